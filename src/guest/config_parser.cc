@@ -6,67 +6,382 @@
  *
  */
 #include <assert.h>
+#include <sys/stat.h>
 #include <iostream>
 #include <sstream>
 #include <fstream>
 #include <map>
 #include <vector>
 #include <string_view>
+#include <charconv>
+#include <cctype>
 
 #include <boost/filesystem.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/property_tree/ini_parser.hpp>
 
 #include "guest/config_parser.h"
+#include "guest/vsock_cid_pool.h"
 #include "utils/log.h"
 
 namespace vm_manager {
 
-using std::map;
-using std::vector;
-using std::string_view;
 using boost::property_tree::ptree;
 
-map<string_view, vector<string_view>> kConfigMap = {
-    { kGroupGlob,    { kGlobName, kGlobFlashfiles, kGlobCid, kGlobWaitReady } },
-    { kGroupEmul,    { kEmulType, kEmulPath } },
-    { kGroupMem,     { kMemSize } },
-    { kGroupVcpu,    { kVcpuNum } },
-    { kGroupFirm,    { kFirmType, kFirmPath, kFirmCode, kFirmVars } },
-    { kGroupDisk,    { kDiskSize, kDiskPath } },
-    { kGroupVgpu,    { kVgpuType, kVgpuGvtgVer, kVgpuUuid, kVgpuMonId, kVgpuOutputs } },
-    { kGroupDisplay, { kDispOptions } },
-    { kGroupNet,     { kNetModel, kNetAdbPort, kNetFastbootPort } },
-    { kGroupVtpm,    { kVtpmBinPath, kVtpmDataDir } },
-    { kGroupRpmb,    { kRpmbBinPath, kRpmbDataDir } },
-    { kGroupAaf,     { kAafPath, kAafSuspend, kAafAudioType }},
-    { kGroupPciPt,   { kPciPtDev }},
-    { kGroupbluetooth, { kHciDown }},
-    { kGroupAudio,   { kDisableEmul } },
-    { kGroupMed,     { kMedBattery, kMedThermal, kMedCamera } },
-    { kGroupService, { kServTimeKeep, kServPmCtrl, kServVinput } },
-    { kGroupExtra,   { kExtraCmd, kExtraService, kExtraPwrCtrlMultiOS } }
+namespace {
+
+struct CivCfgField;
+using CivCfgDecoder = bool (*)(const CivCfgField &f, const std::string &raw, CivVmConfig *c, std::string *err);
+
+/* One entry of the config schema, integers are checked against [min, max] */
+struct CivCfgField {
+    const char *group;
+    const char *key;
+    bool required;
+    uint64_t min;
+    uint64_t max;
+    bool (*check)(const std::string &v);
+    CivCfgDecoder decode;
 };
 
-bool CivConfig::SanitizeOpts(void) {
-    for (auto& section : cfg_data_) {
-        auto group = kConfigMap.find(section.first);
-        if (group != kConfigMap.end()) {
-            for (auto& subsec : section.second) {
-                auto key = std::find(group->second.begin(), group->second.end(), subsec.first);
-                if (key == group->second.end()) {
-                    LOG(error) << "Invalid key: " << section.first << "." << subsec.first << "\n";
-                    return false;
-                }
-            }
+bool ParseValue(const CivCfgField &f, const std::string &raw, std::string *v, std::string *err) {
+    if (!raw.empty() && f.check && !f.check(raw)) {
+        *err = "invalid value '" + raw + "'";
+        return false;
+    }
+    *v = raw;
+    return true;
+}
+
+bool ParseUint(const CivCfgField &f, const std::string &raw, uint64_t *v, std::string *err) {
+    *v = 0;
+    if (raw.empty())
+        return true;
+    const char *end = raw.data() + raw.size();
+    auto [ptr, ec] = std::from_chars(raw.data(), end, *v);
+    if ((ec != std::errc()) || (ptr != end) || (*v < f.min) || (*v > f.max)) {
+        *err = "'" + raw + "' is not an integer in [" + std::to_string(f.min) + ", " + std::to_string(f.max) + "]";
+        return false;
+    }
+    return true;
+}
+
+bool ParseValue(const CivCfgField &f, const std::string &raw, uint32_t *v, std::string *err) {
+    uint64_t n;
+    if (!ParseUint(f, raw, &n, err))
+        return false;
+    *v = static_cast<uint32_t>(n);
+    return true;
+}
+
+bool ParseValue(const CivCfgField &f, const std::string &raw, uint16_t *v, std::string *err) {
+    uint64_t n;
+    if (!ParseUint(f, raw, &n, err))
+        return false;
+    *v = static_cast<uint16_t>(n);
+    return true;
+}
+
+bool ParseValue(const CivCfgField &f, const std::string &raw, bool *v, std::string *err) {
+    if (raw.empty() || (raw == "false") || (raw == "disable") || (raw == "0")) {
+        *v = false;
+    } else if ((raw == "true") || (raw == "enable") || (raw == "1")) {
+        *v = true;
+    } else {
+        *err = "'" + raw + "' is not a boolean";
+        return false;
+    }
+    return true;
+}
+
+template <auto Group, auto Member>
+bool Decode(const CivCfgField &f, const std::string &raw, CivVmConfig *c, std::string *err) {
+    return ParseValue(f, raw, &((c->*Group).*Member), err);
+}
+
+/* Memory and disk sizes, in the syntax QEMU takes for them */
+bool IsSize(const std::string &v) {
+    uint64_t bytes;
+    return ParseCivSize(v, 1, &bytes);
+}
+
+bool IsSuspendOpt(const std::string &v) {
+    return (v == "true") || (v == "false") || (v == kSuspendEnable) || (v == kSuspendDisable);
+}
+
+bool IsAioOpt(const std::string &v) {
+    return (v == kDiskAioThreads) || (v == kDiskAioNative) || (v == kDiskAioIoUring);
+}
+
+bool IsFlashModeOpt(const std::string &v) {
+    return (v == kFlashModeAuto) || (v == kFlashModeDirect) || (v == kFlashModeVm);
+}
+
+bool IsDiskFmtOpt(const std::string &v) {
+    return (v == kDiskFmtQcow2) || (v == kDiskFmtRaw);
+}
+
+bool IsPreallocOpt(const std::string &v) {
+    return (v == kDiskPreallocOff) || (v == kDiskPreallocMetadata) || (v == kDiskPreallocFalloc) ||
+           (v == kDiskPreallocFull);
+}
+
+bool IsCacheOpt(const std::string &v) {
+    return (v == kDiskCacheNone) || (v == kDiskCacheWriteback) || (v == kDiskCacheWritethrough) ||
+           (v == kDiskCacheDirectsync) || (v == kDiskCacheUnsafe);
+}
+
+bool IsRestartOpt(const std::string &v) {
+    return (v == kRestartNeverOpt) || (v == kRestartOnFailureOpt) || (v == kRestartAlwaysOpt);
+}
+
+bool IsProbeOpt(const std::string &v) {
+    size_t colon = v.find(':');
+    if ((colon == std::string::npos) || (colon + 1 == v.size()))
+        return false;
+    std::string kind = v.substr(0, colon);
+    return (kind == kProbeSocket) || (kind == kProbeFile) || (kind == kProbeLog);
+}
+
+bool IsServiceOpt(const std::string &v) {
+    CivService svc;
+    std::string err;
+    return ParseCivService(v, &svc, &err);
+}
+
+/* Services separated by ';' */
+bool IsServiceListOpt(const std::string &v) {
+    std::vector<std::string> entries;
+    boost::split(entries, v, boost::is_any_of(";"));
+    for (auto &e : entries) {
+        if (!boost::trim_copy(e).empty() && !IsServiceOpt(e))
+            return false;
+    }
+    return true;
+}
+
+using C = CivVmConfig;
+
+constexpr uint64_t kMaxVcpu = 1024U;
+constexpr uint64_t kMaxPort = 65535U;
+/* VIRTIO_QUEUE_MAX of QEMU */
+constexpr uint64_t kMaxDiskQueues = 1024U;
+/* Scanouts of a virtio-gpu device */
+constexpr uint64_t kMaxVgpuOutputs = 16U;
+
+constexpr CivCfgField kCivCfgSchema[] = {
+    { kGroupGlob, kGlobName, true, 0, 0, nullptr, Decode<&C::glob, &C::Global::name> },
+    { kGroupGlob, kGlobFlashfiles, false, 0, 0, nullptr, Decode<&C::glob, &C::Global::flashfiles> },
+    { kGroupGlob, kGlobCid, false, 3, kCivMaxCidNum - 1, nullptr, Decode<&C::glob, &C::Global::vsock_cid> },
+    { kGroupGlob, kGlobWaitReady, false, 0, 0, nullptr, Decode<&C::glob, &C::Global::wait_ready> },
+    { kGroupGlob, kGlobFlashMode, false, 0, 0, IsFlashModeOpt, Decode<&C::glob, &C::Global::flash_mode> },
+
+    { kGroupEmul, kEmulType, false, 0, 0, nullptr, Decode<&C::emul, &C::Emulator::type> },
+    { kGroupEmul, kEmulPath, false, 0, 0, nullptr, Decode<&C::emul, &C::Emulator::path> },
+
+    { kGroupMem, kMemSize, false, 0, 0, IsSize, Decode<&C::mem, &C::Memory::size> },
+
+    { kGroupVcpu, kVcpuNum, false, 1, kMaxVcpu, nullptr, Decode<&C::vcpu, &C::Vcpu::num> },
+
+    { kGroupFirm, kFirmType, false, 0, 0, nullptr, Decode<&C::firm, &C::Firmware::type> },
+    { kGroupFirm, kFirmPath, false, 0, 0, nullptr, Decode<&C::firm, &C::Firmware::path> },
+    { kGroupFirm, kFirmCode, false, 0, 0, nullptr, Decode<&C::firm, &C::Firmware::code> },
+    { kGroupFirm, kFirmVars, false, 0, 0, nullptr, Decode<&C::firm, &C::Firmware::vars> },
+
+    { kGroupDisk, kDiskSize, false, 0, 0, IsSize, Decode<&C::disk, &C::Disk::size> },
+    { kGroupDisk, kDiskPath, false, 0, 0, nullptr, Decode<&C::disk, &C::Disk::path> },
+    { kGroupDisk, kDiskSystemImage, false, 0, 0, nullptr, Decode<&C::disk, &C::Disk::system_image> },
+    { kGroupDisk, kDiskExtraPaths, false, 0, 0, nullptr, Decode<&C::disk, &C::Disk::extra_paths> },
+    { kGroupDisk, kDiskAio, false, 0, 0, IsAioOpt, Decode<&C::disk, &C::Disk::aio> },
+    { kGroupDisk, kDiskCache, false, 0, 0, IsCacheOpt, Decode<&C::disk, &C::Disk::cache> },
+    { kGroupDisk, kDiskIothread, false, 0, 0, nullptr, Decode<&C::disk, &C::Disk::iothread> },
+    { kGroupDisk, kDiskQueues, false, 1, kMaxDiskQueues, nullptr, Decode<&C::disk, &C::Disk::queues> },
+    { kGroupDisk, kDiskSnapshot, false, 0, 0, nullptr, Decode<&C::disk, &C::Disk::snapshot> },
+    { kGroupDisk, kDiskFormat, false, 0, 0, IsDiskFmtOpt, Decode<&C::disk, &C::Disk::format> },
+    { kGroupDisk, kDiskPrealloc, false, 0, 0, IsPreallocOpt, Decode<&C::disk, &C::Disk::preallocation> },
+    { kGroupDisk, kDiskClusterSize, false, 0, 0, IsSize, Decode<&C::disk, &C::Disk::cluster_size> },
+    { kGroupDisk, kDiskExtendedL2, false, 0, 0, nullptr, Decode<&C::disk, &C::Disk::extended_l2> },
+    { kGroupDisk, kDiskLazyRefcounts, false, 0, 0, nullptr, Decode<&C::disk, &C::Disk::lazy_refcounts> },
+
+    { kGroupVgpu, kVgpuType, false, 0, 0, nullptr, Decode<&C::vgpu, &C::Graphics::type> },
+    { kGroupVgpu, kVgpuGvtgVer, false, 0, 0, nullptr, Decode<&C::vgpu, &C::Graphics::gvtg_version> },
+    { kGroupVgpu, kVgpuUuid, false, 0, 0, nullptr, Decode<&C::vgpu, &C::Graphics::vgpu_uuid> },
+    { kGroupVgpu, kVgpuMonId, false, 0, 0, nullptr, Decode<&C::vgpu, &C::Graphics::monitor> },
+    { kGroupVgpu, kVgpuOutputs, false, 1, kMaxVgpuOutputs, nullptr, Decode<&C::vgpu, &C::Graphics::outputs> },
+
+    { kGroupDisplay, kDispOptions, false, 0, 0, nullptr, Decode<&C::disp, &C::Display::options> },
+
+    { kGroupNet, kNetModel, false, 0, 0, nullptr, Decode<&C::net, &C::Net::model> },
+    { kGroupNet, kNetAdbPort, false, 1, kMaxPort, nullptr, Decode<&C::net, &C::Net::adb_port> },
+    { kGroupNet, kNetFastbootPort, false, 1, kMaxPort, nullptr, Decode<&C::net, &C::Net::fastboot_port> },
+
+    { kGroupVtpm, kVtpmBinPath, false, 0, 0, nullptr, Decode<&C::vtpm, &C::Vtpm::bin_path> },
+    { kGroupVtpm, kVtpmDataDir, false, 0, 0, nullptr, Decode<&C::vtpm, &C::Vtpm::data_dir> },
+
+    { kGroupRpmb, kRpmbBinPath, false, 0, 0, nullptr, Decode<&C::rpmb, &C::Rpmb::bin_path> },
+    { kGroupRpmb, kRpmbDataDir, false, 0, 0, nullptr, Decode<&C::rpmb, &C::Rpmb::data_dir> },
+
+    { kGroupAaf, kAafPath, false, 0, 0, nullptr, Decode<&C::aaf, &C::Aaf::path> },
+    { kGroupAaf, kAafSuspend, false, 0, 0, IsSuspendOpt, Decode<&C::aaf, &C::Aaf::support_suspend> },
+    { kGroupAaf, kAafAudioType, false, 0, 0, nullptr, Decode<&C::aaf, &C::Aaf::audio_type> },
+
+    { kGroupPciPt, kPciPtDev, false, 0, 0, nullptr, Decode<&C::pt, &C::Passthrough::pci> },
+
+    { kGroupbluetooth, kHciDown, false, 0, 0, nullptr, Decode<&C::bt, &C::Bluetooth::hci_down> },
+
+    { kGroupAudio, kDisableEmul, false, 0, 0, nullptr, Decode<&C::audio, &C::Audio::disable_emulation> },
+
+    { kGroupMed, kMedBattery, false, 0, 0, IsServiceOpt, Decode<&C::med, &C::Mediation::battery> },
+    { kGroupMed, kMedThermal, false, 0, 0, IsServiceOpt, Decode<&C::med, &C::Mediation::thermal> },
+    { kGroupMed, kMedCamera, false, 0, 0, nullptr, Decode<&C::med, &C::Mediation::camera> },
+
+    { kGroupService, kServTimeKeep, false, 0, 0, IsServiceOpt, Decode<&C::serv, &C::GuestControl::time_keep> },
+    { kGroupService, kServPmCtrl, false, 0, 0, IsServiceOpt, Decode<&C::serv, &C::GuestControl::pm_control> },
+    { kGroupService, kServVinput, false, 0, 0, IsServiceOpt, Decode<&C::serv, &C::GuestControl::vinput> },
+    { kGroupService, kServCoProcRestart, false, 0, 0, IsRestartOpt,
+      Decode<&C::serv, &C::GuestControl::coproc_restart> },
+
+    { kGroupExtra, kExtraCmd, false, 0, 0, nullptr, Decode<&C::extra, &C::Extra::cmd> },
+    { kGroupExtra, kExtraService, false, 0, 0, IsServiceListOpt, Decode<&C::extra, &C::Extra::service> },
+    { kGroupExtra, kExtraPwrCtrlMultiOS, false, 0, 0, nullptr, Decode<&C::extra, &C::Extra::pwr_ctrl_multios> },
+};
+
+constexpr bool IsKnownGroup(std::string_view group) {
+    for (auto &f : kCivCfgSchema) {
+        if (group == f.group)
+            return true;
+    }
+    return false;
+}
+
+constexpr bool IsKnownKey(std::string_view group, std::string_view key) {
+    for (auto &f : kCivCfgSchema) {
+        if ((group == f.group) && (key == f.key))
+            return true;
+    }
+    return false;
+}
+
+}  // namespace
+
+bool ParseCivSize(const std::string &v, uint64_t unit, uint64_t *bytes) {
+    if (v.empty() || !isdigit(static_cast<unsigned char>(v[0])))
+        return false;
+
+    bool hex = (v.size() > 2) && (v[0] == '0') && (tolower(v[1]) == 'x');
+    size_t end = 0;
+    uint64_t n = 0;
+    try {
+        n = std::stoull(v, &end, hex ? 16 : 10);
+    } catch (std::exception &e) {
+        return false;
+    }
+
+    /* Only decimal values may have a fraction, as in QEMU */
+    double frac = 0;
+    if (!hex && (end < v.size()) && (v[end] == '.')) {
+        size_t stop = v.find_first_not_of("0123456789", end + 1);
+        if (stop == end + 1)
+            return false;
+        if (stop == std::string::npos)
+            stop = v.size();
+        frac = std::stod("0" + v.substr(end, stop - end));
+        end = stop;
+    }
+
+    if (end < v.size()) {
+        if (end != v.size() - 1)
+            return false;
+        size_t shift = std::string_view("BKMGTPE").find(toupper(v.back()));
+        if (shift == std::string_view::npos)
+            return false;
+        unit = uint64_t(1) << (10 * shift);
+    }
+
+    if (n > UINT64_MAX / unit)
+        return false;
+    uint64_t part = static_cast<uint64_t>(frac * unit);
+    if (part > UINT64_MAX - n * unit)
+        return false;
+    *bytes = n * unit + part;
+    return true;
+}
+
+bool ParseCivService(const std::string &entry, CivService *out, std::string *err) {
+    std::vector<std::string> parts;
+    boost::split(parts, entry, boost::is_any_of(kServiceOptSep));
+    *out = CivService();
+    out->cmd = boost::trim_copy(parts[0]);
+    if (out->cmd.empty()) {
+        *err = "no command";
+        return false;
+    }
+    for (auto it = parts.begin() + 1; it != parts.end(); ++it) {
+        size_t eq = it->find('=');
+        std::string key = boost::trim_copy(it->substr(0, eq));
+        std::string val = (eq == std::string::npos) ? "" : boost::trim_copy(it->substr(eq + 1));
+        if ((key == kServiceOptRestart) && IsRestartOpt(val)) {
+            out->restart = val;
+        } else if ((key == kServiceOptProbe) && IsProbeOpt(val)) {
+            out->probe = val;
         } else {
-            LOG(error) << "Invalid group: " << section.first << "\n";
+            *err = "invalid option '" + boost::trim_copy(*it) + "'";
             return false;
         }
     }
     return true;
 }
 
+std::vector<std::string> CivDiskPaths(const CivVmConfig &cfg) {
+    std::vector<std::string> paths;
+    if (!cfg.disk.path.empty())
+        paths.push_back(cfg.disk.path);
+    std::vector<std::string> extra;
+    boost::split(extra, cfg.disk.extra_paths, boost::is_any_of(","));
+    for (auto &p : extra) {
+        boost::trim(p);
+        if (!p.empty())
+            paths.push_back(p);
+    }
+    return paths;
+}
+
+bool CivConfig::SanitizeOpts(void) const {
+    bool ret = true;
+    for (auto& section : cfg_data_) {
+        if (!IsKnownGroup(section.first)) {
+            LOG(error) << "Invalid group: " << section.first << "\n";
+            ret = false;
+            continue;
+        }
+        for (auto& subsec : section.second) {
+            if (!IsKnownKey(section.first, subsec.first)) {
+                LOG(error) << "Invalid key: " << section.first << "." << subsec.first << "\n";
+                ret = false;
+            }
+        }
+    }
+    return ret;
+}
+
+bool CivConfig::Decode(CivVmConfig *out, std::vector<std::string> *errors) const {
+    *out = CivVmConfig();
+    size_t err_num = errors->size();
+
+    for (auto &f : kCivCfgSchema) {
+        std::string raw = GetValue(f.group, f.key);
+        if (raw.empty() && f.required) {
+            errors->push_back(std::string(f.group) + "." + f.key + " is required");
+            continue;
+        }
+        std::string err;
+        if (!f.decode(f, raw, out, &err))
+            errors->push_back(std::string(f.group) + "." + f.key + ": " + err);
+    }
+
+    return errors->size() == err_num;
+}
+
 bool CivConfig::ReadConfigFile(std::string path) {
     boost::system::error_code ec;
     if (!boost::filesystem::exists(path, ec)) {
@@ -114,15 +429,17 @@ bool CivConfig::WriteConfigFile(std::string path) {
     return true;
 }
 
-std::string CivConfig::GetValue(std::string group, std::string key) {
-    try {
-        std::string val = cfg_data_.get<std::string>(group + "." + key);
-        boost::trim(val);
-        return val;
-    } catch(const std::exception& e) {
-        LOG(warning) << e.what();
+std::string CivConfig::GetValue(std::string group, std::string key) const {
+    auto g = cfg_data_.find(group);
+    if (g == cfg_data_.not_found())
         return std::string();
-    }
+    auto k = g->second.find(key);
+    if (k == g->second.not_found())
+        return std::string();
+
+    std::string val = k->second.data();
+    boost::trim(val);
+    return val;
 }
 
 bool CivConfig::SetValue(const std::string group, const std::string key, const std::string value) {
@@ -137,5 +454,76 @@ bool CivConfig::SetValue(const std::string group, const std::string key, const s
     return true;
 }
 
+void CivConfig::ClearValue(const std::string group, const std::string key) {
+    auto g = cfg_data_.find(group);
+    if (g != cfg_data_.not_found())
+        g->second.erase(key);
+}
+
+bool CivConfigCache::Lookup(const std::string &path, Entry *e) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+        LOG(error) << "File not exists: " << path << std::endl;
+        return false;
+    }
+
+    auto match = [&st](const Entry &e) {
+        return (e.dev == st.st_dev) && (e.ino == st.st_ino) && (e.size == st.st_size) &&
+               (e.mtime.tv_sec == st.st_mtim.tv_sec) && (e.mtime.tv_nsec == st.st_mtim.tv_nsec);
+    };
+
+    {
+        std::scoped_lock lock(mutex_);
+        auto it = entries_.find(path);
+        if ((it != entries_.end()) && match(it->second)) {
+            *e = it->second;
+            return true;
+        }
+    }
+
+    CivConfig parsed;
+    if (!parsed.ReadConfigFile(path)) {
+        Invalidate(path);
+        return false;
+    }
+
+    Entry ne{st.st_dev, st.st_ino, st.st_size, st.st_mtim, std::move(parsed), false, CivVmConfig()};
+    std::vector<std::string> errors;
+    ne.decoded = ne.cfg.Decode(&ne.vm, &errors);
+    for (auto &err : errors)
+        LOG(error) << path << ": " << err;
+
+    std::scoped_lock lock(mutex_);
+    entries_[path] = ne;
+    *e = std::move(ne);
+    return true;
+}
+
+bool CivConfigCache::Read(const std::string &path, CivConfig *cfg) {
+    Entry e;
+    if (!Lookup(path, &e))
+        return false;
+    *cfg = std::move(e.cfg);
+    return true;
+}
+
+bool CivConfigCache::Read(const std::string &path, CivVmConfig *cfg) {
+    Entry e;
+    if (!Lookup(path, &e) || !e.decoded)
+        return false;
+    *cfg = std::move(e.vm);
+    return true;
+}
+
+void CivConfigCache::Invalidate(const std::string &path) {
+    std::scoped_lock lock(mutex_);
+    entries_.erase(path);
+}
+
+CivConfigCache &CivConfigCache::Cache(void) {
+    static CivConfigCache cache_;
+    return cache_;
+}
+
 }  // namespace vm_manager
 
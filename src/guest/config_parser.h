@@ -8,7 +8,14 @@
 #ifndef SRC_GUEST_CONFIG_PARSER_H_
 #define SRC_GUEST_CONFIG_PARSER_H_
 
+#include <sys/types.h>
+#include <time.h>
+
+#include <cstdint>
 #include <string>
+#include <vector>
+#include <map>
+#include <mutex>
 
 #include <boost/property_tree/ptree.hpp>
 
@@ -39,6 +46,7 @@ constexpr char kGlobName[]       = "name";
 constexpr char kGlobFlashfiles[] = "flashfiles";
 constexpr char kGlobCid[]        = "vsock_cid";
 constexpr char kGlobWaitReady[]  = "wait_ready";
+constexpr char kGlobFlashMode[]  = "flash_mode";
 
 constexpr char kEmulType[] = "type";
 constexpr char kEmulPath[] = "path";
@@ -54,6 +62,18 @@ constexpr char kFirmVars[] = "vars";
 
 constexpr char kDiskSize[] = "size";
 constexpr char kDiskPath[] = "path";
+constexpr char kDiskSystemImage[] = "system_image";
+constexpr char kDiskExtraPaths[] = "extra_paths";
+constexpr char kDiskAio[] = "aio";
+constexpr char kDiskCache[] = "cache";
+constexpr char kDiskIothread[] = "iothread";
+constexpr char kDiskQueues[] = "queues";
+constexpr char kDiskSnapshot[] = "snapshot";
+constexpr char kDiskFormat[] = "format";
+constexpr char kDiskPrealloc[] = "preallocation";
+constexpr char kDiskClusterSize[] = "cluster_size";
+constexpr char kDiskExtendedL2[] = "extended_l2";
+constexpr char kDiskLazyRefcounts[] = "lazy_refcounts";
 
 constexpr char kVgpuType[]    = "type";
 constexpr char kVgpuGvtgVer[] = "gvtg_version";
@@ -90,6 +110,7 @@ constexpr char kMedCamera[] = "camera_med";
 constexpr char kServTimeKeep[] = "time_keep";
 constexpr char kServPmCtrl[]   = "pm_control";
 constexpr char kServVinput[]   = "vinput";
+constexpr char kServCoProcRestart[] = "coproc_restart";
 
 constexpr char kExtraCmd[]     = "cmd";
 constexpr char kExtraService[] = "service";
@@ -117,18 +138,218 @@ constexpr char kGvtgV58[] = "i915-GVTg_V5_8";
 constexpr char kSuspendEnable[]  = "enable";
 constexpr char kSuspendDisable[] = "disable";
 
+constexpr char kDiskAioThreads[] = "threads";
+constexpr char kDiskAioNative[]  = "native";
+constexpr char kDiskAioIoUring[] = "io_uring";
+
+constexpr char kFlashModeAuto[]   = "auto";
+constexpr char kFlashModeDirect[] = "direct";
+constexpr char kFlashModeVm[]     = "vm";
+
+constexpr char kDiskFmtQcow2[] = "qcow2";
+constexpr char kDiskFmtRaw[]   = "raw";
+
+constexpr char kDiskPreallocOff[]      = "off";
+constexpr char kDiskPreallocMetadata[] = "metadata";
+constexpr char kDiskPreallocFalloc[]   = "falloc";
+constexpr char kDiskPreallocFull[]     = "full";
+
+constexpr char kDiskCacheNone[]         = "none";
+constexpr char kDiskCacheWriteback[]    = "writeback";
+constexpr char kDiskCacheWritethrough[] = "writethrough";
+constexpr char kDiskCacheDirectsync[]   = "directsync";
+constexpr char kDiskCacheUnsafe[]       = "unsafe";
+
+constexpr char kRestartNeverOpt[]     = "never";
+constexpr char kRestartOnFailureOpt[] = "on-failure";
+constexpr char kRestartAlwaysOpt[]    = "always";
+
+/* Options after the command of a service */
+constexpr char kServiceOptSep[]     = "|";
+constexpr char kServiceOptRestart[] = "restart";
+constexpr char kServiceOptProbe[]   = "probe";
+
+/* Kinds of probe=<kind>:<target> */
+constexpr char kProbeSocket[] = "socket";
+constexpr char kProbeFile[]   = "file";
+constexpr char kProbeLog[]    = "log";
+
+
+/*
+ * Typed view of a config file, decoded in one pass by CivConfig::Decode.
+ * Numbers are 0 and strings are empty when the key is not set.
+ */
+struct CivVmConfig {
+  struct Global {
+    std::string name;
+    std::string flashfiles;
+    uint32_t vsock_cid = 0;
+    bool wait_ready = false;
+    std::string flash_mode;
+  } glob;
+  struct Emulator {
+    std::string type;
+    std::string path;
+  } emul;
+  struct Memory {
+    std::string size;
+  } mem;
+  struct Vcpu {
+    uint32_t num = 0;
+  } vcpu;
+  struct Firmware {
+    std::string type;
+    std::string path;
+    std::string code;
+    std::string vars;
+  } firm;
+  struct Disk {
+    std::string size;
+    std::string path;
+    std::string system_image;
+    /* Comma separated, attached after the boot disk */
+    std::string extra_paths;
+    std::string aio;
+    std::string cache;
+    bool iothread = false;
+    uint32_t queues = 0;
+    /* Writes go to a temporary overlay dropped when the guest exits */
+    bool snapshot = false;
+    /* How the flasher creates the image at path */
+    std::string format;
+    std::string preallocation;
+    std::string cluster_size;
+    bool extended_l2 = false;
+    bool lazy_refcounts = false;
+  } disk;
+  struct Graphics {
+    std::string type;
+    std::string gvtg_version;
+    std::string vgpu_uuid;
+    std::string monitor;
+    uint32_t outputs = 0;
+  } vgpu;
+  struct Display {
+    std::string options;
+  } disp;
+  struct Net {
+    std::string model;
+    uint16_t adb_port = 0;
+    uint16_t fastboot_port = 0;
+  } net;
+  struct Vtpm {
+    std::string bin_path;
+    std::string data_dir;
+  } vtpm;
+  struct Rpmb {
+    std::string bin_path;
+    std::string data_dir;
+  } rpmb;
+  struct Aaf {
+    std::string path;
+    std::string support_suspend;
+    std::string audio_type;
+  } aaf;
+  struct Passthrough {
+    std::string pci;
+  } pt;
+  struct Bluetooth {
+    bool hci_down = false;
+  } bt;
+  struct Audio {
+    bool disable_emulation = false;
+  } audio;
+  struct Mediation {
+    std::string battery;
+    std::string thermal;
+    std::string camera;
+  } med;
+  struct GuestControl {
+    std::string time_keep;
+    std::string pm_control;
+    std::string vinput;
+    std::string coproc_restart;
+  } serv;
+  struct Extra {
+    std::string cmd;
+    std::string service;
+    bool pwr_ctrl_multios = false;
+  } extra;
+};
+
+/* The boot disk followed by the extra disks */
+std::vector<std::string> CivDiskPaths(const CivVmConfig &cfg);
+
+/* A co-process entry, "<command>[ | restart=<policy>][ | probe=<kind>:<target>]" */
+struct CivService {
+  std::string cmd;
+  /* Empty to follow [guest_control] coproc_restart */
+  std::string restart;
+  /* Empty if the service is ready once spawned */
+  std::string probe;
+};
+
+/*
+ * Sizes take QEMU's syntax: a decimal number, optionally with a fraction, or
+ * a 0x hex number, followed by an optional B/K/M/G/T/P/E suffix. unit is the
+ * multiplier when there is no suffix, bytes for disks and MiB for memory.
+ */
+bool ParseCivSize(const std::string &v, uint64_t unit, uint64_t *bytes);
+
+/* err says what is wrong with entry */
+bool ParseCivService(const std::string &entry, CivService *out, std::string *err);
 
 class CivConfig final {
  public:
-  std::string GetValue(const std::string group, const std::string key);
+  /* Fill out with typed values, all errors are collected before returning false */
+  bool Decode(CivVmConfig *out, std::vector<std::string> *errors) const;
+  /* Returns empty string if the key is not set */
+  std::string GetValue(const std::string group, const std::string key) const;
   bool SetValue(const std::string group, const std::string key, const std::string value);
+  void ClearValue(const std::string group, const std::string key);
   bool ReadConfigFile(const std::string path);
   bool WriteConfigFile(std::string path);
  private:
-  bool SanitizeOpts(void);
+  bool SanitizeOpts(void) const;
   boost::property_tree::ptree cfg_data_;
 };
 
+/*
+ * Parsed and sanitized configs, keyed by path and validated against the
+ * device, inode, size and mtime of the file so an edited or replaced file is
+ * parsed again.
+ */
+class CivConfigCache final {
+ public:
+  bool Read(const std::string &path, CivConfig *cfg);
+  /* Decoded view of the same entry, decode errors are logged once per file version */
+  bool Read(const std::string &path, CivVmConfig *cfg);
+  void Invalidate(const std::string &path);
+
+  static CivConfigCache &Cache(void);
+
+ private:
+  CivConfigCache() = default;
+  ~CivConfigCache() = default;
+  CivConfigCache(const CivConfigCache &) = delete;
+  CivConfigCache& operator=(const CivConfigCache&) = delete;
+
+  struct Entry {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    CivConfig cfg;
+    bool decoded;
+    CivVmConfig vm;
+  };
+
+  bool Lookup(const std::string &path, Entry *e);
+
+  std::map<std::string, Entry> entries_;
+  std::mutex mutex_;
+};
+
 }  // namespace vm_manager
 
 #endif  // SRC_GUEST_CONFIG_PARSER_H_
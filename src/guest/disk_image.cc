@@ -0,0 +1,181 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include <sys/stat.h>
+
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/process.hpp>
+
+#include "guest/disk_image.h"
+#include "utils/log.h"
+#include "utils/utils.h"
+
+namespace vm_manager {
+
+std::string DiskImageFormat(const CivVmConfig::Disk &disk) {
+    return disk.format.empty() ? kDiskFmtQcow2 : disk.format;
+}
+
+bool DiskImageOpts(const CivVmConfig::Disk &disk, std::string *out) {
+    std::vector<std::string> opts;
+
+    if (DiskImageFormat(disk) == kDiskFmtRaw) {
+        if (!disk.cluster_size.empty() || disk.extended_l2 || disk.lazy_refcounts) {
+            LOG(error) << "cluster_size, extended_l2 and lazy_refcounts only apply to qcow2 disks";
+            return false;
+        }
+        if (disk.preallocation == kDiskPreallocMetadata) {
+            LOG(error) << "preallocation=metadata only applies to qcow2 disks";
+            return false;
+        }
+    }
+
+    if (!disk.preallocation.empty())
+        opts.push_back("preallocation=" + disk.preallocation);
+    if (!disk.cluster_size.empty())
+        opts.push_back("cluster_size=" + disk.cluster_size);
+    if (disk.extended_l2)
+        opts.push_back("extended_l2=on");
+    if (disk.lazy_refcounts)
+        opts.push_back("lazy_refcounts=on");
+
+    out->clear();
+    for (size_t i = 0; i < opts.size(); i++)
+        *out += ((i == 0) ? "-o " : ",") + opts[i];
+    return true;
+}
+
+bool ParseDiskSize(const std::string &size, uint64_t *bytes) {
+    return ParseCivSize(size, 1, bytes);
+}
+
+bool CreateDiskImage(const CivVmConfig::Disk &disk, const std::string &path) {
+    std::string opts;
+    if (!DiskImageOpts(disk, &opts))
+        return false;
+
+    std::string cmd("qemu-img create -f " + DiskImageFormat(disk) + " " + opts + " " + path + " " + disk.size);
+    LOG(info) << cmd;
+    if (boost::process::system(cmd)) {
+        LOG(error) << "Failed to : " << cmd;
+        return false;
+    }
+    return true;
+}
+
+namespace {
+
+struct BenchProfile {
+    const char *format;
+    const char *preallocation;
+    const char *cluster_size;
+    bool extended_l2;
+    bool lazy_refcounts;
+};
+
+const BenchProfile kBenchProfiles[] = {
+    { kDiskFmtRaw,   kDiskPreallocOff,      "",     false, false },
+    { kDiskFmtRaw,   kDiskPreallocFalloc,   "",     false, false },
+    { kDiskFmtRaw,   kDiskPreallocFull,     "",     false, false },
+    { kDiskFmtQcow2, kDiskPreallocOff,      "",     false, false },
+    { kDiskFmtQcow2, kDiskPreallocOff,      "",     false, true },
+    { kDiskFmtQcow2, kDiskPreallocOff,      "2M",   false, false },
+    { kDiskFmtQcow2, kDiskPreallocOff,      "128K", true,  false },
+    { kDiskFmtQcow2, kDiskPreallocMetadata, "",     false, false },
+    { kDiskFmtQcow2, kDiskPreallocFalloc,   "",     false, false },
+    { kDiskFmtQcow2, kDiskPreallocFull,     "",     false, false },
+};
+
+/* Sequential writes the size of a flashed partition chunk */
+constexpr uint64_t kBenchBlock = 64_KB;
+
+std::string ProfileName(const BenchProfile &p) {
+    std::string name = std::string(p.format) + "," + p.preallocation;
+    if (*p.cluster_size)
+        name += ",cluster=" + std::string(p.cluster_size);
+    if (p.extended_l2)
+        name += ",l2ext";
+    if (p.lazy_refcounts)
+        name += ",lazyref";
+    return name;
+}
+
+/* Seconds the command ran, negative if it failed */
+double TimeCmd(const std::string &cmd) {
+    auto start = std::chrono::steady_clock::now();
+    if (boost::process::system(cmd, boost::process::std_out > boost::process::null)) {
+        LOG(error) << "Failed to : " << cmd;
+        return -1;
+    }
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+}  // namespace
+
+bool BenchDiskImages(const std::string &dir, unsigned int size_mb) {
+    boost::system::error_code ec;
+    if (!boost::filesystem::is_directory(dir, ec)) {
+        LOG(error) << "Not a directory: " << dir;
+        return false;
+    }
+    if (size_mb == 0)
+        return false;
+
+    std::string img = dir + "/vm-manager-bench.img";
+    uint64_t count = size_mb * 1_MB / kBenchBlock;
+    double mb = static_cast<double>(size_mb);
+
+    std::cout << std::left << std::setw(36) << "profile" << std::right
+              << std::setw(10) << "create(s)" << std::setw(14) << "write(MB/s)"
+              << std::setw(16) << "rewrite(MB/s)" << std::setw(16) << "allocated(MB)" << std::endl;
+
+    bool ret = true;
+    for (auto &p : kBenchProfiles) {
+        CivVmConfig::Disk disk;
+        disk.format = p.format;
+        disk.preallocation = p.preallocation;
+        disk.cluster_size = p.cluster_size;
+        disk.extended_l2 = p.extended_l2;
+        disk.lazy_refcounts = p.lazy_refcounts;
+        disk.size = std::to_string(size_mb) + "M";
+
+        boost::filesystem::remove(img, ec);
+        std::string opts;
+        DiskImageOpts(disk, &opts);
+        double create = TimeCmd("qemu-img create -q -f " + std::string(p.format) + " " + opts + " " + img + " " +
+                                disk.size);
+
+        /* Bypass the host page cache, so allocation is paid within the run and not at writeback */
+        std::string bench("qemu-img bench -q -w -t none -n -f " + std::string(p.format) +
+                          " -c " + std::to_string(count) + " -s " + std::to_string(kBenchBlock) + " " + img);
+        double first = (create < 0) ? -1 : TimeCmd(bench);
+        double second = (first < 0) ? -1 : TimeCmd(bench);
+
+        struct stat st;
+        double alloc = (stat(img.c_str(), &st) == 0) ? st.st_blocks * 512.0 / 1_MB : 0;
+
+        std::cout << std::left << std::setw(36) << ProfileName(p) << std::right << std::fixed << std::setprecision(2);
+        if (second < 0) {
+            std::cout << std::setw(10) << "failed" << std::endl;
+            ret = false;
+            continue;
+        }
+        std::cout << std::setw(10) << create << std::setw(14) << mb / first
+                  << std::setw(16) << mb / second << std::setw(16) << alloc << std::endl;
+    }
+    boost::filesystem::remove(img, ec);
+    return ret;
+}
+
+}  // namespace vm_manager
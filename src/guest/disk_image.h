@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef SRC_GUEST_DISK_IMAGE_H_
+#define SRC_GUEST_DISK_IMAGE_H_
+
+#include <cstdint>
+#include <string>
+
+#include "guest/config_parser.h"
+
+namespace vm_manager {
+
+/* Format of the image at [disk] path, qcow2 unless set */
+std::string DiskImageFormat(const CivVmConfig::Disk &disk);
+
+/* The "-o ..." options of qemu-img create/convert for disk, false if they do not apply to its format */
+bool DiskImageOpts(const CivVmConfig::Disk &disk, std::string *opts);
+
+/* A size as accepted by qemu-img, a number without suffix is in bytes */
+bool ParseDiskSize(const std::string &size, uint64_t *bytes);
+
+/* Create the image at path with the size and provisioning options of disk */
+bool CreateDiskImage(const CivVmConfig::Disk &disk, const std::string &path);
+
+/*
+ * Create a scratch image in dir with each provisioning profile, write it
+ * through once and then again, and print the time and throughput of each
+ * pass. The first pass pays for the allocation, the second does not.
+ */
+bool BenchDiskImages(const std::string &dir, unsigned int size_mb);
+
+}  // namespace vm_manager
+
+#endif  // SRC_GUEST_DISK_IMAGE_H_
@@ -0,0 +1,278 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "guest/fat_image.h"
+#include "utils/log.h"
+#include "utils/utils.h"
+
+namespace vm_manager {
+
+namespace {
+
+constexpr uint64_t kSectorSize = 512;
+constexpr uint64_t kClusterSize = 32_KB;
+constexpr uint32_t kReservedSectors = 32;
+constexpr uint32_t kNumFats = 2;
+/* Below this count a FAT is FAT16 whatever the BPB says */
+constexpr uint64_t kMinClusters = 65536;
+constexpr uint64_t kMaxClusters = 0x0ffffff0;
+/* Largest file size FAT32 can record */
+constexpr uint64_t kMaxFileSize = 4_GB - 1;
+
+constexpr uint32_t kFatEnd = 0x0fffffff;
+constexpr size_t kDirEntrySize = 32;
+constexpr size_t kLfnChars = 13;
+constexpr uint8_t kAttrArchive = 0x20;
+constexpr uint8_t kAttrLfn = 0x0f;
+
+uint64_t DivUp(uint64_t a, uint64_t b) {
+    return (a + b - 1) / b;
+}
+
+size_t DirEntries(const std::string &name) {
+    return DivUp(name.size(), kLfnChars) + 1;
+}
+
+/* 8.3 alias "BASE~N  EXT", unique by n, the long name is what the reader uses */
+std::string ShortName(const std::string &name, size_t n) {
+    auto clean = [](std::string s) {
+        std::string out;
+        for (char c : s) {
+            if (std::isalnum(static_cast<unsigned char>(c)) || (c == '-') || (c == '_'))
+                out += static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+        }
+        return out;
+    };
+    size_t dot = name.rfind('.');
+    std::string base = clean(name.substr(0, dot));
+    std::string ext = (dot == std::string::npos) ? "" : clean(name.substr(dot + 1));
+    std::string tail = "~" + std::to_string(n);
+
+    base = base.substr(0, 8 - std::min<size_t>(tail.size(), 7)) + tail;
+    base.resize(8, ' ');
+    ext = ext.substr(0, 3);
+    ext.resize(3, ' ');
+    return base + ext;
+}
+
+uint8_t LfnChecksum(const std::string &short_name) {
+    uint8_t sum = 0;
+    for (char c : short_name)
+        sum = ((sum & 1) << 7) + (sum >> 1) + static_cast<uint8_t>(c);
+    return sum;
+}
+
+void PutLfnChar(uint8_t *e, size_t i, uint16_t c) {
+    static const int kOffsets[kLfnChars] = { 1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30 };
+    Put16(e + kOffsets[i], c);
+}
+
+}  // namespace
+
+FatImage::~FatImage() {
+    Close();
+}
+
+size_t FatImage::AddFile(const std::string &name, uint64_t size) {
+    files_.push_back(File{ pieces_.size(), size });
+    if (size <= kMaxFileSize) {
+        pieces_.push_back(Piece{ name, size, 0 });
+        return files_.size() - 1;
+    }
+    /* Named like split --numeric-suffixes does, the installer joins them back */
+    for (uint64_t i = 0; i * kMaxFileSize < size; i++) {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), ".part%02lu", static_cast<unsigned long>(i));
+        pieces_.push_back(Piece{ name + suffix, std::min(kMaxFileSize, size - i * kMaxFileSize), 0 });
+    }
+    return files_.size() - 1;
+}
+
+uint64_t FatImage::ClusterOffset(uint32_t cluster) const {
+    return data_offset_ + (cluster - 2) * kClusterSize;
+}
+
+std::vector<uint8_t> FatImage::RootDir(void) const {
+    std::vector<uint8_t> dir(root_clusters_ * kClusterSize, 0);
+
+    time_t now = time(nullptr);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    uint16_t dos_date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    uint16_t dos_time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+
+    uint8_t *e = dir.data();
+    for (size_t i = 0; i < pieces_.size(); i++) {
+        const Piece &p = pieces_[i];
+        std::string short_name = ShortName(p.name, i + 1);
+        uint8_t sum = LfnChecksum(short_name);
+
+        /* Long name entries come last part first */
+        size_t lfn = DirEntries(p.name) - 1;
+        for (size_t seq = lfn; seq > 0; seq--, e += kDirEntrySize) {
+            e[0] = seq | ((seq == lfn) ? 0x40 : 0);
+            e[11] = kAttrLfn;
+            e[13] = sum;
+            for (size_t c = 0; c < kLfnChars; c++) {
+                size_t pos = (seq - 1) * kLfnChars + c;
+                uint16_t ch = 0xffff;
+                if (pos < p.name.size())
+                    ch = static_cast<uint8_t>(p.name[pos]) < 0x80 ? p.name[pos] : '_';
+                else if (pos == p.name.size())
+                    ch = 0;
+                PutLfnChar(e, c, ch);
+            }
+        }
+
+        memcpy(e, short_name.data(), 11);
+        e[11] = kAttrArchive;
+        Put16(e + 14, dos_time);
+        Put16(e + 16, dos_date);
+        Put16(e + 18, dos_date);
+        Put16(e + 20, p.cluster >> 16);
+        Put16(e + 22, dos_time);
+        Put16(e + 24, dos_date);
+        Put16(e + 26, p.cluster & 0xffff);
+        Put32(e + 28, static_cast<uint32_t>(p.size));
+        e += kDirEntrySize;
+    }
+    return dir;
+}
+
+bool FatImage::Create(const std::string &path, uint64_t slack) {
+    size_t entries = 1;
+    for (auto &p : pieces_)
+        entries += DirEntries(p.name);
+    root_clusters_ = DivUp(entries * kDirEntrySize, kClusterSize);
+
+    uint64_t next = 2 + root_clusters_;
+    for (auto &p : pieces_) {
+        p.cluster = p.size ? next : 0;
+        next += DivUp(p.size, kClusterSize);
+    }
+    uint64_t clusters = std::max(next - 2 + DivUp(slack, kClusterSize), kMinClusters);
+    if (clusters > kMaxClusters) {
+        LOG(error) << "FAT image: " << clusters << " clusters are too many";
+        return false;
+    }
+    fat_sectors_ = DivUp((clusters + 2) * 4, kSectorSize);
+    uint64_t sectors = kReservedSectors + kNumFats * fat_sectors_ + clusters * (kClusterSize / kSectorSize);
+    data_offset_ = (kReservedSectors + kNumFats * fat_sectors_) * kSectorSize;
+
+    fd_ = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd_ < 0) {
+        LOG(error) << "Cannot create " << path << ": " << strerror(errno);
+        return false;
+    }
+    if (ftruncate(fd_, sectors * kSectorSize) != 0) {
+        LOG(error) << "Cannot size " << path << ": " << strerror(errno);
+        return false;
+    }
+
+    std::vector<uint8_t> boot(kSectorSize, 0);
+    uint8_t *b = boot.data();
+    b[0] = 0xeb;
+    b[1] = 0x58;
+    b[2] = 0x90;
+    memcpy(b + 3, "MSWIN4.1", 8);
+    Put16(b + 11, kSectorSize);
+    b[13] = kClusterSize / kSectorSize;
+    Put16(b + 14, kReservedSectors);
+    b[16] = kNumFats;
+    b[21] = 0xf8;
+    Put16(b + 24, 32);
+    Put16(b + 26, 64);
+    Put32(b + 32, static_cast<uint32_t>(sectors));
+    Put32(b + 36, fat_sectors_);
+    Put32(b + 44, 2);
+    Put16(b + 48, 1);
+    Put16(b + 50, 6);
+    b[64] = 0x80;
+    b[66] = 0x29;
+    Put32(b + 67, std::random_device()());
+    memcpy(b + 71, "NO NAME    ", 11);
+    memcpy(b + 82, "FAT32   ", 8);
+    b[510] = 0x55;
+    b[511] = 0xaa;
+
+    std::vector<uint8_t> fsinfo(kSectorSize, 0);
+    Put32(&fsinfo[0], 0x41615252);
+    Put32(&fsinfo[484], 0x61417272);
+    Put32(&fsinfo[488], static_cast<uint32_t>(clusters - (next - 2)));
+    Put32(&fsinfo[492], static_cast<uint32_t>(next));
+    Put32(&fsinfo[508], 0xaa550000);
+
+    std::vector<uint8_t> fat(fat_sectors_ * kSectorSize, 0);
+    auto chain = [&fat](uint64_t first, uint64_t count) {
+        for (uint64_t c = first; c < first + count; c++)
+            Put32(&fat[c * 4], (c == first + count - 1) ? kFatEnd : c + 1);
+    };
+    Put32(&fat[0], 0x0ffffff8);
+    Put32(&fat[4], kFatEnd);
+    chain(2, root_clusters_);
+    for (auto &p : pieces_) {
+        if (p.size)
+            chain(p.cluster, DivUp(p.size, kClusterSize));
+    }
+
+    auto dir = RootDir();
+    auto put = [this](const std::vector<uint8_t> &v, uint64_t off) {
+        return pwrite(fd_, v.data(), v.size(), off) == static_cast<ssize_t>(v.size());
+    };
+    bool ok = put(boot, 0) && put(fsinfo, kSectorSize) && put(boot, 6 * kSectorSize) &&
+              put(fsinfo, 7 * kSectorSize) && put(dir, ClusterOffset(2));
+    for (uint32_t i = 0; ok && (i < kNumFats); i++)
+        ok = put(fat, (kReservedSectors + i * fat_sectors_) * kSectorSize);
+    if (!ok) {
+        LOG(error) << "Failed to write " << path << ": " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool FatImage::Write(size_t file, uint64_t off, const char *buf, size_t len) {
+    const File &f = files_[file];
+    if (off + len > f.size)
+        return false;
+
+    while (len > 0) {
+        const Piece &p = pieces_[f.first_piece + off / kMaxFileSize];
+        uint64_t in = off % kMaxFileSize;
+        size_t n = std::min<uint64_t>(len, p.size - in);
+        /* The image is sparse, zeroes need no write */
+        if (!IsZero(buf, n) && (pwrite(fd_, buf, n, ClusterOffset(p.cluster) + in) != static_cast<ssize_t>(n))) {
+            LOG(error) << "Failed to write " << p.name << ": " << strerror(errno);
+            return false;
+        }
+        buf += n;
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool FatImage::Close(void) {
+    if (fd_ < 0)
+        return true;
+    int ret = close(fd_);
+    fd_ = -1;
+    return ret == 0;
+}
+
+}  // namespace vm_manager
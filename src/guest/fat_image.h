@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef SRC_GUEST_FAT_IMAGE_H_
+#define SRC_GUEST_FAT_IMAGE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace vm_manager {
+
+/*
+ * FAT32 image holding files in its root directory. All files are declared
+ * first, each one gets contiguous clusters, then the file data is written
+ * in place. The image is sparse, only the tables and the data take space.
+ */
+class FatImage final {
+ public:
+    FatImage() = default;
+    ~FatImage();
+    FatImage(const FatImage&) = delete;
+    FatImage& operator=(const FatImage&) = delete;
+
+    /*
+     * Declare a file, returns its index for Write(). Files over the FAT32
+     * limit are stored in pieces named <name>.part00, <name>.part01, ...
+     */
+    size_t AddFile(const std::string &name, uint64_t size);
+
+    /* Lay out the volume with slack bytes free, create it at path and write its tables and directory */
+    bool Create(const std::string &path, uint64_t slack);
+
+    /* Write data of a file at off, may be called from several threads */
+    bool Write(size_t file, uint64_t off, const char *buf, size_t len);
+
+    bool Close(void);
+
+ private:
+    struct Piece {
+        std::string name;
+        uint64_t size;
+        uint32_t cluster;
+    };
+    struct File {
+        size_t first_piece;
+        uint64_t size;
+    };
+
+    uint64_t ClusterOffset(uint32_t cluster) const;
+    std::vector<uint8_t> RootDir(void) const;
+
+    std::vector<Piece> pieces_;
+    std::vector<File> files_;
+    uint32_t root_clusters_ = 0;
+    uint32_t fat_sectors_ = 0;
+    uint64_t data_offset_ = 0;
+    int fd_ = -1;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_GUEST_FAT_IMAGE_H_
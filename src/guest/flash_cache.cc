@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/ini_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <openssl/evp.h>
+
+#include "guest/flash_cache.h"
+#include "guest/disk_image.h"
+#include "utils/log.h"
+#include "utils/utils.h"
+
+namespace vm_manager {
+
+namespace {
+
+constexpr uint64_t kDefaultMaxSize = 32_GB;
+constexpr const char *kLockFile = "lock";
+constexpr const char *kReadyFile = "ready";
+constexpr const char *kDataName = "data";
+constexpr size_t kHashChunk = 1_MB;
+
+/* Bytes taken on disk, the artifacts are sparse */
+uint64_t DiskUsage(const boost::filesystem::path &p) {
+    boost::system::error_code ec;
+    uint64_t total = 0;
+    struct stat st;
+    if (stat(p.c_str(), &st) == 0)
+        total += st.st_blocks * 512ULL;
+    if (boost::filesystem::is_directory(p, ec)) {
+        for (auto &e : boost::filesystem::recursive_directory_iterator(p, ec)) {
+            if (lstat(e.path().c_str(), &st) == 0)
+                total += st.st_blocks * 512ULL;
+        }
+    }
+    return total;
+}
+
+/*
+ * Open file description locks on the whole lock file, owned by the fd like
+ * flock, but turning an exclusive lock into a shared one is atomic
+ */
+int LockFile(int fd, short type, bool wait) {
+    struct flock fl = {};
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    return fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl);
+}
+
+}  // namespace
+
+FlashCache::FlashCache() : dir_(std::string(GetConfigPath()) + "/flash_cache"), max_size_(kDefaultMaxSize) {
+    std::string conf = std::string(GetConfigPath()) + "/" + kFlashCacheConf;
+    boost::system::error_code ec;
+    if (!boost::filesystem::exists(conf, ec))
+        return;
+
+    try {
+        boost::property_tree::ptree pt;
+        boost::property_tree::ini_parser::read_ini(conf, pt);
+        std::string size = pt.get<std::string>("cache.max_size", "");
+        if (!size.empty() && !ParseDiskSize(size, &max_size_))
+            LOG(error) << conf << ": bad max_size '" << size << "'";
+    } catch (std::exception &e) {
+        LOG(error) << "Failed to load " << conf << ": " << e.what();
+    }
+}
+
+FlashCache::~FlashCache() {
+    for (auto &h : held_)
+        close(h.second);
+    boost::system::error_code ec;
+    for (auto &t : temps_)
+        boost::filesystem::remove_all(t, ec);
+}
+
+bool FlashCache::Key(const std::string &file, std::string *key) {
+    int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        LOG(error) << "Cannot open " << file << ": " << strerror(errno);
+        return false;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), EVP_MD_CTX_free);
+    bool ok = ctx && EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr);
+    std::vector<char> buf(kHashChunk);
+    while (ok) {
+        ssize_t n = read(fd, buf.data(), buf.size());
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            LOG(error) << "Cannot read " << file << ": " << strerror(errno);
+            ok = false;
+        }
+        if (n <= 0)
+            break;
+        ok = EVP_DigestUpdate(ctx.get(), buf.data(), n);
+    }
+    close(fd);
+
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    if (!ok || !EVP_DigestFinal_ex(ctx.get(), md, &len)) {
+        LOG(error) << "Failed to hash " << file;
+        return false;
+    }
+    key->clear();
+    for (unsigned int i = 0; i < len; i++) {
+        char hex[3];
+        snprintf(hex, sizeof(hex), "%02x", md[i]);
+        *key += hex;
+    }
+    return true;
+}
+
+/* Exclusive lock on an entry, -1 on failure. Retried if the entry was evicted while waiting */
+int FlashCache::LockEntry(const std::string &entry) {
+    std::string lock = entry + "/" + kLockFile;
+    for (;;) {
+        boost::system::error_code ec;
+        boost::filesystem::create_directories(entry, ec);
+        int fd = open(lock.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            LOG(error) << "Cannot open " << lock << ": " << strerror(errno);
+            return -1;
+        }
+        if (LockFile(fd, F_WRLCK, true) != 0) {
+            close(fd);
+            return -1;
+        }
+        struct stat held, cur;
+        if ((fstat(fd, &held) == 0) && (stat(lock.c_str(), &cur) == 0) && (held.st_ino == cur.st_ino))
+            return fd;
+        close(fd);
+    }
+}
+
+bool FlashCache::Get(const std::string &key, const std::string &kind,
+                     const std::function<bool(const std::string &path)> &prepare, std::string *path) {
+    boost::system::error_code ec;
+    if (max_size_ == 0) {
+        /* Flashes running side by side must not share it */
+        std::string tmp = "/tmp/civ-flash-" + key + "-" + kind + "-XXXXXX";
+        if (!mkdtemp(tmp.data())) {
+            LOG(error) << "Cannot create " << tmp << ": " << strerror(errno);
+            return false;
+        }
+        temps_.push_back(tmp);
+        *path = tmp + "/" + kDataName;
+        return prepare(*path);
+    }
+
+    std::string entry = dir_ + "/" + key + "-" + kind;
+    *path = entry + "/" + kDataName;
+    if (held_.count(entry))
+        return true;
+
+    int fd = LockEntry(entry);
+    if (fd < 0)
+        return false;
+
+    std::string ready = entry + "/" + kReadyFile;
+    if (boost::filesystem::exists(ready, ec)) {
+        LOG(info) << "Flash cache: reuse " << entry;
+        /* The mtime of ready is the last use */
+        utimensat(AT_FDCWD, ready.c_str(), nullptr, 0);
+    } else {
+        boost::filesystem::remove_all(*path, ec);
+        if (!prepare(*path)) {
+            boost::filesystem::remove_all(*path, ec);
+            close(fd);
+            return false;
+        }
+        std::ofstream(ready).close();
+        LOG(info) << "Flash cache: add " << entry;
+    }
+
+    /* Readers share the entry, eviction needs it exclusive */
+    if (LockFile(fd, F_RDLCK, false) != 0) {
+        LOG(error) << "Cannot share " << entry << ": " << strerror(errno);
+        close(fd);
+        return false;
+    }
+    held_[entry] = fd;
+    Evict(entry);
+    return true;
+}
+
+void FlashCache::Evict(const std::string &keep) {
+    struct Item {
+        std::string entry;
+        uint64_t size;
+        uint64_t used;
+    };
+    std::vector<Item> items;
+    uint64_t total = 0;
+    boost::system::error_code ec;
+    for (auto &e : boost::filesystem::directory_iterator(dir_, ec)) {
+        struct stat st;
+        std::string ready = e.path().string() + "/" + kReadyFile;
+        /* An entry without ready is being prepared, or was left by a failed flash */
+        uint64_t used = 0;
+        if (stat(ready.c_str(), &st) == 0)
+            used = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ULL + st.st_mtim.tv_nsec;
+        uint64_t size = DiskUsage(e.path());
+        total += size;
+        if (e.path().string() != keep)
+            items.push_back(Item{ e.path().string(), size, used });
+    }
+    std::sort(items.begin(), items.end(), [](const Item &a, const Item &b) { return a.used < b.used; });
+
+    for (auto &it : items) {
+        if (total <= max_size_)
+            break;
+        int fd = open((it.entry + "/" + kLockFile).c_str(), O_RDWR | O_CLOEXEC);
+        if (fd < 0)
+            continue;
+        /* In use by another flash */
+        if (LockFile(fd, F_WRLCK, false) != 0) {
+            close(fd);
+            continue;
+        }
+        LOG(info) << "Flash cache: evict " << it.entry;
+        boost::filesystem::remove_all(it.entry, ec);
+        close(fd);
+        total -= it.size;
+    }
+}
+
+}  // namespace vm_manager
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef SRC_GUEST_FLASH_CACHE_H_
+#define SRC_GUEST_FLASH_CACHE_H_
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace vm_manager {
+
+/*
+ * Read from the config path when flashing. "max_size" of the [cache] group
+ * caps the disk space of the cache, 0 turns it off.
+ */
+inline constexpr const char *kFlashCacheConf = "flash_cache.conf";
+
+/* Kinds of artifacts prepared from flashfiles */
+inline constexpr const char *kFlashArtifactUsb = "usb";
+inline constexpr const char *kFlashArtifactDisk = "disk";
+inline constexpr const char *kFlashArtifactFiles = "files";
+
+/*
+ * Artifacts prepared from flashfiles, kept in <config path>/flash_cache/ by
+ * the content of the flashfiles, so a reflash or another guest of the same
+ * build reuses them. The least recently used ones are dropped over the size
+ * cap. An artifact in use by a flash is held with a shared lock and is
+ * never dropped.
+ */
+class FlashCache final {
+ public:
+    FlashCache();
+    ~FlashCache();
+    FlashCache(const FlashCache&) = delete;
+    FlashCache& operator=(const FlashCache&) = delete;
+
+    /*
+     * SHA-256 of the whole file. Reading it all costs a few seconds for a
+     * large zip, far less than preparing an artifact, and unlike the zip
+     * metadata it cannot match two different builds.
+     */
+    static bool Key(const std::string &file, std::string *key);
+
+    /*
+     * Set path to the artifact of kind for key, calling prepare to create
+     * it at path first if it is not cached. The artifact stays valid until
+     * this object is destroyed.
+     */
+    bool Get(const std::string &key, const std::string &kind,
+             const std::function<bool(const std::string &path)> &prepare, std::string *path);
+
+ private:
+    int LockEntry(const std::string &entry);
+    void Evict(const std::string &keep);
+
+    std::string dir_;
+    uint64_t max_size_;
+    /* Shared locks held on the artifacts in use, by entry */
+    std::map<std::string, int> held_;
+    /* Artifacts prepared while the cache is off, removed at the end */
+    std::vector<std::string> temps_;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_GUEST_FLASH_CACHE_H_
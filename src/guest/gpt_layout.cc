@@ -0,0 +1,254 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include <unistd.h>
+
+#include <charconv>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/crc.hpp>
+
+#include "guest/gpt_layout.h"
+#include "utils/log.h"
+#include "utils/utils.h"
+
+namespace vm_manager {
+
+namespace {
+
+constexpr uint32_t kGptEntries = 128;
+constexpr uint32_t kGptEntrySize = 128;
+constexpr uint64_t kGptEntryLbas = kGptEntries * kGptEntrySize / kGptSectorSize;
+constexpr uint32_t kGptHeaderSize = 92;
+/* Partitions start on 1MiB unless gpt.ini says otherwise */
+constexpr uint64_t kGptDefaultStartLba = 2048;
+constexpr uint64_t kGptLbasPerMb = 1024 * 1024 / kGptSectorSize;
+
+const std::map<std::string, std::string> kGptTypes = {
+    { "esp",   "C12A7328-F81F-11D2-BA4B-00A0C93EC93B" },
+    { "fat",   "EBD0A0A2-B9E5-4433-87C0-68B6B72699C7" },
+    { "linux", "0FC63DAF-8483-4772-8E79-3D69D8477DE4" },
+};
+
+using IniSections = std::map<std::string, std::map<std::string, std::string>>;
+
+/* gpt.ini uses both '#' and ';' comments, which the property tree parser does not take */
+bool ReadIni(const std::string &path, IniSections *out) {
+    std::ifstream ifs(path);
+    if (!ifs) {
+        LOG(error) << "Cannot open " << path;
+        return false;
+    }
+    std::string line, section;
+    while (std::getline(ifs, line)) {
+        boost::trim(line);
+        if (line.empty() || (line[0] == '#') || (line[0] == ';'))
+            continue;
+        if ((line.front() == '[') && (line.back() == ']')) {
+            section = boost::trim_copy(line.substr(1, line.size() - 2));
+            continue;
+        }
+        size_t eq = line.find('=');
+        if (eq == std::string::npos) {
+            LOG(error) << path << ": bad line '" << line << "'";
+            return false;
+        }
+        (*out)[section][boost::trim_copy(line.substr(0, eq))] = boost::trim_copy(line.substr(eq + 1));
+    }
+    return true;
+}
+
+template <typename T>
+bool ToInt(const std::string &s, T *v) {
+    auto [ptr, ec] = std::from_chars(s.data(), s.data() + s.size(), *v);
+    return (ec == std::errc()) && (ptr == s.data() + s.size());
+}
+
+/* The first three fields of a GUID are stored little endian, the rest as written */
+bool PutGuid(uint8_t *p, const std::string &text) {
+    std::string hex = boost::erase_all_copy(text, "-");
+    if ((hex.size() != 32) || (hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos))
+        return false;
+    uint8_t b[16];
+    for (int i = 0; i < 16; i++)
+        b[i] = static_cast<uint8_t>(std::stoul(hex.substr(2 * i, 2), nullptr, 16));
+    const int order[16] = { 3, 2, 1, 0, 5, 4, 7, 6, 8, 9, 10, 11, 12, 13, 14, 15 };
+    for (int i = 0; i < 16; i++)
+        p[i] = b[order[i]];
+    return true;
+}
+
+/* Version 4 GUID */
+void PutRandomGuid(uint8_t *p) {
+    static std::random_device rd;
+    static std::mt19937_64 gen(rd());
+    Put64(p, gen());
+    Put64(p + 8, gen());
+    p[7] = (p[7] & 0x0f) | 0x40;
+    p[8] = (p[8] & 0x3f) | 0x80;
+}
+
+bool PWrite(int fd, const void *buf, size_t len, uint64_t off) {
+    if (pwrite(fd, buf, len, off) != static_cast<ssize_t>(len)) {
+        LOG(error) << "GPT: write failed: " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+}  // namespace
+
+bool GptLayout::Load(const std::string &ini_path, uint64_t disk_size) {
+    IniSections ini;
+    if (!ReadIni(ini_path, &ini))
+        return false;
+
+    lbas_ = disk_size / kGptSectorSize;
+    if (lbas_ <= kGptDefaultStartLba + kGptEntryLbas + 2) {
+        LOG(error) << "Disk of " << disk_size << " bytes is too small for a partition table";
+        return false;
+    }
+    /* The backup table and header take the end of the disk */
+    uint64_t last_usable = lbas_ - kGptEntryLbas - 2;
+    uint64_t next = kGptDefaultStartLba;
+    auto &base = ini["base"];
+    if (base.count("start_lba") && !ToInt(base["start_lba"], &next)) {
+        LOG(error) << ini_path << ": bad start_lba";
+        return false;
+    }
+
+    std::vector<std::string> names;
+    boost::split(names, base["partitions"], boost::is_any_of(" \t"), boost::token_compress_on);
+    parts_.clear();
+    for (auto &n : names) {
+        if (n.empty())
+            continue;
+        auto it = ini.find("partition." + n);
+        if (it == ini.end()) {
+            LOG(error) << ini_path << ": no section for partition " << n;
+            return false;
+        }
+        auto &sec = it->second;
+
+        std::string type = sec.count("type") ? sec["type"] : "linux";
+        auto t = kGptTypes.find(type);
+        if (t != kGptTypes.end())
+            type = t->second;
+        else if (boost::erase_all_copy(type, "-").size() != 32)
+            type = kGptTypes.at("linux");
+
+        int64_t len_mb = 0;
+        if (!ToInt(sec["len"], &len_mb)) {
+            LOG(error) << ini_path << ": bad len of partition " << n;
+            return false;
+        }
+        std::vector<std::string> labels;
+        std::string label = sec.count("label") ? sec["label"] : n;
+        if (sec["has_slot"] == "true") {
+            labels = { label + "_a", label + "_b" };
+        } else {
+            labels = { label };
+        }
+
+        for (auto &l : labels) {
+            GptPartition p;
+            p.label = l;
+            p.type_guid = type;
+            p.guid = (labels.size() == 1) ? sec["guid"] : "";
+            p.first_lba = next;
+            p.last_lba = (len_mb < 0) ? last_usable : next + len_mb * kGptLbasPerMb - 1;
+            if ((len_mb == 0) || (p.last_lba > last_usable)) {
+                LOG(error) << "Partition " << l << " does not fit on a disk of " << disk_size << " bytes";
+                return false;
+            }
+            next = p.last_lba + 1;
+            parts_.push_back(p);
+        }
+    }
+    if (parts_.empty() || (parts_.size() > kGptEntries)) {
+        LOG(error) << ini_path << ": " << parts_.size() << " partitions";
+        return false;
+    }
+    return true;
+}
+
+const GptPartition *GptLayout::Find(const std::string &label) const {
+    for (auto &p : parts_) {
+        if (p.label == label)
+            return &p;
+    }
+    return nullptr;
+}
+
+bool GptLayout::Write(int fd) const {
+    std::vector<uint8_t> entries(kGptEntries * kGptEntrySize, 0);
+    for (size_t i = 0; i < parts_.size(); i++) {
+        const GptPartition &p = parts_[i];
+        uint8_t *e = &entries[i * kGptEntrySize];
+        PutGuid(e, p.type_guid);
+        if (p.guid.empty() || !PutGuid(e + 16, p.guid))
+            PutRandomGuid(e + 16);
+        Put64(e + 32, p.first_lba);
+        Put64(e + 40, p.last_lba);
+        /* UTF-16LE, at most 36 characters */
+        for (size_t c = 0; (c < p.label.size()) && (c < 36); c++)
+            Put16(e + 56 + 2 * c, static_cast<uint8_t>(p.label[c]));
+    }
+    boost::crc_32_type entries_crc;
+    entries_crc.process_bytes(entries.data(), entries.size());
+
+    uint8_t disk_guid[16];
+    PutRandomGuid(disk_guid);
+
+    auto header = [&](uint64_t my_lba, uint64_t alt_lba, uint64_t entries_lba) {
+        std::vector<uint8_t> h(kGptSectorSize, 0);
+        memcpy(&h[0], "EFI PART", 8);
+        Put32(&h[8], 0x00010000);
+        Put32(&h[12], kGptHeaderSize);
+        Put64(&h[24], my_lba);
+        Put64(&h[32], alt_lba);
+        Put64(&h[40], kGptEntryLbas + 2);
+        Put64(&h[48], lbas_ - kGptEntryLbas - 2);
+        memcpy(&h[56], disk_guid, sizeof(disk_guid));
+        Put64(&h[72], entries_lba);
+        Put32(&h[80], kGptEntries);
+        Put32(&h[84], kGptEntrySize);
+        Put32(&h[88], entries_crc.checksum());
+        boost::crc_32_type crc;
+        crc.process_bytes(h.data(), kGptHeaderSize);
+        Put32(&h[16], crc.checksum());
+        return h;
+    };
+
+    std::vector<uint8_t> mbr(kGptSectorSize, 0);
+    uint8_t *pe = &mbr[446];
+    pe[2] = 0x02;
+    pe[4] = 0xee;
+    pe[5] = pe[6] = pe[7] = 0xff;
+    Put32(pe + 8, 1);
+    Put32(pe + 12, static_cast<uint32_t>(std::min<uint64_t>(lbas_ - 1, UINT32_MAX)));
+    mbr[510] = 0x55;
+    mbr[511] = 0xaa;
+
+    uint64_t backup_entries = lbas_ - kGptEntryLbas - 1;
+    auto primary = header(1, lbas_ - 1, 2);
+    auto backup = header(lbas_ - 1, 1, backup_entries);
+    return PWrite(fd, mbr.data(), mbr.size(), 0) &&
+           PWrite(fd, primary.data(), primary.size(), kGptSectorSize) &&
+           PWrite(fd, entries.data(), entries.size(), 2 * kGptSectorSize) &&
+           PWrite(fd, entries.data(), entries.size(), backup_entries * kGptSectorSize) &&
+           PWrite(fd, backup.data(), backup.size(), (lbas_ - 1) * kGptSectorSize);
+}
+
+}  // namespace vm_manager
@@ -0,0 +1,58 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef SRC_GUEST_GPT_LAYOUT_H_
+#define SRC_GUEST_GPT_LAYOUT_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace vm_manager {
+
+inline constexpr uint64_t kGptSectorSize = 512;
+
+struct GptPartition {
+    std::string label;
+    std::string type_guid;
+    /* Random if empty */
+    std::string guid;
+    uint64_t first_lba = 0;
+    uint64_t last_lba = 0;
+
+    uint64_t Offset(void) const { return first_lba * kGptSectorSize; }
+    uint64_t Size(void) const { return (last_lba - first_lba + 1) * kGptSectorSize; }
+};
+
+/*
+ * Partition table described by the gpt.ini of the flashfiles, the file the
+ * installer turns into the "gpt" it flashes. Lengths are in MiB, -1 takes
+ * the rest of the disk, partitions with has_slot get an _a and a _b copy.
+ */
+class GptLayout final {
+ public:
+    GptLayout() = default;
+
+    /* Lay out the partitions on a disk of disk_size bytes */
+    bool Load(const std::string &ini_path, uint64_t disk_size);
+
+    const std::vector<GptPartition> &Partitions(void) const { return parts_; }
+    /* nullptr if no partition has the label */
+    const GptPartition *Find(const std::string &label) const;
+
+    /* Write the protective MBR and both copies of the table to fd */
+    bool Write(int fd) const;
+
+ private:
+    uint64_t lbas_ = 0;
+    std::vector<GptPartition> parts_;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_GUEST_GPT_LAYOUT_H_
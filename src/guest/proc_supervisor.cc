@@ -0,0 +1,159 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstring>
+#include <utility>
+
+#include <boost/thread.hpp>
+
+#include "guest/proc_supervisor.h"
+#include "utils/log.h"
+#include "utils/utils.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+namespace vm_manager {
+
+/* Supervisor and fallback waiters only call waitpid and short callbacks */
+constexpr const std::size_t kSupervisorStackSize = 256_KB;
+
+static int PidfdOpen(pid_t pid) {
+    return static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+}
+
+/* r is what waitpid returned, -1 if the status could not be read */
+static int DecodeStatus(pid_t r, int status) {
+    if (r <= 0)
+        return -1;
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status);
+    if (WIFSIGNALED(status))
+        return 128 + WTERMSIG(status);
+    return -1;
+}
+
+bool ProcSupervisor::Init(void) {
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd_ < 0) {
+        LOG(error) << "Failed to create epoll: " << strerror(errno);
+        return false;
+    }
+
+    boost::thread::attributes attrs;
+    attrs.set_stack_size(kSupervisorStackSize);
+    boost::thread t(attrs, [this]() { Loop(); });
+    t.detach();
+    return true;
+}
+
+void ProcSupervisor::Loop(void) {
+    struct epoll_event events[16];
+    while (true) {
+        int n = epoll_wait(epfd_, events, sizeof(events) / sizeof(events[0]), -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            LOG(error) << "Process supervisor: epoll_wait failed: " << strerror(errno);
+            return;
+        }
+        for (int i = 0; i < n; i++)
+            Reap(static_cast<pid_t>(events[i].data.u32));
+    }
+}
+
+void ProcSupervisor::Reap(pid_t pid) {
+    std::scoped_lock lock(mutex_);
+    auto it = children_.find(pid);
+    if (it == children_.end())
+        return;
+
+    int status = 0;
+    pid_t r = waitpid(pid, &status, WNOHANG);
+    if (r == 0)
+        return;
+
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, it->second.pidfd, nullptr);
+    close(it->second.pidfd);
+    ExitCallback cb = std::move(it->second.cb);
+    children_.erase(it);
+
+    if (cb)
+        cb(DecodeStatus(r, status));
+}
+
+void ProcSupervisor::WatchByThread(pid_t pid) {
+    boost::thread::attributes attrs;
+    attrs.set_stack_size(kSupervisorStackSize);
+    boost::thread t(attrs, [this, pid]() {
+        int status = 0;
+        pid_t r;
+        while (((r = waitpid(pid, &status, 0)) < 0) && (errno == EINTR)) {}
+
+        std::scoped_lock lock(mutex_);
+        auto it = children_.find(pid);
+        if (it == children_.end())
+            return;
+        ExitCallback cb = std::move(it->second.cb);
+        children_.erase(it);
+        if (cb)
+            cb(DecodeStatus(r, status));
+    });
+    t.detach();
+}
+
+bool ProcSupervisor::Watch(pid_t pid, ExitCallback cb) {
+    std::scoped_lock lock(mutex_);
+    if ((epfd_ < 0) && !Init())
+        return false;
+
+    int pidfd = PidfdOpen(pid);
+    if (pidfd < 0) {
+        if (errno != ENOSYS) {
+            LOG(error) << "Failed to open pidfd of " << pid << ": " << strerror(errno);
+            return false;
+        }
+        children_[pid] = Child{-1, std::move(cb)};
+        WatchByThread(pid);
+        return true;
+    }
+
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN;
+    ev.data.u32 = static_cast<uint32_t>(pid);
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, pidfd, &ev) < 0) {
+        LOG(error) << "Failed to watch " << pid << ": " << strerror(errno);
+        close(pidfd);
+        return false;
+    }
+    children_[pid] = Child{pidfd, std::move(cb)};
+    return true;
+}
+
+void ProcSupervisor::Unwatch(pid_t pid) {
+    std::scoped_lock lock(mutex_);
+    auto it = children_.find(pid);
+    if (it == children_.end())
+        return;
+    /* Keep the child in the set, it still has to be reaped once it exits */
+    it->second.cb = nullptr;
+}
+
+ProcSupervisor &ProcSupervisor::Supervisor(void) {
+    static ProcSupervisor supervisor_;
+    return supervisor_;
+}
+
+}  // namespace vm_manager
@@ -0,0 +1,63 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef SRC_GUEST_PROC_SUPERVISOR_H_
+#define SRC_GUEST_PROC_SUPERVISOR_H_
+
+#include <sys/types.h>
+
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace vm_manager {
+
+/*
+ * Reaps all child processes of vm-manager from one thread. Each watched pid
+ * gets a pidfd in an epoll set, the exit callback is called from the
+ * supervisor thread once the child has been reaped, so it must not block.
+ *
+ * On kernels without pidfd_open, a waiter thread with a small stack is used
+ * for that child instead.
+ */
+class ProcSupervisor final {
+ public:
+    using ExitCallback = std::function<void(int exit_code)>;
+
+    /* The child must not have been reaped yet */
+    bool Watch(pid_t pid, ExitCallback cb);
+    /* No callback for pid is running or will run once this returns */
+    void Unwatch(pid_t pid);
+
+    static ProcSupervisor &Supervisor(void);
+
+ private:
+    ProcSupervisor() = default;
+    ~ProcSupervisor() = default;
+    ProcSupervisor(const ProcSupervisor &) = delete;
+    ProcSupervisor& operator=(const ProcSupervisor&) = delete;
+
+    bool Init(void);
+    void Loop(void);
+    void Reap(pid_t pid);
+    void WatchByThread(pid_t pid);
+
+    struct Child {
+        int pidfd;
+        ExitCallback cb;
+    };
+
+    int epfd_ = -1;
+    std::map<pid_t, Child> children_;
+    /* Held while a callback runs, so Unwatch waits for it */
+    std::mutex mutex_;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_GUEST_PROC_SUPERVISOR_H_
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include <cstdio>
+#include <future>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/thread.hpp>
+
+#include "guest/qmp_client.h"
+#include "utils/log.h"
+
+namespace vm_manager {
+
+constexpr const std::chrono::milliseconds kQmpConnectRetryInterval(100);
+
+/* The I/O thread shared by all QMP clients */
+static boost::asio::io_context &QmpIo(void) {
+    static boost::asio::io_context io;
+    static auto work = boost::asio::make_work_guard(io);
+    static boost::thread *t = new boost::thread([]() {
+        while (true) {
+            try {
+                io.run();
+                return;
+            } catch (std::exception &e) {
+                LOG(error) << "QMP: exception in I/O thread: " << e.what();
+            }
+        }
+    });
+    (void)t;
+    return io;
+}
+
+std::shared_ptr<QmpClient> QmpClient::Create(std::string sock_path) {
+    return std::shared_ptr<QmpClient>(new QmpClient(std::move(sock_path)));
+}
+
+QmpClient::QmpClient(std::string sock_path) : sock_path_(std::move(sock_path)), sock_(QmpIo()) {}
+
+std::string QmpClient::Quote(const std::string &s) {
+    std::string q = "\"";
+    for (char c : s) {
+        switch (c) {
+            case '"':  q += "\\\""; break;
+            case '\\': q += "\\\\"; break;
+            case '\n': q += "\\n"; break;
+            case '\r': q += "\\r"; break;
+            case '\t': q += "\\t"; break;
+            default:
+                if (static_cast<unsigned char>(c) < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    q += buf;
+                } else {
+                    q += c;
+                }
+                break;
+        }
+    }
+    return q + "\"";
+}
+
+bool QmpClient::Connect(std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    auto self = shared_from_this();
+
+    while (true) {
+        auto ready = std::make_shared<std::promise<bool>>();
+        std::future<bool> f = ready->get_future();
+
+        boost::asio::post(QmpIo(), [self, ready]() {
+            self->greeted_ = false;
+            self->on_ready_ = [ready](bool ok) { ready->set_value(ok); };
+            self->sock_.async_connect(boost::asio::local::stream_protocol::endpoint(self->sock_path_),
+                                      [self](const boost::system::error_code &ec) {
+                if (ec) {
+                    self->Fail(ec.message());
+                    return;
+                }
+                self->ReadNext();
+            });
+        });
+
+        auto now = std::chrono::steady_clock::now();
+        if ((f.wait_for(deadline - now) == std::future_status::ready) && f.get())
+            return true;
+
+        if (std::chrono::steady_clock::now() + kQmpConnectRetryInterval >= deadline) {
+            LOG(error) << "QMP: cannot connect to " << sock_path_;
+            boost::asio::post(QmpIo(), [self]() { self->Fail("connect timeout"); });
+            return false;
+        }
+        std::this_thread::sleep_for(kQmpConnectRetryInterval);
+    }
+}
+
+void QmpClient::Close(void) {
+    {
+        std::scoped_lock lock(cb_mutex_);
+        closed_ = true;
+        event_cb_ = nullptr;
+    }
+    auto self = shared_from_this();
+    boost::asio::post(QmpIo(), [self]() { self->Fail("closed"); });
+}
+
+void QmpClient::SetEventCallback(EventCallback cb) {
+    std::scoped_lock lock(cb_mutex_);
+    event_cb_ = std::move(cb);
+}
+
+void QmpClient::Fail(const std::string &why) {
+    connected_ = false;
+    boost::system::error_code ec;
+    sock_.close(ec);
+    rbuf_.consume(rbuf_.size());
+    wq_.clear();
+
+    auto pending = std::move(pending_);
+    pending_.clear();
+    auto on_ready = std::move(on_ready_);
+    on_ready_ = nullptr;
+
+    if (on_ready)
+        on_ready(false);
+
+    std::scoped_lock lock(cb_mutex_);
+    if (closed_)
+        return;
+    for (auto &p : pending)
+        p.second(false, ptree(), why);
+}
+
+void QmpClient::ReadNext(void) {
+    auto self = shared_from_this();
+    boost::asio::async_read_until(sock_, rbuf_, '\n',
+                                  [self](const boost::system::error_code &ec, std::size_t) {
+        if (ec) {
+            if (self->connected_)
+                LOG(info) << "QMP: " << self->sock_path_ << " disconnected: " << ec.message();
+            self->Fail(ec.message());
+            return;
+        }
+        std::istream is(&self->rbuf_);
+        std::string line;
+        std::getline(is, line);
+        self->OnMessage(line);
+        self->ReadNext();
+    });
+}
+
+void QmpClient::WriteNext(void) {
+    auto self = shared_from_this();
+    boost::asio::async_write(sock_, boost::asio::buffer(wq_.front()),
+                             [self](const boost::system::error_code &ec, std::size_t) {
+        if (ec) {
+            self->Fail(ec.message());
+            return;
+        }
+        self->wq_.pop_front();
+        if (!self->wq_.empty())
+            self->WriteNext();
+    });
+}
+
+void QmpClient::Send(const std::string &cmd, const std::string &args_json, ReplyCallback cb) {
+    uint64_t id = next_id_++;
+    std::string msg = "{\"execute\":" + Quote(cmd);
+    if (!args_json.empty())
+        msg += ",\"arguments\":" + args_json;
+    msg += ",\"id\":" + std::to_string(id) + "}\n";
+
+    pending_[id] = std::move(cb);
+    wq_.push_back(std::move(msg));
+    if (wq_.size() == 1)
+        WriteNext();
+}
+
+void QmpClient::OnMessage(const std::string &line) {
+    ptree pt;
+    try {
+        std::istringstream iss(line);
+        boost::property_tree::read_json(iss, pt);
+    } catch (std::exception &e) {
+        LOG(warning) << "QMP: malformed message from " << sock_path_ << ": " << e.what();
+        return;
+    }
+
+    if (!greeted_) {
+        if (!pt.get_child_optional("QMP"))
+            return;
+        greeted_ = true;
+        auto self = shared_from_this();
+        Send("qmp_capabilities", "", [self](bool ok, const ptree &, const std::string &err) {
+            if (!ok)
+                LOG(error) << "QMP: capability negotiation failed: " << err;
+            self->connected_ = ok;
+            auto on_ready = std::move(self->on_ready_);
+            self->on_ready_ = nullptr;
+            if (on_ready)
+                on_ready(ok);
+        });
+        return;
+    }
+
+    if (auto ev = pt.get_optional<std::string>("event")) {
+        std::scoped_lock lock(cb_mutex_);
+        if (event_cb_)
+            event_cb_(*ev, pt.get_child("data", ptree()));
+        return;
+    }
+
+    auto id = pt.get_optional<uint64_t>("id");
+    if (!id)
+        return;
+    auto it = pending_.find(*id);
+    if (it == pending_.end())
+        return;
+    ReplyCallback cb = std::move(it->second);
+    pending_.erase(it);
+
+    bool ok = !pt.get_child_optional("error");
+    std::string err = ok ? "" : pt.get<std::string>("error.desc", "unknown error");
+
+    /* The capabilities reply is handled before the client is usable */
+    if (!connected_) {
+        cb(ok, pt.get_child("return", ptree()), err);
+        return;
+    }
+    std::scoped_lock lock(cb_mutex_);
+    if (!closed_)
+        cb(ok, pt.get_child("return", ptree()), err);
+}
+
+void QmpClient::ExecuteAsync(const std::string &cmd, const std::string &args_json, ReplyCallback cb) {
+    auto self = shared_from_this();
+    boost::asio::post(QmpIo(), [self, cmd, args_json, cb = std::move(cb)]() mutable {
+        if (!self->connected_) {
+            std::scoped_lock lock(self->cb_mutex_);
+            if (!self->closed_)
+                cb(false, ptree(), "not connected");
+            return;
+        }
+        self->Send(cmd, args_json, std::move(cb));
+    });
+}
+
+bool QmpClient::Execute(const std::string &cmd, const std::string &args_json,
+                        ptree *ret, std::chrono::milliseconds timeout) {
+    auto reply = std::make_shared<std::promise<bool>>();
+    std::future<bool> f = reply->get_future();
+
+    auto out = std::make_shared<ptree>();
+    ExecuteAsync(cmd, args_json, [reply, out, cmd](bool ok, const ptree &r, const std::string &err) {
+        if (!ok)
+            LOG(error) << "QMP: " << cmd << " failed: " << err;
+        *out = r;
+        reply->set_value(ok);
+    });
+
+    if (f.wait_for(timeout) != std::future_status::ready) {
+        LOG(error) << "QMP: " << cmd << " timed out";
+        return false;
+    }
+    try {
+        if (!f.get())
+            return false;
+    } catch (std::exception &e) {
+        /* Client closed, the reply callback was dropped */
+        return false;
+    }
+    if (ret)
+        *ret = *out;
+    return true;
+}
+
+}  // namespace vm_manager
@@ -0,0 +1,95 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef SRC_GUEST_QMP_CLIENT_H_
+#define SRC_GUEST_QMP_CLIENT_H_
+
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <boost/asio.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+namespace vm_manager {
+
+/*
+ * Client of a QEMU QMP monitor socket. All clients share one I/O thread,
+ * commands are pipelined and matched to replies by id, asynchronous events
+ * go to the event callback. Callbacks run on the I/O thread and must not
+ * block on another QMP reply.
+ *
+ * A QMP unix socket serves one client at a time, so a VM has one pipelined
+ * connection per monitor rather than a pool of them.
+ */
+class QmpClient final : public std::enable_shared_from_this<QmpClient> {
+ public:
+    using ptree = boost::property_tree::ptree;
+    using ReplyCallback = std::function<void(bool ok, const ptree &ret, const std::string &err)>;
+    using EventCallback = std::function<void(const std::string &event, const ptree &data)>;
+
+    static std::shared_ptr<QmpClient> Create(std::string sock_path);
+    ~QmpClient() = default;
+
+    /*
+     * Connect and negotiate capabilities. QEMU creates the socket shortly
+     * after start, so connecting is retried until timeout.
+     */
+    bool Connect(std::chrono::milliseconds timeout);
+    /* No callback runs once this returns, pending commands fail */
+    void Close(void);
+    bool Connected(void) const { return connected_; }
+
+    void SetEventCallback(EventCallback cb);
+
+    /* args_json is a JSON object or empty */
+    void ExecuteAsync(const std::string &cmd, const std::string &args_json, ReplyCallback cb);
+    /* Blocking form of ExecuteAsync, not to be called from a callback */
+    bool Execute(const std::string &cmd, const std::string &args_json,
+                 ptree *ret, std::chrono::milliseconds timeout);
+
+    /* Quote s as a JSON string */
+    static std::string Quote(const std::string &s);
+
+ private:
+    explicit QmpClient(std::string sock_path);
+    QmpClient(const QmpClient&) = delete;
+    QmpClient& operator=(const QmpClient&) = delete;
+
+    void ReadNext(void);
+    void WriteNext(void);
+    void OnMessage(const std::string &line);
+    void Send(const std::string &cmd, const std::string &args_json, ReplyCallback cb);
+    void Fail(const std::string &why);
+
+    std::string sock_path_;
+    boost::asio::local::stream_protocol::socket sock_;
+    boost::asio::streambuf rbuf_;
+
+    /* Only touched on the I/O thread */
+    std::deque<std::string> wq_;
+    std::map<uint64_t, ReplyCallback> pending_;
+    uint64_t next_id_ = 1;
+    bool greeted_ = false;
+    std::function<void(bool)> on_ready_;
+
+    std::atomic<bool> connected_ = false;
+    EventCallback event_cb_;
+    bool closed_ = false;
+    /* Held while the event callback runs, so Close waits for it */
+    std::mutex cb_mutex_;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_GUEST_QMP_CLIENT_H_
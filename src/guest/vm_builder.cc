@@ -28,4 +28,22 @@ namespace vm_manager {
     VmBuilder::VmState VmBuilder::GetState(void) {
         return state_;
     }
+
+    void VmBuilder::SetStateListener(std::function<void(VmBuilder *, VmState)> listener) {
+        std::scoped_lock lock(state_lock_);
+        state_listener_ = std::move(listener);
+    }
+
+    void VmBuilder::SetState(VmState s) {
+        std::function<void(VmBuilder *, VmState)> listener;
+        {
+            std::scoped_lock lock(state_lock_);
+            if (state_ == s)
+                return;
+            state_ = s;
+            listener = state_listener_;
+        }
+        if (listener)
+            listener(this, s);
+    }
 }  //  namespace vm_manager
@@ -14,6 +14,7 @@
 #include <utility>
 #include <exception>
 #include <map>
+#include <functional>
 
 #include <boost/thread.hpp>
 #include <boost/process.hpp>
@@ -39,22 +40,45 @@ class VmBuilder {
     explicit VmBuilder(std::string name) : name_(name), vsock_cid_(0) {}
     virtual ~VmBuilder() = default;
     virtual bool BuildVmArgs(void) = 0;
-    virtual void StartVm(void) = 0;
+    /* Returns false if the VM could not be started, nothing is left running then */
+    virtual bool StartVm(void) = 0;
     virtual void WaitVmExit(void) = 0;
+    /* Call cb once the main process has exited, cb runs on the process supervisor and must not block */
+    virtual void NotifyVmExit(std::function<void(void)> cb) = 0;
     virtual void StopVm(void) = 0;
-    virtual void PauseVm(void) = 0;
+    /* Stop the vCPUs of a running VM, its memory and devices stay in place */
+    virtual bool PauseVm(void) = 0;
+    /* Continue a VM stopped by PauseVm */
+    virtual bool ResumeVm(void) = 0;
     virtual bool WaitVmReady(void) = 0;
     virtual void SetVmReady(void) = 0;
     virtual void SetProcessEnv(std::vector<std::string> env) = 0;
+    /* Release the resources of the finished boot and go back to kVmCreated */
+    virtual void ResetVm(void) = 0;
+    /* Acquire host resources for the planned args and render the launch command */
+    virtual bool PrepareBoot(void) = 0;
+    /* Like PrepareBoot, but the boot resumes from the snapshot taken by SaveVm */
+    virtual bool PrepareRestore(void) = 0;
+    /* Save the state of the VM to its snapshot, the VM is stopped once saved */
+    virtual bool SaveVm(void) = 0;
+    /* GetStats of each co-process of the current boot */
+    virtual std::vector<std::string> GetCoProcStats(void) = 0;
+    /* Exit code of the main process, -1 if it has not exited */
+    virtual int GetExitCode(void) = 0;
     std::string GetName(void);
     uint32_t GetCid(void);
     VmState GetState(void);
+    /* Called on every state transition, from whichever thread makes it */
+    void SetStateListener(std::function<void(VmBuilder *, VmState)> listener);
 
  protected:
+    void SetState(VmState s);
+
     std::string name_;
     uint32_t vsock_cid_;
     VmState state_ = VmBuilder::VmState::kVmEmpty;
     std::mutex state_lock_;
+    std::function<void(VmBuilder *, VmState)> state_listener_;
 };
 
 static inline constexpr const char *VmStateToStr(VmBuilder::VmState s) {
@@ -10,6 +10,8 @@
 #include <utility>
 #include <memory>
 #include <fstream>
+#include <chrono>
+#include <thread>
 
 #include <boost/process.hpp>
 #include <boost/uuid/uuid.hpp>
@@ -60,6 +62,15 @@ constexpr const char *kSys2MFreeHugePages = "/sys/kernel/mm/hugepages/hugepages-
 constexpr const char *kSys2MNrHugePages = "/sys/kernel/mm/hugepages/hugepages-2048kB/nr_hugepages";
 
 constexpr const char *kDrmCard0Vf = "/sys/class/drm/card0/iov/vf";
+
+/* Co-processes must pass their readiness probes in this time before QEMU is launched */
+constexpr const std::chrono::seconds kCoProcReadyTimeout(10);
+constexpr const std::chrono::milliseconds kCoProcProbeInterval(20);
+constexpr const std::chrono::seconds kQmpConnectTimeout(5);
+constexpr const std::chrono::seconds kQmpCmdTimeout(5);
+/* Writing the RAM of a large guest to a slow disk */
+constexpr const std::chrono::seconds kSnapshotSaveTimeout(600);
+constexpr const std::chrono::milliseconds kSnapshotPollInterval(100);
 constexpr const char *kGtPreemptTimeoutUs = "/gt/preempt_timeout_us";
 constexpr const char *kGtExecQuantumMs = "/gt/exec_quantum_ms";
 
@@ -100,7 +111,7 @@ void VmBuilderQemu::SoundCardHook(void) {
     if (!boost::process::system("ls /proc/asound/sofhdadsp")) {
         LOG(info) << "Removing snd-sof-pci-intel-tgl ...";
         if (!boost::process::system("modprobe -r snd-sof-pci-intel-tgl")) {
-            end_call_.emplace([](){
+            end_call_.emplace_back([](){
                 LOG(info) << "Probing snd-sof-pci-intel-tgl ...";
                 boost::process::system("modprobe snd-sof-pci-intel-tgl");
             });
@@ -151,32 +162,16 @@ static bool SetupHugePages(const std::string &mem_size) {
     if (mem_size.empty())
         return false;
 
-    int mem_mb = 0;
-    try {
-        mem_mb = std::stoi(mem_size, nullptr, 0);
-    } catch (std::exception &e) {
-        LOG(error) << e.what();
+    uint64_t bytes = 0;
+    if (!ParseCivSize(mem_size, 1_MB, &bytes) || (bytes / 1_MB > INT32_MAX)) {
+        LOG(error) << "Invalid memory size " << mem_size;
         return false;
     }
 
+    int mem_mb = bytes / 1_MB;
     if (mem_mb <= 0)
         return false;
 
-    switch (toupper(mem_size.back())) {
-    case '0' ... '9':
-    case 'A' ... 'F':
-    case 'M':
-        break;
-    case 'G':
-        if (mem_mb > INT32_MAX/1024)
-            return false;
-        else
-            mem_mb *= 1024;
-        break;
-    default:
-        return false;
-    }
-
     /* Get free Huge pages */
     int free_hp = ReadSysFile(kSys2MFreeHugePages, std::ios_base::dec);
 
@@ -273,37 +268,45 @@ static int SetAvailableVf(void) {
     return -1;
 }
 
-bool VmBuilderQemu::SetupSriov(void) {
-    std::string vgpu_mon_id = cfg_.GetValue(kGroupVgpu, kVgpuMonId);
+bool VmBuilderQemu::PlanSriov(void) {
+    std::string vgpu_mon_id = cfg_.vgpu.monitor;
     if (vgpu_mon_id.empty()) {
-        emul_cmd_.append(" -display gtk,gl=on");
+        AddArg(" -display gtk,gl=on");
     } else {
-        emul_cmd_.append(" -display gtk,gl=on,monitor=" + vgpu_mon_id);
+        AddArg(" -display gtk,gl=on,monitor=" + vgpu_mon_id);
     }
 
-    std::string mem_size = cfg_.GetValue(kGroupMem, kMemSize);
+    std::string mem_size = cfg_.mem.size;
     boost::trim(mem_size);
+    if (mem_size.empty()) {
+        LOG(error) << "Memory size is required by SRIOV!";
+        return false;
+    }
+
+    plan_.sriov = true;
+    plan_.hugepages_mem = mem_size;
+
+    AddArg(" -device virtio-vga,max_outputs=1,blob=true");
+    AddArg(VmLaunchPlan::kArgSriovVf, " -device vfio-pci,host=0000:00:02.");
+    AddArg(" -object memory-backend-memfd,hugetlb=on,id=mem_sriov,size=" + mem_size +
+           " -machine memory-backend=mem_sriov");
 
-    if (!SetupHugePages(mem_size)) {
+    return true;
+}
+
+bool VmBuilderQemu::SetupSriov(void) {
+    if (!SetupHugePages(plan_.hugepages_mem)) {
         LOG(info) << "Failed to setup hugepage for SRIOV!";
         return false;
     }
-    int vf = SetAvailableVf();
-    if (vf < 0)
+    sriov_vf_ = SetAvailableVf();
+    if (sriov_vf_ < 0)
         return false;
-
-    emul_cmd_.append(" -device virtio-vga,max_outputs=1,blob=true"
-                    " -device vfio-pci,host=0000:00:02." + std::to_string(vf) +
-                    " -object memory-backend-memfd,hugetlb=on,id=mem_sriov,size=" + mem_size +
-                    " -machine memory-backend=mem_sriov");
-
     return true;
 }
 
 void VmBuilderQemu::BringDownBtHciIntf(void) {
-    std::string hci_status = cfg_.GetValue(kGroupbluetooth, kHciDown);
-    boost::trim(hci_status);
-    if (hci_status == "true") {
+    if (plan_.hci_down) {
         LOG(info) << "Shutting down Hci Interface!!!\n";
         int result = boost::process::system("sudo hciconfig hci0 down");
         if (result != 0) {
@@ -313,25 +316,26 @@ void VmBuilderQemu::BringDownBtHciIntf(void) {
 }
 
 void VmBuilderQemu::BuildExtraGuestPmCtrlCmd(void) {
-    std::string ex_cmd = cfg_.GetValue(kGroupExtra, kExtraPwrCtrlMultiOS);
-    if (ex_cmd == "true") {
-        static std::string socketPath;
-        for (int avail = 0; avail < MAX_NUM_GUEST; avail++) {
-            socketPath = kQmpPowerSocket + std::to_string(avail);
-            if (access(socketPath.c_str(), F_OK) != 0) {
-                std::string qmpCmd = " -qmp unix:" + socketPath + ",server,nowait";
-                emul_cmd_.append(qmpCmd);
-                break;
-            }
-        }
+    if (cfg_.extra.pwr_ctrl_multios)
+        AddArg(VmLaunchPlan::kArgPwrQmp, "");
+}
 
-        end_call_.emplace([](){
-            boost::system::error_code ec;
-            boost::filesystem::remove(socketPath, ec);
-        });
-    } else {
-        return;
+void VmBuilderQemu::AcquirePwrQmpSocket(void) {
+    pwr_qmp_sock_.clear();
+    for (int avail = 0; avail < MAX_NUM_GUEST; avail++) {
+        std::string sock = kQmpPowerSocket + std::to_string(avail);
+        if (access(sock.c_str(), F_OK) != 0) {
+            pwr_qmp_sock_ = sock;
+            break;
+        }
     }
+    if (pwr_qmp_sock_.empty())
+        return;
+
+    end_call_.emplace_back([sock = pwr_qmp_sock_](){
+        boost::system::error_code ec;
+        boost::filesystem::remove(sock, ec);
+    });
 }
 
 enum PciPassthroughAction {
@@ -417,7 +421,7 @@ static bool PassthroughOnePciDev(const char *pci_id, PciPassthroughAction action
 }
 
 void VmBuilderQemu::BuildPtPciDevicesCmd(void) {
-    std::string pt_pci = cfg_.GetValue(kGroupPciPt, kPciPtDev);
+    std::string pt_pci = cfg_.pt.pci;
     boost::trim(pt_pci);
     if (pt_pci.empty())
         return;
@@ -425,14 +429,26 @@ void VmBuilderQemu::BuildPtPciDevicesCmd(void) {
     std::vector<std::string> vec;
     boost::split(vec, pt_pci, boost::is_any_of(","), boost::token_compress_on);
 
-    BringDownBtHciIntf();  // Bring down blutooth hci interface before passthrough
+    plan_.hci_down = cfg_.bt.hci_down;
     for (auto it=vec.begin(); it != vec.end(); ++it) {
         boost::trim(*it);
-        if (PassthroughOnePciDev(it->c_str(), kPciPassthrough)) {
-            pci_pt_dev_set_.insert(*it);
-            emul_cmd_.append(" -device vfio-pci,host=" + *it + ",x-no-kvm-intx=on");
+        if (it->empty())
+            continue;
+        plan_.pt_pci_devs.push_back(*it);
+        AddArg(VmLaunchPlan::kArgPciDev, *it);
+    }
+}
+
+void VmBuilderQemu::PassthroughPciDevices(void) {
+    if (plan_.pt_pci_devs.empty())
+        return;
+
+    BringDownBtHciIntf();  // Bring down blutooth hci interface before passthrough
+    for (auto &dev : plan_.pt_pci_devs) {
+        if (PassthroughOnePciDev(dev.c_str(), kPciPassthrough)) {
+            pci_pt_dev_set_.insert(dev);
         } else {
-            LOG(warning) << "Failed to passthrough: " << *it;
+            LOG(warning) << "Failed to passthrough: " << dev;
         }
     }
 }
@@ -440,11 +456,12 @@ void VmBuilderQemu::BuildPtPciDevicesCmd(void) {
 void VmBuilderQemu::SetPciDevicesCallback(void) {
     if (pci_pt_dev_set_.empty())
         return;
-    end_call_.emplace([this](){
+    end_call_.emplace_back([this](){
         LOG(info) << "Restore passthroughed PCI devices ...";
         for (auto it=pci_pt_dev_set_.begin(); it != pci_pt_dev_set_.end(); ++it) {
             PassthroughOnePciDev(it->c_str(), kPciRestore);
         }
+        pci_pt_dev_set_.clear();
     });
 }
 
@@ -457,54 +474,78 @@ bool VmBuilderQemu::PassthroughGpu(void) {
 }
 
 bool VmBuilderQemu::CreateGvtgVgpu(void) {
-    std::string gvtg_ver = cfg_.GetValue(kGroupVgpu, kVgpuGvtgVer);
-    std::string gvtg_create(kGvtgMdevTypePath + gvtg_ver + "/create");
-    std::string uuid = cfg_.GetValue(kGroupVgpu, kVgpuUuid);
+    std::string gvtg_create(kGvtgMdevTypePath + plan_.gvtg_version + "/create");
+    std::string uuid = plan_.gvtg_uuid;
 
-    if (WriteSysFile(gvtg_create.c_str(), uuid) == 0)
-        return true;
-    return false;
+    if (WriteSysFile(gvtg_create.c_str(), uuid) != 0)
+        return false;
+
+    end_call_.emplace_back([uuid](){
+        std::string gvtg_remove(kIntelGpuDevPath + uuid + "/remove");
+        WriteSysFile(gvtg_remove.c_str(), "1");
+    });
+    return true;
+}
+
+/* "<kind>:<target>" as checked by the config schema */
+static VmProcProbe ProbeOf(const std::string &probe) {
+    size_t colon = probe.find(':');
+    std::string kind = probe.substr(0, colon);
+    std::string target = probe.substr(colon + 1);
+    if (kind == kProbeSocket)
+        return VmProcProbe{VmProcProbe::kUnixSocket, target};
+    if (kind == kProbeFile)
+        return VmProcProbe{VmProcProbe::kFile, target};
+    return VmProcProbe{VmProcProbe::kLogLine, target};
+}
+
+/* The entry has been checked when the config was decoded */
+static CivService ServiceOf(const std::string &entry) {
+    CivService svc;
+    std::string err;
+    ParseCivService(entry, &svc, &err);
+    return svc;
 }
 
 void VmBuilderQemu::RunMediationSrv(void) {
-    std::string batt_med = cfg_.GetValue(kGroupMed, kMedBattery);
+    std::string batt_med = cfg_.med.battery;
     if (!batt_med.empty())
-        co_procs_.emplace_back(std::make_unique<VmProcSimple>(batt_med));
+        AddCoProc(ServiceOf(batt_med));
 
-    std::string ther_med = cfg_.GetValue(kGroupMed, kMedThermal);
+    std::string ther_med = cfg_.med.thermal;
     if (!ther_med.empty())
-        co_procs_.emplace_back(std::make_unique<VmProcSimple>(ther_med));
+        AddCoProc(ServiceOf(ther_med));
 
-    std::string cam_med = cfg_.GetValue(kGroupMed, kMedCamera);
+    std::string cam_med = cfg_.med.camera;
     if ((cam_med.size() == 1) && (std::tolower(cam_med[0]) == 'y'))
-        co_procs_.emplace_back(std::make_unique<VmProcSimple>("/usr/local/bin/stream"));
+        AddCoProc(CivService{"/usr/local/bin/stream"});
 }
 
 void VmBuilderQemu::BuildGuestTimeKeepCmd(void) {
-    std::string tk = cfg_.GetValue(kGroupService, kServTimeKeep);
-    if (tk.empty())
+    if (cfg_.serv.time_keep.empty())
         return;
+    CivService tk = ServiceOf(cfg_.serv.time_keep);
 
     constexpr const char *kTimeKeepPipe = "/tmp/qmp-time-keep-pipe";
-    tk.append(" " + std::string(kTimeKeepPipe));
-    co_procs_.emplace_back(std::make_unique<VmProcSimple>(tk));
-    emul_cmd_.append(" -qmp pipe:" + std::string(kTimeKeepPipe));
+    tk.cmd.append(" " + std::string(kTimeKeepPipe));
+    AddCoProc(std::move(tk));
+    AddArg(" -qmp pipe:" + std::string(kTimeKeepPipe));
 }
 
 void VmBuilderQemu::BuildGuestPmCtrlCmd(void) {
-    std::string pm = cfg_.GetValue(kGroupService, kServPmCtrl);
-    if (pm.empty())
+    if (cfg_.serv.pm_control.empty())
         return;
+    CivService pm = ServiceOf(cfg_.serv.pm_control);
 
     constexpr const char *kPmCtrlSock = "/tmp/qmp-pm-sock";
-    std::size_t pos = pm.find_first_of(' ');
+    std::size_t pos = pm.cmd.find_first_of(' ');
     if (pos != std::string::npos) {
-        pm.insert(pos + 1, std::string(kPmCtrlSock) + " ");
+        pm.cmd.insert(pos + 1, std::string(kPmCtrlSock) + " ");
     } else {
-        pm.append(" " + std::string(kPmCtrlSock));
+        pm.cmd.append(" " + std::string(kPmCtrlSock));
     }
-    co_procs_.emplace_back(std::make_unique<VmProcSimple>(pm));
-    emul_cmd_.append(" -qmp unix:" + std::string(kPmCtrlSock) + ",server=on,wait=off -no-reboot");
+    AddCoProc(std::move(pm));
+    AddArg(" -qmp unix:" + std::string(kPmCtrlSock) + ",server=on,wait=off -no-reboot");
 }
 
 static int GetUid(void) {
@@ -521,10 +562,10 @@ static int GetUid(void) {
 
 void VmBuilderQemu::BuildAudioCmd(void) {
     int uid = GetUid();
-    if (cfg_.GetValue(kGroupAudio, kDisableEmul).compare("true") == 0)
+    if (cfg_.audio.disable_emulation)
         return;
 
-    emul_cmd_.append(" -device intel-hda"
+    AddArg(" -device intel-hda"
                      " -device hda-duplex,audiodev=android_spk"
                      " -audiodev id=android_spk,timer-period=5000,driver=pa,"
                      "in.fixed-settings=off,out.fixed-settings=off,server=/run/user/" + std::to_string(uid) +
@@ -532,14 +573,14 @@ void VmBuilderQemu::BuildAudioCmd(void) {
 }
 
 void VmBuilderQemu::BuildExtraCmd(void) {
-    std::string ex_cmd = cfg_.GetValue(kGroupExtra, kExtraCmd);
+    std::string ex_cmd = cfg_.extra.cmd;
     if (ex_cmd.empty())
         return;
-    emul_cmd_.append(" " + ex_cmd);
+    AddArg(" " + ex_cmd);
 }
 
 void VmBuilderQemu::SetExtraServices(void) {
-    std::string ex_srvs = cfg_.GetValue(kGroupExtra, kExtraService);
+    std::string ex_srvs = cfg_.extra.service;
     boost::trim(ex_srvs);
     if (ex_srvs.empty())
         return;
@@ -551,12 +592,12 @@ void VmBuilderQemu::SetExtraServices(void) {
         if (it->empty())
             continue;
 
-        co_procs_.emplace_back(std::make_unique<VmProcSimple>(*it));
+        AddCoProc(ServiceOf(*it));
     }
 }
 
 bool VmBuilderQemu::BuildEmulPath(void) {
-    std::string str_emul_path = cfg_.GetValue(kGroupEmul, kEmulPath);
+    std::string str_emul_path = cfg_.emul.path;
     boost::filesystem::path emul_path;
     boost::system::error_code ec;
     if (boost::filesystem::exists(str_emul_path, ec)) {
@@ -571,12 +612,12 @@ bool VmBuilderQemu::BuildEmulPath(void) {
     if (emul_path.empty()) {
         return false;
     }
-    emul_cmd_.assign(emul_path.c_str());
+    plan_.emul_path.assign(emul_path.c_str());
     return true;
 }
 
 void VmBuilderQemu::BuildFixedCmd(void) {
-    emul_cmd_.append(
+    AddArg(
         " -M q35"
         " -machine kernel_irqchip=on"
         " -k en-us"
@@ -585,29 +626,27 @@ void VmBuilderQemu::BuildFixedCmd(void) {
         " -device qemu-xhci,id=xhci,p2=8,p3=8"
         " -device usb-mouse"
         " -device usb-kbd");
-    emul_cmd_.append(
+    AddArg(
         /* Make sure this device be the last argument */
         " -device intel-iommu,device-iotlb=on,caching-mode=on"
         " -nodefaults ");
 }
 
 bool VmBuilderQemu::BuildNameQmp(void) {
-    std::string vm_name = cfg_.GetValue(kGroupGlob, kGlobName);
+    std::string vm_name = cfg_.glob.name;
     boost::trim(vm_name);
-    if (vm_name.empty()) {
-        emul_cmd_.clear();
+    if (vm_name.empty())
         return false;
-    }
-    emul_cmd_.append(" -name " + vm_name);
+    AddArg(" -name " + vm_name);
     std::vector<std::string> name_param;
     boost::split(name_param, vm_name, boost::is_any_of(","));
-    emul_cmd_.append(" -qmp unix:" + std::string(GetConfigPath()) + "/." + name_param[0] +
-                     ".qmp.unix.socket,server,nowait");
+    plan_.qmp_sock = std::string(GetConfigPath()) + "/." + name_param[0] + ".qmp.unix.socket";
+    AddArg(" -qmp unix:" + plan_.qmp_sock + ",server,nowait");
     return true;
 }
 
 void VmBuilderQemu::BuildNetCmd(void) {
-    std::string model = cfg_.GetValue(kGroupNet, kNetModel);
+    std::string model = cfg_.net.model;
     if (model.empty())
         model = "e1000";
 
@@ -615,112 +654,101 @@ void VmBuilderQemu::BuildNetCmd(void) {
         return;
 
     std::string net_arg = " -netdev user,id=net0";
-    std::string adb_port = cfg_.GetValue(kGroupNet, kNetAdbPort);
-    if (!adb_port.empty())
-        net_arg.append(",hostfwd=tcp::" + adb_port + "-:5555");
-    std::string fb_port = cfg_.GetValue(kGroupNet, kNetFastbootPort);
-    if (!fb_port.empty())
-        net_arg.append(",hostfwd=tcp::" + fb_port + "-:5554");
+    if (cfg_.net.adb_port)
+        net_arg.append(",hostfwd=tcp::" + std::to_string(cfg_.net.adb_port) + "-:5555");
+    if (cfg_.net.fastboot_port)
+        net_arg.append(",hostfwd=tcp::" + std::to_string(cfg_.net.fastboot_port) + "-:5554");
+
+    AddArg(net_arg);
+    AddArg(" -device "+ model + ",netdev=net0,bus=pcie.0,addr=0xA");
+}
 
-    emul_cmd_.append(net_arg);
-    emul_cmd_.append(" -device "+ model + ",netdev=net0,bus=pcie.0,addr=0xA");
+void VmBuilderQemu::BuildVsockCmd(void) {
+    plan_.vsock_cid = cfg_.glob.vsock_cid;
+    AddArg(VmLaunchPlan::kArgVsockCid, " -device vhost-vsock-pci,id=vhost-vsock-pci0,bus=pcie.0,addr=0x10,guest-cid=");
 }
 
-bool VmBuilderQemu::BuildVsockCmd(void) {
-    std::string str_cid = cfg_.GetValue(kGroupGlob, kGlobCid);
-    if (str_cid.empty()) {
+bool VmBuilderQemu::AcquireVsockCid(void) {
+    if (plan_.vsock_cid == 0) {
         vsock_cid_ = VsockCidPool::Pool().GetCid();
         if (vsock_cid_ == 0) {
-            emul_cmd_.clear();
+            LOG(error) << "No free cid in cid pool!";
             return false;
         }
     } else {
-        try {
-            vsock_cid_ = VsockCidPool::Pool().GetCid(std::stoul(str_cid));
-            if (vsock_cid_ == 0) {
-                LOG(error) << "Cannot acquire cid(" << str_cid << ") from cid pool!";
-                emul_cmd_.clear();
-                return false;
-            }
-        } catch (std::exception &e) {
-            LOG(error) << "Invalid Cid!" << e.what();
-            emul_cmd_.clear();
+        vsock_cid_ = VsockCidPool::Pool().GetCid(plan_.vsock_cid);
+        if (vsock_cid_ == 0) {
+            LOG(error) << "Cannot acquire cid(" << plan_.vsock_cid << ") from cid pool!";
             return false;
         }
     }
-    emul_cmd_.append(" -device vhost-vsock-pci,id=vhost-vsock-pci0,bus=pcie.0,addr=0x10,guest-cid=" +
-                    std::to_string(vsock_cid_));
     return true;
 }
 
 void VmBuilderQemu::BuildRpmbCmd(void) {
-    std::string rpmb_bin = cfg_.GetValue(kGroupRpmb, kRpmbBinPath);
-    std::string rpmb_data = cfg_.GetValue(kGroupRpmb, kRpmbDataDir);
+    std::string rpmb_bin = cfg_.rpmb.bin_path;
+    std::string rpmb_data = cfg_.rpmb.data_dir;
     time_t rawtime;
     struct tm timeinfo;
     char t_buf[80];
     time(&rawtime);
     localtime_r(&rawtime, &timeinfo);
     strftime(t_buf, 80 , "%Y-%m-%d_%T", &timeinfo);
-    std::string rpmb_sock = std::string(kRpmbSockPrefix) + t_buf;
+    /* Guests of the same config may boot in the same second */
+    std::string rpmb_sock = std::string(kRpmbSockPrefix) + name_ + "_" + t_buf;
 
     if (!rpmb_bin.empty() && !rpmb_data.empty()) {
-        emul_cmd_.append(" -device virtio-serial,addr=1"
+        AddArg(" -device virtio-serial,addr=1"
                          " -device virtserialport,chardev=rpmb0,name=rpmb0,nr=1"
                           " -chardev socket,id=rpmb0,path=" + rpmb_sock);
-        co_procs_.emplace_back(std::make_unique<VmCoProcRpmb>(std::move(rpmb_bin), std::move(rpmb_data),
-                               std::move(rpmb_sock)));
+        plan_.co_procs.push_back({VmLaunchPlan::kCoProcRpmb, std::move(rpmb_bin), std::move(rpmb_data),
+                                  std::move(rpmb_sock)});
     }
 }
 
 void VmBuilderQemu::BuildVtpmCmd(void) {
-    std::string vtpm_bin = cfg_.GetValue(kGroupVtpm, kVtpmBinPath);
-    std::string vtpm_data = cfg_.GetValue(kGroupVtpm, kVtpmDataDir);
+    std::string vtpm_bin = cfg_.vtpm.bin_path;
+    std::string vtpm_data = cfg_.vtpm.data_dir;
     if (!vtpm_bin.empty() && !vtpm_data.empty()) {
-        emul_cmd_.append(" -chardev socket,id=chrtpm,path=" +
+        AddArg(" -chardev socket,id=chrtpm,path=" +
                          vtpm_data + "/" + kVtpmSock +
                          " -tpmdev emulator,id=tpm0,chardev=chrtpm -device tpm-crb,tpmdev=tpm0");
-        co_procs_.emplace_back(std::make_unique<VmCoProcVtpm>(std::move(vtpm_bin), std::move(vtpm_data)));
+        plan_.co_procs.push_back({VmLaunchPlan::kCoProcVtpm, std::move(vtpm_bin), std::move(vtpm_data), ""});
     }
 }
 
-void VmBuilderQemu::InitAafCfg(void) {
-    std::string aaf_path = cfg_.GetValue(kGroupAaf, kAafPath);
-    if (!aaf_path.empty()) {
-        aaf_cfg_ = std::make_unique<Aaf>(aaf_path.c_str());
-    }
-}
 
 bool VmBuilderQemu::BuildAafCfg(void) {
-    std::string aaf_path = cfg_.GetValue(kGroupAaf, kAafPath);
+    std::string aaf_path = cfg_.aaf.path;
     if (!aaf_path.empty()) {
-        std::string aaf_suspend = cfg_.GetValue(kGroupAaf, kAafSuspend);
+        std::string aaf_suspend = cfg_.aaf.support_suspend;
         if (!aaf_suspend.empty()) {
             if (aaf_suspend.compare("true") == 0 || aaf_suspend.compare("enable") == 0) {
-                aaf_cfg_->Set(kAafKeySuspend, "true");
+                plan_.aaf_data[kAafKeySuspend] = "true";
             } else if (aaf_suspend.compare("false") == 0 || aaf_suspend.compare("disable") == 0) {
-                aaf_cfg_->Set(kAafKeySuspend, "false");
+                plan_.aaf_data[kAafKeySuspend] = "false";
             } else {
                 LOG(error) << "Invalid value of 'support_suspend'";
                 return false;
             }
         }
 
-        std::string aaf_audio_type = cfg_.GetValue(kGroupAaf, kAafAudioType);
+        std::string aaf_audio_type = cfg_.aaf.audio_type;
         if (!aaf_audio_type.empty()) {
-            aaf_cfg_->Set(kAafKeyAudioType, aaf_audio_type);
+            plan_.aaf_data[kAafKeyAudioType] = aaf_audio_type;
         }
 
-        emul_cmd_.append(" -virtfs local,mount_tag=aaf,security_model=none,path=" + aaf_path);
+        plan_.aaf_path = aaf_path;
+        AddArg(" -virtfs local,mount_tag=aaf,security_model=none,path=" + aaf_path);
     }
     return true;
 }
 
 bool VmBuilderQemu::BuildVgpuCmd(void) {
-    std::string vgpu_type = cfg_.GetValue(kGroupVgpu, kVgpuType);
+    std::string vgpu_type = cfg_.vgpu.type;
     if (!vgpu_type.empty()) {
         if (vgpu_type.compare(kVgpuGvtG) == 0) {
-            std::string vgpu_uuid = cfg_.GetValue(kGroupVgpu, kVgpuUuid);
+            std::string vgpu_uuid = cfg_.vgpu.vgpu_uuid;
             if (vgpu_uuid.empty()) {
                 LOG(error) << "Empty VGPU UUID!";
                 return false;
@@ -729,48 +757,32 @@ bool VmBuilderQemu::BuildVgpuCmd(void) {
                 return false;
             }
 
-            if (!CreateGvtgVgpu()) {
-                return false;
-            }
+            plan_.gvtg_version = cfg_.vgpu.gvtg_version;
+            plan_.gvtg_uuid = vgpu_uuid;
 
-            emul_cmd_.append(" -device vfio-pci-nohotplug,ramfb=on,display=on,addr=2.0,x-igd-opregion=on,sysfsdev=" +
+            AddArg(" -device vfio-pci-nohotplug,ramfb=on,display=on,addr=2.0,x-igd-opregion=on,sysfsdev=" +
                              std::string(kIntelGpuDevPath) + vgpu_uuid);
-            if (aaf_cfg_)
-                aaf_cfg_->Set(kAafKeyGpuType, "gvtg");
+            plan_.aaf_data[kAafKeyGpuType] = "gvtg";
         } else if (vgpu_type.compare(kVgpuGvtD) == 0) {
-            SoundCardHook();
-            if (!PassthroughGpu()) {
-                return false;
-            }
-            emul_cmd_.append(" -vga none -nographic"
+            plan_.gvtd = true;
+            AddArg(" -vga none -nographic"
                 " -device vfio-pci,host=00:02.0,x-igd-gms=2,id=hostdev0,bus=pcie.0,addr=0x2,x-igd-opregion=on"
                 " -display none");
-            if (aaf_cfg_)
-                aaf_cfg_->Set(kAafKeyGpuType, "gvtd");
+            plan_.aaf_data[kAafKeyGpuType] = "gvtd";
         } else if (vgpu_type.compare(kVgpuVirtio) == 0) {
-            emul_cmd_.append(" -device virtio-vga-gl");
-            std::string outputs = cfg_.GetValue(kGroupVgpu, kVgpuOutputs);
-            if (!outputs.empty()) {
-                std::size_t pos{};
-                int o = std::stoi(outputs, &pos, 10);
-                if (pos == outputs.size())
-                    emul_cmd_.append(",max_outputs=" + outputs);
-            }
-            if (aaf_cfg_)
-                aaf_cfg_->Set(kAafKeyGpuType, "virtio");
+            AddArg(" -device virtio-vga-gl");
+            if (cfg_.vgpu.outputs)
+                AddArg(",max_outputs=" + std::to_string(cfg_.vgpu.outputs));
+            plan_.aaf_data[kAafKeyGpuType] = "virtio";
         } else if (vgpu_type.compare(kVgpuRamfb) == 0) {
-            emul_cmd_.append(" -device ramfb");
+            AddArg(" -device ramfb");
         } else if (vgpu_type.compare(kVgpuVirtio2D) == 0) {
-            emul_cmd_.append(" -device virtio-vga");
-            if (aaf_cfg_)
-                aaf_cfg_->Set(kAafKeyGpuType, "virtio");
+            AddArg(" -device virtio-vga");
+            plan_.aaf_data[kAafKeyGpuType] = "virtio";
         } else if (vgpu_type.compare(kVgpuSriov) == 0) {
-            if (!SetupSriov()) {
-                LOG(error) << "Failed to setup SRIOV!";
+            if (!PlanSriov())
                 return false;
-            }
-            if (aaf_cfg_)
-                aaf_cfg_->Set(kAafKeyGpuType, "sriov");
+            plan_.aaf_data[kAafKeyGpuType] = "sriov";
         } else {
             LOG(warning) << "Invalid Graphics config";
             return false;
@@ -780,57 +792,102 @@ bool VmBuilderQemu::BuildVgpuCmd(void) {
 }
 
 void VmBuilderQemu::BuildVinputCmd(void) {
-    std::string vgpu_type = cfg_.GetValue(kGroupVgpu, kVgpuType);
-    std::string vinput = cfg_.GetValue(kGroupService, kServVinput);
+    std::string vgpu_type = cfg_.vgpu.type;
 
-    if (vinput.empty()) {
+    if (cfg_.serv.vinput.empty()) {
         LOG(warning) << "vinput-manager not found";
         return;
     }
+    CivService vinput = ServiceOf(cfg_.serv.vinput);
 
     if (vgpu_type.compare(kVgpuGvtD) == 0) {
-        vinput.append(" --gvtd");
-        emul_cmd_.append(
+        vinput.cmd.append(" --gvtd");
+        AddArg(
             " -qmp unix:./qmp-vinput-sock,server,nowait"
             " -device virtio-input-host-pci,evdev=/dev/input/by-id/Power-Button-vm0"
             " -device virtio-input-host-pci,evdev=/dev/input/by-id/Volume-Button-vm0"
             " -device virtio-input-host-pci,evdev=/dev/input/by-id/Other-Button-vm0");
     } else {
-        emul_cmd_.append(
+        AddArg(
             " -device virtio-input-host-pci,evdev=/dev/input/by-id/Power-Button-vm0"
             " -device virtio-input-host-pci,evdev=/dev/input/by-id/Volume-Button-vm0"
             " -device virtio-input-host-pci,evdev=/dev/input/by-id/Other-Button-vm0");
     }
-    co_procs_.emplace_back(std::make_unique<VmProcSimple>(vinput));
+    AddCoProc(std::move(vinput));
 }
 
 void VmBuilderQemu::BuildDispCmd(void) {
-    std::string disp_op = cfg_.GetValue(kGroupDisplay, kDispOptions);
+    std::string disp_op = cfg_.disp.options;
     if (disp_op.empty()) {
-        emul_cmd_.append(" -display gtk,gl=on");
+        AddArg(" -display gtk,gl=on");
         return;
     }
 
-    emul_cmd_.append(" -display " + disp_op);
+    AddArg(" -display " + disp_op);
+}
+
+/* A size as accepted by -m, a number without suffix is in MB */
+static uint64_t MemSizeMb(const std::string &size) {
+    uint64_t bytes = 0;
+    ParseCivSize(size, 1_MB, &bytes);
+    return bytes / 1_MB;
+}
+
+/*
+ * The system image is mapped read-only and shared by every guest using it,
+ * so its pages are in the host page cache once, and the guest reads them
+ * with DAX instead of keeping its own copy.
+ */
+bool VmBuilderQemu::PlanSystemImage(void) {
+    const std::string &img = cfg_.disk.system_image;
+    if (img.empty())
+        return true;
+
+    if (cfg_.mem.size.empty()) {
+        LOG(error) << "A system image needs the memory size to be set";
+        return false;
+    }
+    boost::system::error_code ec;
+    uint64_t size = boost::filesystem::file_size(img, ec);
+    if (ec) {
+        LOG(error) << "Cannot read system image " << img << ": " << ec.message();
+        return false;
+    }
+    /* The mapping cannot grow a read-only file, and device memory is plugged in 2M blocks */
+    if ((size == 0) || (size % 2_MB)) {
+        LOG(error) << "Size of system image " << img << " must be a multiple of 2M";
+        return false;
+    }
+    plan_.sysimg_size = size;
+    return true;
 }
 
 void VmBuilderQemu::BuildMemCmd(void) {
-    emul_cmd_.append(" -m " + cfg_.GetValue(kGroupMem, kMemSize));
+    if (cfg_.mem.size.empty())
+        return;
+    std::string mem = " -m " + cfg_.mem.size;
+    /* virtio-pmem memory is plugged above the RAM */
+    if (plan_.sysimg_size)
+        mem += ",slots=1,maxmem=" + std::to_string(MemSizeMb(cfg_.mem.size) + plan_.sysimg_size / 1_MB) + "M";
+    AddArg(mem);
 }
 
 void VmBuilderQemu::BuildVcpuCmd(void) {
-    emul_cmd_.append(" -smp " + cfg_.GetValue(kGroupVcpu, kVcpuNum));
+    if (cfg_.vcpu.num)
+        AddArg(" -smp " + std::to_string(cfg_.vcpu.num));
 }
 
 bool VmBuilderQemu::BuildFirmwareCmd(void) {
-    std::string firm_type = cfg_.GetValue(kGroupFirm, kFirmType);
+    std::string firm_type = cfg_.firm.type;
     if (firm_type.empty())
         return false;
+    /* The firmware variables are written like a disk */
+    std::string snapshot = cfg_.disk.snapshot ? ",snapshot=on" : "";
     if (firm_type.compare(kFirmUnified) == 0) {
-        emul_cmd_.append(" -drive if=pflash,format=raw,file=" + cfg_.GetValue(kGroupFirm, kFirmPath));
+        AddArg(" -drive if=pflash,format=raw,file=" + cfg_.firm.path + snapshot);
     } else if (firm_type.compare(kFirmSplited) == 0) {
-        emul_cmd_.append(" -drive if=pflash,format=raw,readonly,file=" + cfg_.GetValue(kGroupFirm, kFirmCode));
-        emul_cmd_.append(" -drive if=pflash,format=raw,file=" + cfg_.GetValue(kGroupFirm, kFirmVars));
+        AddArg(" -drive if=pflash,format=raw,readonly,file=" + cfg_.firm.code);
+        AddArg(" -drive if=pflash,format=raw,file=" + cfg_.firm.vars + snapshot);
     } else {
         LOG(error) << "Invalid virtual firmware";
         return false;
@@ -838,10 +895,59 @@ bool VmBuilderQemu::BuildFirmwareCmd(void) {
     return true;
 }
 
-void VmBuilderQemu::BuildVdiskCmd(void) {
-    emul_cmd_.append(
-        " -drive file="+ cfg_.GetValue(kGroupDisk, kDiskPath) + ",if=none,id=disk1,discard=unmap,detect-zeroes=unmap"
-        " -device virtio-blk-pci,drive=disk1,bootindex=1");
+/*
+ * Every disk gets the same I/O profile. With an iothread the virtqueues are
+ * served outside of the main loop, and one queue per vCPU lets the guest
+ * submit from all of them without sharing a ring.
+ */
+bool VmBuilderQemu::BuildVdiskCmd(void) {
+    const CivVmConfig::Disk &disk = cfg_.disk;
+    /* Linux AIO is only asynchronous on O_DIRECT files */
+    if ((disk.aio == kDiskAioNative) && (disk.cache != kDiskCacheNone) && (disk.cache != kDiskCacheDirectsync)) {
+        LOG(error) << "aio=native needs cache=none or cache=directsync";
+        return false;
+    }
+
+    std::string drive_opts;
+    if (!disk.aio.empty())
+        drive_opts += ",aio=" + disk.aio;
+    if (!disk.cache.empty())
+        drive_opts += ",cache=" + disk.cache;
+    if (disk.snapshot)
+        drive_opts += ",snapshot=on";
+
+    uint32_t queues = disk.queues;
+    if ((queues == 0) && disk.iothread)
+        queues = cfg_.vcpu.num;
+
+    auto paths = CivDiskPaths(cfg_);
+    for (size_t i = 0; i < paths.size(); i++) {
+        std::string id = "disk" + std::to_string(i + 1);
+        std::string dev = " -device virtio-blk-pci,drive=" + id;
+        if (disk.iothread) {
+            AddArg(" -object iothread,id=iothread-" + id);
+            dev += ",iothread=iothread-" + id;
+        }
+        if (queues)
+            dev += ",num-queues=" + std::to_string(queues);
+        std::string fmt;
+        if (i == 0) {
+            dev += ",bootindex=1";
+            /* Created by the flasher, no need to probe it */
+            if (!disk.format.empty())
+                fmt = ",format=" + disk.format;
+        }
+
+        AddArg(" -drive file=" + paths[i] + ",if=none,id=" + id + ",discard=unmap,detect-zeroes=unmap" +
+               fmt + drive_opts + dev);
+    }
+
+    if (plan_.sysimg_size) {
+        AddArg(" -object memory-backend-file,id=sysimg,mem-path=" + cfg_.disk.system_image +
+               ",size=" + std::to_string(plan_.sysimg_size) + ",share=on,readonly=on"
+               " -device virtio-pmem-pci,memdev=sysimg,id=sysimg0");
+    }
+    return true;
 }
 
 bool VmBuilderQemu::BuildVmArgs(void) {
@@ -857,8 +963,6 @@ bool VmBuilderQemu::BuildVmArgs(void) {
 
     BuildDispCmd();
 
-    InitAafCfg();
-
     if (!BuildVgpuCmd())
         return false;
 
@@ -869,11 +973,13 @@ bool VmBuilderQemu::BuildVmArgs(void) {
 
     BuildNetCmd();
 
-    if (!BuildVsockCmd())
-        return false;
+    BuildVsockCmd();
 
     BuildVtpmCmd();
 
+    if (!PlanSystemImage())
+        return false;
+
     BuildMemCmd();
 
     BuildVcpuCmd();
@@ -881,10 +987,10 @@ bool VmBuilderQemu::BuildVmArgs(void) {
     if (!BuildFirmwareCmd())
         return false;
 
-    BuildVdiskCmd();
+    if (!BuildVdiskCmd())
+        return false;
 
     BuildPtPciDevicesCmd();
-    SetPciDevicesCallback();
 
     RunMediationSrv();
 
@@ -901,18 +1007,244 @@ bool VmBuilderQemu::BuildVmArgs(void) {
 
     SetExtraServices();
 
-    if (aaf_cfg_)
-        aaf_cfg_->Flush();
+    SetState(VmBuilder::VmState::kVmCreated);
+
+    return true;
+}
+
+void VmBuilderQemu::AddArg(std::string text) {
+    plan_.args.push_back({VmLaunchPlan::kArgText, std::move(text)});
+}
+
+void VmBuilderQemu::AddArg(VmLaunchPlan::ArgKind kind, std::string text) {
+    plan_.args.push_back({kind, std::move(text)});
+}
+
+void VmBuilderQemu::AddCoProc(CivService svc) {
+    plan_.co_procs.push_back({VmLaunchPlan::kCoProcSimple, std::move(svc.cmd), "", "", std::move(svc.restart),
+                              std::move(svc.probe)});
+}
+
+bool VmBuilderQemu::AcquireResources(void) {
+    if (!AcquireVsockCid())
+        return false;
+
+    if (!plan_.gvtg_uuid.empty() && !CreateGvtgVgpu()) {
+        LOG(error) << "Failed to create GVT-g vgpu!";
+        return false;
+    }
+
+    if (plan_.gvtd) {
+        SoundCardHook();
+        if (!PassthroughGpu())
+            return false;
+    }
+
+    if (plan_.sriov && !SetupSriov()) {
+        LOG(error) << "Failed to setup SRIOV!";
+        return false;
+    }
+
+    PassthroughPciDevices();
+    SetPciDevicesCallback();
+
+    for (auto &a : plan_.args) {
+        if (a.kind == VmLaunchPlan::kArgPwrQmp) {
+            AcquirePwrQmpSocket();
+            break;
+        }
+    }
+
+    if (!plan_.aaf_path.empty()) {
+        Aaf aaf(plan_.aaf_path.c_str());
+        for (auto &kv : plan_.aaf_data)
+            aaf.Set(kv.first, kv.second);
+        aaf.Flush();
+    }
+    return true;
+}
+
+void VmBuilderQemu::RenderEmulCmd(void) {
+    emul_cmd_.assign(plan_.emul_path);
+    for (auto &a : plan_.args) {
+        switch (a.kind) {
+            case VmLaunchPlan::kArgText:
+                emul_cmd_.append(a.text);
+                break;
+            case VmLaunchPlan::kArgVsockCid:
+                emul_cmd_.append(a.text + std::to_string(vsock_cid_));
+                break;
+            case VmLaunchPlan::kArgSriovVf:
+                emul_cmd_.append(a.text + std::to_string(sriov_vf_));
+                break;
+            case VmLaunchPlan::kArgPciDev:
+                /* Devices failed to passthrough are skipped */
+                if (pci_pt_dev_set_.count(a.text))
+                    emul_cmd_.append(" -device vfio-pci,host=" + a.text + ",x-no-kvm-intx=on");
+                break;
+            case VmLaunchPlan::kArgPwrQmp:
+                if (!pwr_qmp_sock_.empty())
+                    emul_cmd_.append(" -qmp unix:" + pwr_qmp_sock_ + ",server,nowait");
+                break;
+        }
+    }
+
+    if (restore_mode_ == kSnapshotModeMappedRam) {
+        emul_cmd_.append(" -global migration.x-mapped-ram=on -incoming file:" +
+                         VmSnapshot(name_).StatePath());
+    } else if (!restore_mode_.empty()) {
+        emul_cmd_.append(" -incoming \"exec:cat " + VmSnapshot(name_).StatePath() + "\"");
+    }
+}
 
-    main_proc_ = std::make_unique<VmProcSimple>(emul_cmd_);
+bool VmBuilderQemu::PrepareBoot(void) {
+    if (main_proc_)
+        return true;
 
-    state_ = VmBuilder::VmState::kVmCreated;
+    if (!AcquireResources()) {
+        /* Roll back whatever has been acquired */
+        StopVm();
+        return false;
+    }
+
+    RenderEmulCmd();
+
+    for (auto &c : plan_.co_procs) {
+        switch (c.kind) {
+            case VmLaunchPlan::kCoProcSimple:
+                co_procs_.emplace_back(std::make_unique<VmProcSimple>(c.cmd));
+                break;
+            case VmLaunchPlan::kCoProcRpmb:
+                co_procs_.emplace_back(std::make_unique<VmCoProcRpmb>(c.cmd, c.data, c.sock));
+                break;
+            case VmLaunchPlan::kCoProcVtpm:
+                co_procs_.emplace_back(std::make_unique<VmCoProcVtpm>(c.cmd, c.data));
+                break;
+        }
+        const std::string &restart = c.restart.empty() ? cfg_.serv.coproc_restart : c.restart;
+        co_procs_.back()->SetRestartPolicy(RestartPolicyFromStr(restart));
+        if (!c.probe.empty())
+            co_procs_.back()->SetReadyProbe(ProbeOf(c.probe));
+    }
 
+    auto main_proc = std::make_shared<VmProcSimple>(emul_cmd_);
+    main_proc->SetEnv(env_data_);
+    std::scoped_lock lock(stopvm_mutex_);
+    main_proc_ = std::move(main_proc);
     return true;
 }
 
+bool VmBuilderQemu::PrepareRestore(void) {
+    if (main_proc_) {
+        LOG(error) << "VM " << name_ << " is already prepared for a boot";
+        return false;
+    }
+
+    VmSnapshot snap(name_);
+    std::string mode;
+    if (!snap.Check(cfg_, &mode))
+        return false;
+
+    /* The guest expects the TPM and RPMB contents it had when it was saved */
+    if (!cfg_.vtpm.data_dir.empty() &&
+        !VmSnapshot::CopyFiles(snap.Dir() + "/" + kSnapshotVtpmDir, cfg_.vtpm.data_dir))
+        return false;
+    if (!cfg_.rpmb.data_dir.empty() &&
+        !VmSnapshot::CopyFiles(snap.Dir() + "/" + kSnapshotRpmbDir, cfg_.rpmb.data_dir))
+        return false;
+
+    restore_mode_ = mode;
+    if (!PrepareBoot()) {
+        restore_mode_.clear();
+        return false;
+    }
+    LOG(info) << "VM " << name_ << " restores from " << snap.Dir();
+    return true;
+}
+
+bool VmBuilderQemu::SaveVm(void) {
+    if (plan_.gvtd || plan_.sriov || !plan_.pt_pci_devs.empty()) {
+        LOG(error) << "VM " << name_ << " has passthrough devices, its state cannot be saved";
+        return false;
+    }
+    VmBuilder::VmState st = GetState();
+    if ((st != VmBuilder::VmState::kVmRunning) && (st != VmBuilder::VmState::kVmPaused)) {
+        LOG(error) << "VM " << name_ << " is not running, nothing to save";
+        return false;
+    }
+    auto qmp = GetQmp();
+    if (!qmp) {
+        LOG(error) << "VM " << name_ << " has no QMP monitor";
+        return false;
+    }
+
+    VmSnapshot snap(name_);
+    if (!snap.Begin())
+        return false;
+
+    if ((st == VmBuilder::VmState::kVmRunning) && !PauseVm())
+        return false;
+
+    if (!SaveState(qmp.get(), &snap)) {
+        /* Let the guest go on as it was */
+        if (st == VmBuilder::VmState::kVmRunning)
+            ResumeVm();
+        return false;
+    }
+
+    /* Disks must stay as saved, so the guest does not run on after the snapshot */
+    qmp->Execute("quit", "", nullptr, kQmpCmdTimeout);
+    LOG(info) << "VM " << name_ << " saved to " << snap.Dir();
+    return true;
+}
+
+bool VmBuilderQemu::SaveState(QmpClient *qmp, VmSnapshot *snap) {
+    /* mapped-ram writes each page at a fixed offset, so the file is loaded in parallel and stays sparse */
+    std::string mode = kSnapshotModeMappedRam;
+    std::string uri = "file:" + snap->StatePath();
+    if (!qmp->Execute("migrate-set-capabilities",
+                      "{\"capabilities\":[{\"capability\":\"mapped-ram\",\"state\":true}]}",
+                      nullptr, kQmpCmdTimeout)) {
+        LOG(info) << "VM " << name_ << ": mapped-ram is not supported, save as a stream";
+        mode = kSnapshotModeStream;
+        uri = "exec:cat > " + snap->StatePath();
+    }
+
+    if (!qmp->Execute("migrate", "{\"uri\":" + QmpClient::Quote(uri) + "}", nullptr, kQmpCmdTimeout))
+        return false;
+
+    auto deadline = std::chrono::steady_clock::now() + kSnapshotSaveTimeout;
+    std::string status;
+    while (std::chrono::steady_clock::now() < deadline) {
+        boost::property_tree::ptree ret;
+        if (!qmp->Execute("query-migrate", "", &ret, kQmpCmdTimeout))
+            break;
+        status = ret.get<std::string>("status", "");
+        if ((status == "completed") || (status == "failed") || (status == "cancelled"))
+            break;
+        std::this_thread::sleep_for(kSnapshotPollInterval);
+    }
+    if (status != "completed") {
+        LOG(error) << "VM " << name_ << ": saving state did not complete, status: " << status;
+        qmp->Execute("migrate_cancel", "", nullptr, kQmpCmdTimeout);
+        return false;
+    }
+
+    /* Nothing changes them while the vCPUs are stopped */
+    if (!cfg_.vtpm.data_dir.empty() &&
+        !VmSnapshot::CopyFiles(cfg_.vtpm.data_dir, snap->Dir() + "/" + kSnapshotVtpmDir))
+        return false;
+    if (!cfg_.rpmb.data_dir.empty() &&
+        !VmSnapshot::CopyFiles(cfg_.rpmb.data_dir, snap->Dir() + "/" + kSnapshotRpmbDir))
+        return false;
+
+    return snap->Commit(cfg_, mode);
+}
+
 void VmBuilderQemu::SetProcessEnv(std::vector<std::string> env) {
-    main_proc_->SetEnv(env);
+    env_data_ = std::move(env);
+    if (main_proc_)
+        main_proc_->SetEnv(env_data_);
 }
 
 void VmBuilderQemu::SetProcLogDir(void) {
@@ -929,30 +1261,157 @@ void VmBuilderQemu::SetProcLogDir(void) {
     }
 }
 
-void VmBuilderQemu::StartVm() {
+/* Launch all co-processes at once, then wait until every readiness probe passes */
+bool VmBuilderQemu::StartCoProcs(void) {
+    std::vector<boost::thread> launchers;
+    for (auto &p : co_procs_) {
+        if (!p->Running())
+            launchers.emplace_back([proc = p.get()]() { proc->Run(); });
+    }
+    for (auto &t : launchers)
+        t.join();
+
+    std::vector<VmProcess *> pending;
+    for (auto &p : co_procs_)
+        pending.push_back(p.get());
+
+    auto deadline = std::chrono::steady_clock::now() + kCoProcReadyTimeout;
+    while (true) {
+        std::string err;
+        for (auto it = pending.begin(); it != pending.end();) {
+            switch ((*it)->ProbeReady(&err)) {
+                case kProbeReady:
+                    it = pending.erase(it);
+                    break;
+                case kProbeFailed:
+                    LOG(error) << "Co-process of " << name_ << " failed, " << err;
+                    return false;
+                default:
+                    ++it;
+                    break;
+            }
+        }
+        if (pending.empty())
+            return true;
+
+        if (std::chrono::steady_clock::now() >= deadline) {
+            for (auto p : pending) {
+                p->ProbeReady(&err);
+                LOG(error) << "Co-process of " << name_ << " not ready in "
+                           << kCoProcReadyTimeout.count() << "s, " << err;
+            }
+            return false;
+        }
+        std::this_thread::sleep_for(kCoProcProbeInterval);
+    }
+}
+
+bool VmBuilderQemu::StartVm() {
     LOG(info) << "Emulator command:" << emul_cmd_;
 
     if (!main_proc_) {
         LOG(error) << "VM's main proc is not build up!";
-        return;
+        return false;
     }
 
     SetProcLogDir();
 
-    for (size_t i = 0; i < co_procs_.size(); ++i) {
-        if (!co_procs_[i]->Running())
-            co_procs_[i]->Run();
+    if (!StartCoProcs()) {
+        StopVm();
+        return false;
     }
 
     main_proc_->Run();
     LOG(info) << "Main Proc is started";
-    state_ = VmBuilder::VmState::kVmBooting;
+    SetState(VmBuilder::VmState::kVmBooting);
+
+    ConnectQmp();
+    if (!restore_mode_.empty() && !RunRestored()) {
+        StopVm();
+        return false;
+    }
+    return true;
+}
+
+void VmBuilderQemu::ConnectQmp(void) {
+    if (plan_.qmp_sock.empty())
+        return;
+
+    auto qmp = QmpClient::Create(plan_.qmp_sock);
+    qmp->SetEventCallback([this](const std::string &event, const boost::property_tree::ptree &data) {
+        OnQmpEvent(event, data);
+    });
+    /* The guest still works without the monitor, only control over QMP is lost */
+    if (!qmp->Connect(kQmpConnectTimeout)) {
+        LOG(warning) << "VM " << name_ << ": QMP monitor is not available";
+        qmp->Close();
+        return;
+    }
+
+    {
+        std::scoped_lock lock(stopvm_mutex_);
+        qmp_ = std::move(qmp);
+    }
+}
+
+/*
+ * Wait for the saved state to be loaded. SaveVm pauses the guest before
+ * saving it, and QEMU keeps an incoming guest paused like its source, so
+ * it is continued here. Ready only once the vCPUs run.
+ */
+bool VmBuilderQemu::RunRestored(void) {
+    auto qmp = GetQmp();
+    if (!qmp) {
+        LOG(error) << "VM " << name_ << ": the restore cannot be followed without QMP";
+        return false;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + kSnapshotSaveTimeout;
+    std::string status;
+    auto main_proc = GetMainProc();
+    while (std::chrono::steady_clock::now() < deadline) {
+        if (!main_proc || !main_proc->Running())
+            break;
+        boost::property_tree::ptree ret;
+        if (!qmp->Execute("query-status", "", &ret, kQmpCmdTimeout))
+            break;
+        status = ret.get<std::string>("status", "");
+        if (status != "inmigrate")
+            break;
+        std::this_thread::sleep_for(kSnapshotPollInterval);
+    }
+
+    if ((status == "paused") && qmp->Execute("cont", "", nullptr, kQmpCmdTimeout))
+        status = "running";
+    if (status != "running") {
+        LOG(error) << "VM " << name_ << ": restoring state did not complete, status: " << status;
+        return false;
+    }
+    SetVmReady();
+    return true;
+}
+
+void VmBuilderQemu::OnQmpEvent(const std::string &event, const boost::property_tree::ptree &data) {
+    if (event == "STOP") {
+        if (GetState() == VmBuilder::VmState::kVmRunning)
+            SetState(VmBuilder::VmState::kVmPaused);
+    } else if (event == "RESUME") {
+        if (GetState() == VmBuilder::VmState::kVmPaused)
+            SetState(VmBuilder::VmState::kVmRunning);
+        else if (!restore_mode_.empty() && (GetState() == VmBuilder::VmState::kVmBooting))
+            SetVmReady();
+    } else if (event == "SHUTDOWN" || event == "RESET") {
+        LOG(info) << "VM " << name_ << ": " << event << ", reason: " << data.get<std::string>("reason", "unknown");
+    }
 }
 
 bool VmBuilderQemu::WaitVmReady(void) {
+    auto main_proc = GetMainProc();
+    if (!main_proc)
+        return false;
     int wait_cnt = 0;
     while (wait_cnt++ < 200) {
-        if (!main_proc_->Running())
+        if (!main_proc->Running())
             return false;
         vm_ready_latch_.wait_for(boost::chrono::seconds(1));
 
@@ -966,20 +1425,84 @@ bool VmBuilderQemu::WaitVmReady(void) {
 void VmBuilderQemu::SetVmReady(void) {
     vm_ready_latch_.try_count_down();
 
-    state_ = VmBuilder::VmState::kVmRunning;
+    SetState(VmBuilder::VmState::kVmRunning);
+}
+
+std::shared_ptr<QmpClient> VmBuilderQemu::GetQmp(void) {
+    std::scoped_lock lock(stopvm_mutex_);
+    return qmp_;
+}
+
+std::shared_ptr<VmProcess> VmBuilderQemu::GetMainProc(void) {
+    std::scoped_lock lock(stopvm_mutex_);
+    return main_proc_;
+}
+
+bool VmBuilderQemu::PauseVm(void) {
+    if (GetState() != VmBuilder::VmState::kVmRunning) {
+        LOG(error) << "VM " << name_ << " is not running, cannot pause";
+        return false;
+    }
+    auto qmp = GetQmp();
+    if (!qmp || !qmp->Execute("stop", "", nullptr, kQmpCmdTimeout))
+        return false;
+    /* The STOP event may not have arrived yet */
+    SetState(VmBuilder::VmState::kVmPaused);
+    return true;
+}
+
+bool VmBuilderQemu::ResumeVm(void) {
+    if (GetState() != VmBuilder::VmState::kVmPaused) {
+        LOG(error) << "VM " << name_ << " is not paused, cannot resume";
+        return false;
+    }
+    auto qmp = GetQmp();
+    if (!qmp || !qmp->Execute("cont", "", nullptr, kQmpCmdTimeout))
+        return false;
+    SetState(VmBuilder::VmState::kVmRunning);
+    return true;
+}
+
+std::vector<std::string> VmBuilderQemu::GetCoProcStats(void) {
+    std::scoped_lock lock(stopvm_mutex_);
+    std::vector<std::string> stats;
+    for (auto &p : co_procs_)
+        stats.push_back(p->GetStats());
+    return stats;
 }
 
-void VmBuilderQemu::PauseVm(void) {
+int VmBuilderQemu::GetExitCode(void) {
+    auto main_proc = GetMainProc();
+    if (!main_proc)
+        return -1;
+    return main_proc->ExitCode();
+}
+
+void VmBuilderQemu::NotifyVmExit(std::function<void(void)> cb) {
+    auto main_proc = GetMainProc();
+    if (main_proc)
+        main_proc->NotifyOnExit(std::move(cb));
+    else
+        cb();
 }
 
 void VmBuilderQemu::WaitVmExit() {
-    if (main_proc_) {
-        main_proc_->Join();
+    auto main_proc = GetMainProc();
+    if (main_proc) {
+        main_proc->Join();
     }
 }
 
 void VmBuilderQemu::StopVm() {
     std::scoped_lock lock(stopvm_mutex_);
+    StopVmLocked();
+}
+
+void VmBuilderQemu::StopVmLocked(void) {
+    if (qmp_) {
+        qmp_->Close();
+        qmp_.reset();
+    }
 
     if (main_proc_)
         main_proc_->Stop();
@@ -990,13 +1513,30 @@ void VmBuilderQemu::StopVm() {
     co_procs_.clear();
 
     VsockCidPool::Pool().ReleaseCid(vsock_cid_);
+    vsock_cid_ = 0;
 
+    /* Release in reverse order of acquisition */
     while (!end_call_.empty()) {
-        end_call_.front()();
-        end_call_.pop();
+        end_call_.back()();
+        end_call_.pop_back();
     }
 }
 
+void VmBuilderQemu::ResetVm(void) {
+    std::scoped_lock lock(stopvm_mutex_);
+    StopVmLocked();
+
+    main_proc_.reset();
+    emul_cmd_.clear();
+    pci_pt_dev_set_.clear();
+    pwr_qmp_sock_.clear();
+    restore_mode_.clear();
+    sriov_vf_ = -1;
+    vm_ready_latch_.reset(1);
+
+    SetState(VmBuilder::VmState::kVmCreated);
+}
+
 VmBuilderQemu::~VmBuilderQemu() {
     StopVm();
 }
@@ -15,7 +15,8 @@
 #include <set>
 #include <utility>
 #include <memory>
-#include <queue>
+#include <map>
+#include <functional>
 
 #include <boost/ptr_container/ptr_vector.hpp>
 #include <boost/thread/latch.hpp>
@@ -23,40 +24,108 @@
 #include "guest/config_parser.h"
 #include "guest/vm_builder.h"
 #include "guest/aaf.h"
+#include "guest/qmp_client.h"
+#include "guest/vm_snapshot.h"
 
 namespace vm_manager {
 
+/*
+ * Everything a boot needs, derived from the config only. Computing it does
+ * not touch host state, resources are acquired when the plan is applied.
+ */
+struct VmLaunchPlan {
+    enum ArgKind {
+        kArgText = 0,
+        /* Followed by the acquired vsock cid */
+        kArgVsockCid,
+        /* Followed by the acquired SRIOV VF number */
+        kArgSriovVf,
+        /* PCI device to passthrough, rendered only if passthrough succeeded */
+        kArgPciDev,
+        /* QMP socket for multi-OS power control, picked when applied */
+        kArgPwrQmp,
+    };
+    struct Arg {
+        ArgKind kind;
+        std::string text;
+    };
+
+    enum CoProcKind {
+        kCoProcSimple = 0,
+        kCoProcRpmb,
+        kCoProcVtpm,
+    };
+    struct CoProc {
+        CoProcKind kind;
+        std::string cmd;
+        std::string data;
+        std::string sock;
+        /* Empty for the default policy of the guest */
+        std::string restart;
+        /* "<kind>:<target>" of a declared readiness probe, or empty */
+        std::string probe;
+    };
+
+    std::string emul_path;
+    std::vector<Arg> args;
+    std::vector<CoProc> co_procs;
+
+    /* 0 to allocate from the cid pool */
+    uint32_t vsock_cid = 0;
+    std::string gvtg_version;
+    std::string gvtg_uuid;
+    bool gvtd = false;
+    bool sriov = false;
+    std::string hugepages_mem;
+    std::vector<std::string> pt_pci_devs;
+    bool hci_down = false;
+    /* Size of the shared system image exposed through virtio-pmem, 0 if none */
+    uint64_t sysimg_size = 0;
+    /* Monitor socket the daemon talks QMP to */
+    std::string qmp_sock;
+    std::string aaf_path;
+    std::map<std::string, std::string> aaf_data;
+};
+
 class VmBuilderQemu : public VmBuilder {
  public:
-    explicit VmBuilderQemu(std::string name, CivConfig cfg) :
+    explicit VmBuilderQemu(std::string name, CivVmConfig cfg) :
                        VmBuilder(name), cfg_(cfg), vm_ready_latch_(1) {}
     ~VmBuilderQemu();
     bool BuildVmArgs(void);
-    void StartVm(void);
+    bool StartVm(void);
     void StopVm(void);
     void WaitVmExit(void);
-    void PauseVm(void);
+    void NotifyVmExit(std::function<void(void)> cb);
+    bool PauseVm(void);
+    bool ResumeVm(void);
     bool WaitVmReady(void);
     void SetVmReady(void);
     void SetProcessEnv(std::vector<std::string> env);
+    int GetExitCode(void);
+    std::vector<std::string> GetCoProcStats(void);
+    void ResetVm(void);
+    bool PrepareBoot(void);
+    bool PrepareRestore(void);
+    bool SaveVm(void);
 
  private:
     bool BuildEmulPath(void);
     void BuildFixedCmd(void);
     bool BuildNameQmp(void);
     void BuildNetCmd(void);
-    bool BuildVsockCmd(void);
+    void BuildVsockCmd(void);
     void BuildRpmbCmd(void);
     void BuildVtpmCmd(void);
-    void InitAafCfg(void);
     bool BuildAafCfg(void);
     bool BuildVgpuCmd(void);
     void BuildVinputCmd(void);
     void BuildDispCmd(void);
+    bool PlanSystemImage(void);
     void BuildMemCmd(void);
     void BuildVcpuCmd(void);
     bool BuildFirmwareCmd(void);
-    void BuildVdiskCmd(void);
+    bool BuildVdiskCmd(void);
     void BringDownBtHciIntf(void);
     void BuildPtPciDevicesCmd(void);
     void BuildGuestTimeKeepCmd(void);
@@ -65,26 +134,53 @@ class VmBuilderQemu : public VmBuilder {
     void BuildAudioCmd(void);
     void BuildExtraCmd(void);
 
+    void AddArg(std::string text);
+    void AddArg(VmLaunchPlan::ArgKind kind, std::string text);
+    void AddCoProc(CivService svc);
+
+    bool AcquireResources(void);
+    bool AcquireVsockCid(void);
+    void AcquirePwrQmpSocket(void);
+    void PassthroughPciDevices(void);
+    void RenderEmulCmd(void);
+
     void SoundCardHook(void);
     bool PassthroughGpu(void);
     bool CreateGvtgVgpu(void);
 
     void SetPciDevicesCallback(void);
+    bool PlanSriov(void);
     bool SetupSriov(void);
     void RunMediationSrv(void);
     void SetExtraServices(void);
     void SetProcLogDir(void);
+    bool StartCoProcs(void);
+    void ConnectQmp(void);
+    bool RunRestored(void);
+    std::shared_ptr<QmpClient> GetQmp(void);
+    std::shared_ptr<VmProcess> GetMainProc(void);
+    void StopVmLocked(void);
+    bool SaveState(QmpClient *qmp, VmSnapshot *snap);
+    void OnQmpEvent(const std::string &event, const boost::property_tree::ptree &data);
 
-    CivConfig cfg_;
-    std::unique_ptr<Aaf> aaf_cfg_;
+    CivVmConfig cfg_;
+    VmLaunchPlan plan_;
 
-    std::unique_ptr<VmProcess> main_proc_;
+    /* Replaced and reset under stopvm_mutex_, threads other than the op holder use GetMainProc */
+    std::shared_ptr<VmProcess> main_proc_;
     std::vector<std::unique_ptr<VmProcess>> co_procs_;
+    /* Rendered from plan_ and the resources of the current boot */
     std::string emul_cmd_;
-    // std::vector<std::string> env_data_;
+    std::vector<std::string> env_data_;
     std::set<std::string> pci_pt_dev_set_;
+    int sriov_vf_ = -1;
+    std::string pwr_qmp_sock_;
+    std::shared_ptr<QmpClient> qmp_;
+    /* Snapshot mode the current boot restores from, empty for a cold boot */
+    std::string restore_mode_;
     boost::latch vm_ready_latch_;
-    std::queue<std::function<void(void)>> end_call_;
+    /* Releases of acquired resources, run in reverse order by StopVm */
+    std::vector<std::function<void(void)>> end_call_;
     std::mutex stopvm_mutex_;
 };
 
@@ -0,0 +1,178 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/process.hpp>
+
+#include "guest/vm_clone.h"
+#include "guest/vm_snapshot.h"
+#include "utils/utils.h"
+#include "utils/log.h"
+
+namespace vm_manager {
+
+/* The overlay of the boot disk is disk.qcow2, those of the extra disks disk<n>.qcow2 */
+static std::string CloneDiskName(size_t i) {
+    return (i == 0) ? "disk.qcow2" : "disk" + std::to_string(i + 1) + ".qcow2";
+}
+
+/* "qcow2" or "raw", by the magic at the start of the image */
+static std::string ImageFormat(const std::string &path) {
+    std::ifstream ifs(path, std::ios::binary);
+    char magic[4] = { 0 };
+    ifs.read(magic, sizeof(magic));
+    if (ifs && (magic[0] == 'Q') && (magic[1] == 'F') && (magic[2] == 'I') && (magic[3] == '\xfb'))
+        return "qcow2";
+    return "raw";
+}
+
+static bool CopyFile(const std::string &from, const std::string &to) {
+    boost::system::error_code ec;
+    boost::filesystem::copy_file(from, to, boost::filesystem::copy_options::overwrite_existing, ec);
+    if (ec) {
+        LOG(error) << "Cannot copy " << from << ": " << ec.message();
+        return false;
+    }
+    return true;
+}
+
+bool VmCloner::CloneOne(const std::string &name) {
+    boost::system::error_code ec;
+    std::string dir = std::string(GetConfigPath()) + "/instances/" + name;
+    boost::filesystem::create_directories(dir, ec);
+    if (ec) {
+        LOG(error) << "Cannot create " << dir << ": " << ec.message();
+        return false;
+    }
+
+    CivConfig cfg = golden_;
+
+    std::string extra;
+    for (size_t i = 0; i < disks_.size(); i++) {
+        std::string disk = dir + "/" + CloneDiskName(i);
+        std::string cmd("qemu-img create -f qcow2 -b " + disks_[i].first + " -F " + disks_[i].second + " " + disk);
+        LOG(info) << cmd;
+        if (boost::process::system(cmd)) {
+            LOG(error) << "Failed to : " << cmd;
+            return false;
+        }
+        if (i == 0)
+            cfg.SetValue(kGroupDisk, kDiskPath, disk);
+        else
+            extra += (extra.empty() ? "" : ",") + disk;
+    }
+    if (!extra.empty())
+        cfg.SetValue(kGroupDisk, kDiskExtraPaths, extra);
+
+    /* The firmware keeps its variables in the pflash image, a unified one is written as a whole */
+    if (cfg_.firm.type == kFirmSplited) {
+        std::string vars = dir + "/" + boost::filesystem::path(cfg_.firm.vars).filename().string();
+        if (!CopyFile(cfg_.firm.vars, vars))
+            return false;
+        cfg.SetValue(kGroupFirm, kFirmVars, vars);
+    } else if (cfg_.firm.type == kFirmUnified) {
+        std::string firm = dir + "/" + boost::filesystem::path(cfg_.firm.path).filename().string();
+        if (!CopyFile(cfg_.firm.path, firm))
+            return false;
+        cfg.SetValue(kGroupFirm, kFirmPath, firm);
+    }
+
+    /* Data written while the golden guest was flashed, the instance starts from it */
+    if (!cfg_.vtpm.data_dir.empty()) {
+        if (!VmSnapshot::CopyFiles(cfg_.vtpm.data_dir, dir + "/vtpm"))
+            return false;
+        cfg.SetValue(kGroupVtpm, kVtpmDataDir, dir + "/vtpm");
+    }
+    if (!cfg_.rpmb.data_dir.empty()) {
+        if (!VmSnapshot::CopyFiles(cfg_.rpmb.data_dir, dir + "/rpmb"))
+            return false;
+        cfg.SetValue(kGroupRpmb, kRpmbDataDir, dir + "/rpmb");
+    }
+
+    /* Keep the options that follow the name */
+    std::string vm_name = cfg_.glob.name;
+    size_t comma = vm_name.find(',');
+    cfg.SetValue(kGroupGlob, kGlobName, name + ((comma == std::string::npos) ? "" : vm_name.substr(comma)));
+    /* Instances run side by side, the cid and host ports cannot be shared */
+    cfg.ClearValue(kGroupGlob, kGlobCid);
+    cfg.ClearValue(kGroupNet, kNetAdbPort);
+    cfg.ClearValue(kGroupNet, kNetFastbootPort);
+
+    std::string cfg_path = std::string(GetConfigPath()) + "/" + name + ".ini";
+    std::ofstream(cfg_path).close();
+    if (!cfg.WriteConfigFile(cfg_path)) {
+        boost::filesystem::remove(cfg_path, ec);
+        return false;
+    }
+    return true;
+}
+
+bool VmCloner::CloneGuest(std::string path, unsigned int count, std::vector<std::string> *names) {
+    boost::system::error_code ec;
+    boost::filesystem::path p(path);
+
+    if (!boost::filesystem::exists(p, ec) || !boost::filesystem::is_regular_file(p, ec)) {
+        p = boost::filesystem::path(GetConfigPath() + std::string("/") + path + ".ini");
+        if (!boost::filesystem::exists(p, ec)) {
+            LOG(error) << "CiV config not exists: " << path;
+            return false;
+        }
+    }
+
+    if (!golden_.ReadConfigFile(p.string())) {
+        LOG(error) << "Failed to read config file";
+        return false;
+    }
+    std::vector<std::string> errors;
+    if (!golden_.Decode(&cfg_, &errors)) {
+        for (auto &err : errors)
+            LOG(error) << p.string() << ": " << err;
+        return false;
+    }
+
+    if (!boost::filesystem::is_regular_file(cfg_.disk.path, ec)) {
+        LOG(error) << "Disk of " << path << " not exists, flash it first: " << cfg_.disk.path;
+        return false;
+    }
+    for (auto &d : CivDiskPaths(cfg_)) {
+        if (!boost::filesystem::is_regular_file(d, ec)) {
+            LOG(error) << "Disk of " << path << " not exists: " << d;
+            return false;
+        }
+        std::string abs = boost::filesystem::absolute(d, ec).string();
+        disks_.emplace_back(abs, ImageFormat(abs));
+
+        /* Every instance reads through to the golden disk, writing to it would corrupt them all */
+        boost::filesystem::permissions(abs, boost::filesystem::perms::owner_write |
+                                            boost::filesystem::perms::group_write |
+                                            boost::filesystem::perms::others_write |
+                                            boost::filesystem::remove_perms, ec);
+        if (ec)
+            LOG(warning) << "Cannot make " << abs << " read-only: " << ec.message();
+    }
+
+    std::string golden_name = cfg_.glob.name.substr(0, cfg_.glob.name.find(','));
+    for (unsigned int n = 1; names->size() < count; n++) {
+        std::string name = golden_name + "-" + std::to_string(n);
+        if (boost::filesystem::exists(std::string(GetConfigPath()) + "/" + name + ".ini", ec))
+            continue;
+        if (!CloneOne(name)) {
+            LOG(error) << "Failed to clone " << name;
+            return false;
+        }
+        names->push_back(name);
+    }
+    return true;
+}
+
+}  // namespace vm_manager
@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef SRC_GUEST_VM_CLONE_H_
+#define SRC_GUEST_VM_CLONE_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "guest/config_parser.h"
+
+namespace vm_manager {
+
+/*
+ * Makes instances of a flashed guest without flashing them. Each instance
+ * gets qcow2 overlays backed by the disks of the golden guest, its own copy
+ * of the firmware vars, vTPM and RPMB data, and a config named
+ * <golden>-<n> in the config path.
+ */
+class VmCloner final {
+ public:
+    VmCloner() = default;
+    ~VmCloner() = default;
+    /* The names of the new guests go to names */
+    bool CloneGuest(std::string path, unsigned int count, std::vector<std::string> *names);
+
+ private:
+    bool CloneOne(const std::string &name);
+
+    CivConfig golden_;
+    CivVmConfig cfg_;
+    /* Absolute path and format of each golden disk, the boot disk first */
+    std::vector<std::pair<std::string, std::string>> disks_;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_GUEST_VM_CLONE_H_
@@ -15,47 +15,54 @@
 
 #include "guest/vm_flash.h"
 #include "guest/config_parser.h"
+#include "guest/disk_image.h"
+#include "guest/vm_provision.h"
+#include "guest/fat_image.h"
+#include "guest/zip_reader.h"
+#include "guest/flash_cache.h"
 #include "guest/vm_process.h"
 #include "utils/utils.h"
 #include "utils/log.h"
 
 namespace vm_manager {
 
-constexpr const char *kVirtualUsbDiskPath("/tmp/flash.vfat");
-constexpr const size_t kDdBs = 63_MB;
-constexpr const size_t k4GB = 4_GB;
+/* Free space left on the virtual USB disk for the installer */
+constexpr const size_t kUsbDiskSlack = 1_GB;
 
-bool VmFlasher::CheckImages(boost::filesystem::path o_dir) {
-    boost::system::error_code bec;
-    boost::filesystem::path e = boost::process::search_path("split");
-    if (e.empty())
-        return false;
-    std::vector<std::string> args;
-    boost::filesystem::directory_iterator end_itr;
-    for (boost::filesystem::directory_iterator ditr(o_dir); ditr != end_itr; ++ditr) {
-        if (boost::filesystem::is_regular_file(ditr->path(), bec)) {
-            total_image_size_ += boost::filesystem::file_size(ditr->path(), bec);
-            if (boost::filesystem::file_size(ditr->path(), bec) >= k4GB) {
-                args.clear();
-                args.push_back("--bytes=" + std::to_string(k4GB - 1));
-                args.push_back("--numeric-suffixes");
-                args.push_back(ditr->path().string());
-                args.push_back(ditr->path().string() + ".part");
-                LOG(info) << boost::algorithm::join(args, " ");
-                if (boost::process::system(e, boost::process::args(args))) {
-                    LOG(error) << "Failed to split: " << ditr->path().string();
-                    return false;
-                }
-                boost::filesystem::remove(ditr->path().string(), bec);
-            }
-        }
+/*
+ * The zip entries are inflated straight into their place in the FAT image,
+ * several at a time, nothing is extracted to a temporary directory.
+ */
+bool VmFlasher::CreateUsbImage(const ZipReader &zip, const std::string &path) {
+    FatImage fat;
+    std::vector<const ZipEntry *> files;
+    for (auto &e : zip.Entries()) {
+        /* Only the top level files go on the disk */
+        if (e.IsDir() || (e.name.find('/') != std::string::npos))
+            continue;
+        fat.AddFile(e.name, e.size);
+        files.push_back(&e);
     }
-    return true;
+
+    LOG(info) << "Create " << path << " with " << files.size() << " files";
+    if (!fat.Create(path, kUsbDiskSlack))
+        return false;
+
+    bool ret = RunParallel(files.size(), kMaxExtractors, [&](size_t j) {
+        return zip.Extract(*files[j], [&fat, j](uint64_t off, const char *buf, size_t len) {
+            return fat.Write(j, off, buf, len);
+        });
+    });
+    if (!fat.Close())
+        ret = false;
+    if (!ret)
+        LOG(error) << "Failed to create " << path;
+    return ret;
 }
 
 bool VmFlasher::QemuCreateVirtUsbDisk(void) {
     boost::system::error_code bec;
-    boost::filesystem::path file(cfg_.GetValue(kGroupGlob, kGlobFlashfiles));
+    boost::filesystem::path file(cfg_.glob.flashfiles);
     if (!boost::filesystem::exists(file, bec)) {
         LOG(error) <<  "Flashfile not exists: " << file.c_str();
         return false;
@@ -71,93 +78,39 @@ bool VmFlasher::QemuCreateVirtUsbDisk(void) {
         return true;
     }
 
-    boost::filesystem::path o_dir("/tmp/" + file.stem().string());
-    std::error_code ec;
-    std::string cmd;
-    if (boost::filesystem::exists(o_dir, bec)) {
-        cmd.assign("rm -rf " + o_dir.string());
-        LOG(info) << cmd;
-        if (boost::process::system(cmd))
-            return false;
-    }
-
-    cmd.assign("unzip -o " + file.string() + " -d " + o_dir.string());
-    LOG(info) << cmd;
-    if (boost::process::system(cmd)) {
-        LOG(error) << "Failed to unzip: " << file.string();
+    ZipReader zip;
+    std::string key;
+    if (!zip.Open(file.string()) || !FlashCache::Key(file.string(), &key))
         return false;
-    }
-
-    boost::filesystem::path boot_file(o_dir.string() + "/boot.img");
-    if (boost::filesystem::exists(boot_file, bec)) {
-        if (!CheckImages(o_dir))
-            return false;
-
-        cmd.assign("dd if=/dev/zero of=" + std::string(kVirtualUsbDiskPath) +
-                " bs=" + std::to_string(kDdBs) +
-                " count=" + std::to_string((total_image_size_ + 1_GB + kDdBs - 1)/kDdBs));
-        LOG(info) << cmd;
-        if (boost::process::system(cmd)) {
-            LOG(error) << "Failed to : " << cmd;
-            return false;
-        }
-
-        cmd.assign("mkfs.vfat " + std::string(kVirtualUsbDiskPath));
-        LOG(info) << cmd;
-        if (boost::process::system(cmd)) {
-            LOG(error) << "Failed to : " << cmd;
-            return false;
-        }
-
-        boost::filesystem::directory_iterator end_itr;
-        for (boost::filesystem::directory_iterator ditr(o_dir, bec); ditr != end_itr; ++ditr) {
-            if (boost::filesystem::is_regular_file(ditr->path(), bec)) {
-                cmd.assign("mcopy -o -n -i " + std::string(kVirtualUsbDiskPath) + " " + ditr->path().string() + " ::");
-                LOG(info) << cmd;
-                if (boost::process::system(cmd)) {
-                    LOG(error) << "Failed to : " << cmd;
-                    return false;
-                }
-            }
-        }
-        cmd.assign("rm -r " + o_dir.string());
-        LOG(info) << cmd;
-        if (boost::process::system(cmd)) {
-            LOG(warning) << "Failed to : " << cmd;
-        }
+    /* Cached media may be shared by several flashes, the installer writes go to a temporary overlay */
+    virtual_disk_shared_ = true;
 
-        virtual_disk_ = kVirtualUsbDiskPath;
-        return true;
+    if (zip.Find("boot.img")) {
+        return cache_.Get(key, kFlashArtifactUsb, [&](const std::string &p) {
+            return CreateUsbImage(zip, p);
+        }, &virtual_disk_);
     }
 
-    int count = 0;
-    for (auto& p : boost::filesystem::directory_iterator(o_dir, bec)) {
-        if (++count >1)
-            return false;
-    }
-    if (count == 1) {
-        virtual_disk_ = o_dir.string() + "/" + file.stem().string();
-        return true;
+    /* Otherwise the zip holds the USB disk image itself */
+    std::vector<const ZipEntry *> files;
+    for (auto &e : zip.Entries()) {
+        if (!e.IsDir())
+            files.push_back(&e);
     }
+    if (files.size() != 1)
+        return false;
 
-    return false;
+    return cache_.Get(key, kFlashArtifactDisk, [&](const std::string &p) {
+        return zip.ExtractTo(*files[0], p);
+    }, &virtual_disk_);
 }
 
 bool VmFlasher::QemuCreateVirtualDisk(void) {
-    std::string path = cfg_.GetValue(kGroupDisk, kDiskPath);
-    std::string size = cfg_.GetValue(kGroupDisk, kDiskSize);
-
-    std::string cmd("qemu-img create -f qcow2 " + path + " " + size);
-    LOG(info) << cmd;
-    if (boost::process::system(cmd)) {
-        LOG(error) << "Failed to : " << cmd;
-        return false;
-    }
-    return true;
+    return CreateDiskImage(cfg_.disk, cfg_.disk.path);
 }
 
 bool VmFlasher::FlashWithQemu(void) {
-    std::string emul_path = cfg_.GetValue(kGroupEmul, kEmulPath);
+    std::string emul_path = cfg_.emul.path;
     if (emul_path.empty())
         return false;
 
@@ -170,8 +123,8 @@ bool VmFlasher::FlashWithQemu(void) {
 
     std::string qemu_args(emul_path);
 
-    std::string rpmb_bin = cfg_.GetValue(kGroupRpmb, kRpmbBinPath);
-    std::string rpmb_data_dir = cfg_.GetValue(kGroupRpmb, kRpmbDataDir);
+    std::string rpmb_bin = cfg_.rpmb.bin_path;
+    std::string rpmb_data_dir = cfg_.rpmb.data_dir;
     std::string rpmb_data_file = rpmb_data_dir + "/" + std::string(kRpmbData);
     time_t rawtime;
     struct tm timeinfo;
@@ -197,8 +150,8 @@ bool VmFlasher::FlashWithQemu(void) {
         rpmb_proc = std::make_unique<VmCoProcRpmb>(std::move(rpmb_bin), std::move(rpmb_data_dir), std::move(rpmb_sock));
     }
 
-    std::string vtpm_bin = cfg_.GetValue(kGroupVtpm, kVtpmBinPath);
-    std::string vtpm_data_dir = cfg_.GetValue(kGroupVtpm, kVtpmDataDir);
+    std::string vtpm_bin = cfg_.vtpm.bin_path;
+    std::string vtpm_data_dir = cfg_.vtpm.data_dir;
     std::unique_ptr<VmCoProcVtpm> vtpm_proc;
     if (!vtpm_bin.empty() && !vtpm_data_dir.empty()) {
         qemu_args.append(" -chardev socket,id=chrtpm,path=" +
@@ -207,14 +160,14 @@ bool VmFlasher::FlashWithQemu(void) {
         vtpm_proc = std::make_unique<VmCoProcVtpm>(std::move(vtpm_bin), std::move(vtpm_data_dir));
     }
 
-    std::string firm_type = cfg_.GetValue(kGroupFirm, kFirmType);
+    std::string firm_type = cfg_.firm.type;
     if (firm_type.empty())
         return false;
     if (firm_type.compare(kFirmUnified) == 0) {
-        qemu_args.append(" -drive if=pflash,format=raw,file=" + cfg_.GetValue(kGroupFirm, kFirmPath));
+        qemu_args.append(" -drive if=pflash,format=raw,file=" + cfg_.firm.path);
     } else if (firm_type.compare(kFirmSplited) == 0) {
-        qemu_args.append(" -drive if=pflash,format=raw,readonly,file=" + cfg_.GetValue(kGroupFirm, kFirmCode));
-        qemu_args.append(" -drive if=pflash,format=raw,file=" + cfg_.GetValue(kGroupFirm, kFirmVars));
+        qemu_args.append(" -drive if=pflash,format=raw,readonly,file=" + cfg_.firm.code);
+        qemu_args.append(" -drive if=pflash,format=raw,file=" + cfg_.firm.vars);
     } else {
         LOG(error) << "Invalid virtual firmware";
         return false;
@@ -222,7 +175,7 @@ bool VmFlasher::FlashWithQemu(void) {
 
     qemu_args.append(
         " -device virtio-scsi-pci,id=scsi0,addr=0x8"
-        " -drive if=none,format=qcow2,id=scsidisk1,file=" + cfg_.GetValue(kGroupDisk, kDiskPath) +
+        " -drive if=none,format=" + DiskImageFormat(cfg_.disk) + ",id=scsidisk1,file=" + cfg_.disk.path +
         " -device scsi-hd,drive=scsidisk1,bus=scsi0.0");
 
     qemu_args.append(" -name civ_flashing"
@@ -235,7 +188,8 @@ bool VmFlasher::FlashWithQemu(void) {
         " -no-reboot"
         " -nographic -display none -serial mon:stdio"
         " -boot menu=on,splash-time=5000,strict=on "
-        " -drive id=udisk1,format=raw,if=none,file=" + virtual_disk_ +
+        " -drive id=udisk1,format=raw,if=none" + std::string(virtual_disk_shared_ ? ",snapshot=on" : "") +
+        ",file=" + virtual_disk_ +
         " -device usb-storage,drive=udisk1,bus=xhci.0"
         " -nodefaults");
 
@@ -254,6 +208,35 @@ bool VmFlasher::FlashWithQemu(void) {
     return true;
 }
 
+/* Writes the disk from the host, the installer is not booted */
+bool VmFlasher::FlashDirect(void) {
+    boost::system::error_code ec;
+    ZipReader zip;
+    std::string key, files;
+    if (!zip.Open(cfg_.glob.flashfiles) || !FlashCache::Key(cfg_.glob.flashfiles, &key) ||
+        !cache_.Get(key, kFlashArtifactFiles, [&](const std::string &p) {
+            return zip.ExtractAll(p);
+        }, &files)) {
+        LOG(error) << "Failed to extract: " << cfg_.glob.flashfiles;
+        return false;
+    }
+
+    /* Same as a flash in the VM, the guest starts with a blank RPMB */
+    std::string rpmb_data_file = cfg_.rpmb.data_dir + "/" + std::string(kRpmbData);
+    if (!cfg_.rpmb.data_dir.empty() && boost::filesystem::exists(rpmb_data_file, ec)) {
+        if (!boost::filesystem::remove(rpmb_data_file, ec)) {
+            LOG(error) << "Failed to remove " << rpmb_data_file;
+            return false;
+        }
+    }
+
+    VmProvisioner prov(cfg_);
+    bool ret = prov.Provision(files);
+    if (ret)
+        LOG(info) << "Flash done!";
+    return ret;
+}
+
 bool VmFlasher::FlashGuest(std::string path) {
     boost::system::error_code ec;
     boost::filesystem::path p(path);
@@ -267,13 +250,26 @@ bool VmFlasher::FlashGuest(std::string path) {
         }
     }
 
-    if (!cfg_.ReadConfigFile(p.string())) {
+    CivConfig cfg;
+    if (!cfg.ReadConfigFile(p.string())) {
         LOG(error) << "Failed to read config file";
         return false;
     }
+    std::vector<std::string> errors;
+    if (!cfg.Decode(&cfg_, &errors)) {
+        for (auto &err : errors)
+            LOG(error) << p.string() << ": " << err;
+        return false;
+    }
 
-    std::string emul_type = cfg_.GetValue(kGroupEmul, kEmulType);
+    std::string emul_type = cfg_.emul.type;
     if ((emul_type.compare(kEmulTypeQemu) == 0) || emul_type.empty()) {
+        if ((cfg_.glob.flash_mode != kFlashModeVm) && VmProvisioner::CanProvision(cfg_.glob.flashfiles))
+            return FlashDirect();
+        if (cfg_.glob.flash_mode == kFlashModeDirect) {
+            LOG(error) << "No gpt.ini and installer.cmd in " << cfg_.glob.flashfiles << ", cannot flash from the host";
+            return false;
+        }
         return FlashWithQemu();
     }
     return false;
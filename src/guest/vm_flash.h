@@ -12,6 +12,8 @@
 #include <string>
 
 #include <guest/config_parser.h>
+#include <guest/flash_cache.h>
+#include <guest/zip_reader.h>
 
 namespace vm_manager {
 
@@ -25,12 +27,14 @@ class VmFlasher final {
     bool QemuCreateVirtUsbDisk(void);
     bool QemuCreateVirtualDisk(void);
     bool FlashWithQemu(void);
-    bool CheckImages(boost::filesystem::path o_dir);
+    bool FlashDirect(void);
+    bool CreateUsbImage(const ZipReader &zip, const std::string &path);
 
  private:
-    size_t total_image_size_ = 0;
     std::string virtual_disk_;
-    CivConfig cfg_;
+    bool virtual_disk_shared_ = false;
+    FlashCache cache_;
+    CivVmConfig cfg_;
 };
 
 }  // namespace vm_manager
@@ -6,6 +6,15 @@
  *
  */
 
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <algorithm>
+
 #include <fstream>
 #include <ctime>
 
@@ -16,11 +25,37 @@
 
 #include "utils/log.h"
 #include "guest/vm_process.h"
+#include "guest/proc_supervisor.h"
 
 namespace vm_manager {
 
-void VmProcSimple::ThreadMon(void) {
-    std::error_code ec;
+/* Restarts of a co-process back off from kRestartBackoffMin up to kRestartBackoffMax */
+constexpr const std::chrono::milliseconds kRestartBackoffMin(100);
+constexpr const std::chrono::milliseconds kRestartBackoffMax(10000);
+/* More exits than kCrashLoopLimit within kCrashLoopWindow stop the restarts */
+constexpr const std::chrono::seconds kCrashLoopWindow(60);
+constexpr const size_t kCrashLoopLimit = 5;
+
+VmRestartPolicy RestartPolicyFromStr(const std::string &s) {
+    if (s == "on-failure")
+        return kRestartOnFailure;
+    if (s == "always")
+        return kRestartAlways;
+    return kRestartNever;
+}
+
+const char *RestartPolicyToStr(VmRestartPolicy p) {
+    switch (p) {
+        case kRestartNever:     return "never";
+        case kRestartOnFailure: return "on-failure";
+        case kRestartAlways:    return "always";
+    }
+    return "unknown";
+}
+
+void VmProcSimple::Run(void) {
+    /* Tells apart logs of processes started in the same second */
+    static std::atomic<uint32_t> log_seq{0};
 
     time_t rawtime;
     struct tm timeinfo;
@@ -46,9 +81,8 @@ void VmProcSimple::ThreadMon(void) {
         exe_pos_end = cmd_.size();
     std::string exe = cmd_.substr(exe_pos_begin, exe_pos_end - exe_pos_begin);
 
-    std::string tid = boost::lexical_cast<std::string>(mon_->get_id());
-
-    std::string f_out = log_dir_ + std::string(basename(exe.c_str())) + "_" + t_buf + "_" + tid + "_out.log";
+    std::string f_out = log_dir_ + std::string(basename(exe.c_str())) + "_" + t_buf + "_" +
+                        std::to_string(log_seq++) + "_out.log";
     std::ofstream fo(f_out);
     fo.close();
 
@@ -59,41 +93,237 @@ void VmProcSimple::ThreadMon(void) {
                                           boost::filesystem::perms::others_read |
                                           boost::filesystem::perms::others_write |
                                           boost::filesystem::add_perms);
+    {
+        std::scoped_lock lock(exit_mutex_);
+        log_file_ = f_out;
+    }
 
-    c_ = std::make_unique<boost::process::child>(
+    std::error_code ec;
+    boost::process::child c(
         cmd_,
         boost::process::env = env,
         (boost::process::std_out & boost::process::std_err) > f_out,
-        ec,
-        boost::process::extend::on_success = [this](auto & exec) {
-            child_latch_.count_down();
-        },
-        boost::process::extend::on_error = [this](auto & exec, const std::error_code& ec) {
-            child_latch_.count_down();
-    });
+        ec);
+    if (ec || !c.valid()) {
+        LOG(error) << "Failed to launch " << exe << ": " << ec.message();
+        OnExit(-1);
+        return;
+    }
+
+    /* The supervisor reaps the child from now on */
+    pid_t pid = c.id();
+    pid_ = pid;
+    c.detach();
+    {
+        std::scoped_lock lock(exit_mutex_);
+        running_ = true;
+        exited_ = false;
+    }
 
-    c_->wait(ec);
+    if (!ProcSupervisor::Supervisor().Watch(pid, [this](int exit_code) { OnExit(exit_code); })) {
+        LOG(error) << "Cannot supervise " << exe << ", kill it";
+        kill(pid, SIGKILL);
+        int status;
+        waitpid(pid, &status, 0);
+        OnExit(-1);
+    }
+}
 
-    std::ofstream out(f_out, std::fstream::app);
-    out << "\n\nCMD: " << cmd_;
+std::string VmProcSimple::LogFile(void) {
+    std::scoped_lock lock(exit_mutex_);
+    return log_file_;
+}
 
-    int result = c_->exit_code();
+void VmProcSimple::OnExit(int exit_code) {
+    exit_code_ = exit_code;
 
-    LOG(info) << "Thread-0x" << tid << " Exiting"
-              << "\n\t\tChild-" << c_->id() << " exited, exit code=" << result
-              << "\n\t\tlog: " << f_out;
+    std::string log_file = LogFile();
+    if (!log_file.empty()) {
+        std::ofstream out(log_file, std::fstream::app);
+        out << "\n\nCMD: " << cmd_;
+    }
+
+    LOG(info) << "Child-" << pid_ << " exited, exit code=" << exit_code
+              << "\n\t\tlog: " << log_file;
+
+    std::function<void(void)> cb;
+    {
+        std::scoped_lock lock(exit_mutex_);
+        running_ = false;
+        exited_ = true;
+        cb = std::move(on_exit_);
+    }
+    exit_cv_.notify_all();
+    if (cb)
+        cb();
+
+    ScheduleRestart(exit_code);
 }
 
-void VmProcSimple::Run(void) {
-    mon_ = std::make_unique<boost::thread>([this] { ThreadMon(); });
-    child_latch_.wait();
+void VmProcSimple::SetRestartPolicy(VmRestartPolicy policy) {
+    std::scoped_lock lock(restart_mutex_);
+    restart_policy_ = policy;
 }
 
-void VmProcSimple::Join(void) {
-    if (!mon_)
+void VmProcSimple::ScheduleRestart(int exit_code) {
+    std::scoped_lock lock(restart_mutex_);
+    if (stopping_)
+        return;
+    if (restart_policy_ == kRestartNever)
+        return;
+    /* An unknown status (-1) is neither a success nor a failure */
+    if ((restart_policy_ == kRestartOnFailure) && (exit_code <= 0)) {
+        if (exit_code < 0)
+            LOG(warning) << "Exit status of co-process is unknown, not restarting: " << cmd_;
         return;
-    if (mon_->joinable())
-        mon_->join();
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    recent_exits_.push_back(now);
+    while (now - recent_exits_.front() > kCrashLoopWindow)
+        recent_exits_.pop_front();
+    if (recent_exits_.size() > kCrashLoopLimit) {
+        crash_loop_ = true;
+        LOG(error) << "Co-process exited " << recent_exits_.size() << " times in "
+                   << kCrashLoopWindow.count() << "s, stop restarting: " << cmd_;
+        return;
+    }
+
+    if (restart_active_) {
+        restart_pending_ = true;
+        return;
+    }
+    /* The last restart thread has already left RestartLoop */
+    if (restart_thread_.joinable())
+        restart_thread_.join();
+    restart_active_ = true;
+    restart_thread_ = boost::thread([this]() { RestartLoop(); });
+}
+
+void VmProcSimple::RestartLoop(void) {
+    std::unique_lock lock(restart_mutex_);
+    while (true) {
+        auto backoff = std::min(kRestartBackoffMax, kRestartBackoffMin * (1 << (recent_exits_.size() - 1)));
+        if (restart_cv_.wait_for(lock, backoff, [this]() { return stopping_; })) {
+            restart_active_ = false;
+            return;
+        }
+
+        restarts_++;
+        LOG(warning) << "Restart co-process after " << backoff.count() << "ms (" << restarts_ << "): " << cmd_;
+        lock.unlock();
+        Run();
+        lock.lock();
+
+        if (stopping_ || !restart_pending_) {
+            restart_active_ = false;
+            return;
+        }
+        restart_pending_ = false;
+    }
+}
+
+std::string VmProcSimple::GetStats(void) {
+    size_t b = cmd_.find_first_not_of(' ');
+    std::string exe = (b == std::string::npos) ? "" : cmd_.substr(b, cmd_.find(' ', b) - b);
+    exe = basename(exe.c_str());
+
+    std::scoped_lock lock(restart_mutex_);
+    const char *state = crash_loop_ ? "CrashLoop" : (running_ ? "Running" : "Exited");
+    return exe + ":" + RestartPolicyToStr(restart_policy_) + ":" + std::to_string(restarts_) + ":" + state;
+}
+
+void VmProcSimple::NotifyOnExit(std::function<void(void)> cb) {
+    {
+        std::scoped_lock lock(exit_mutex_);
+        if (!exited_) {
+            on_exit_ = std::move(cb);
+            return;
+        }
+    }
+    cb();
+}
+
+void VmProcSimple::SetReadyProbe(VmProcProbe probe) {
+    probe_ = std::move(probe);
+}
+
+static bool UnixSocketAccepts(const std::string &path) {
+    struct sockaddr_un addr = {};
+    if (path.size() >= sizeof(addr.sun_path))
+        return false;
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path, path.c_str(), path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    bool ret = (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) == 0);
+    close(fd);
+    return ret;
+}
+
+static bool FileContains(const std::string &path, const std::string &s) {
+    std::ifstream ifs(path);
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (line.find(s) != std::string::npos)
+            return true;
+    }
+    return false;
+}
+
+VmProbeResult VmProcSimple::ProbeReady(std::string *err) {
+    std::string log_file = LogFile();
+    bool running, exited;
+    {
+        std::scoped_lock lock(exit_mutex_);
+        running = running_;
+        exited = exited_;
+    }
+    if (exited && !running && (exit_code_ != 0)) {
+        *err = "exited with code " + std::to_string(exit_code_) + ": " + cmd_ + ", log: " + log_file;
+        return kProbeFailed;
+    }
+    /* A one-shot process that exited 0 is as ready as it gets */
+    if (probe_.kind == VmProcProbe::kNone)
+        return kProbeReady;
+    if (!running && !exited) {
+        *err = "not started: " + cmd_;
+        return kProbeFailed;
+    }
+
+    /* Once the process is gone, a probe that has not passed never will */
+    VmProbeResult pending = running ? kProbePending : kProbeFailed;
+    boost::system::error_code ec;
+    switch (probe_.kind) {
+        case VmProcProbe::kUnixSocket:
+            if (!UnixSocketAccepts(probe_.target)) {
+                *err = "socket " + probe_.target + " is not accepting: " + cmd_;
+                return pending;
+            }
+            break;
+        case VmProcProbe::kFile:
+            if (!boost::filesystem::exists(probe_.target, ec)) {
+                *err = "file " + probe_.target + " does not exist: " + cmd_;
+                return pending;
+            }
+            break;
+        case VmProcProbe::kLogLine:
+            if (!FileContains(log_file, probe_.target)) {
+                *err = "\"" + probe_.target + "\" not found in " + log_file + ": " + cmd_;
+                return pending;
+            }
+            break;
+        default:
+            break;
+    }
+    return kProbeReady;
+}
+
+void VmProcSimple::Join(void) {
+    std::unique_lock lock(exit_mutex_);
+    exit_cv_.wait(lock, [this]() { return !running_; });
 }
 
 void VmProcSimple::SetEnv(std::vector<std::string> env) {
@@ -119,32 +349,40 @@ void VmProcSimple::SetLogDir(const char *path) {
 
 void VmProcSimple::Stop(void) {
     try {
-        if (!mon_ || !c_)
+        {
+            std::scoped_lock lock(restart_mutex_);
+            stopping_ = true;
+        }
+        restart_cv_.notify_all();
+        if (restart_thread_.joinable() && (restart_thread_.get_id() != boost::this_thread::get_id()))
+            restart_thread_.join();
+
+        if (!running_)
             return;
 
-        if (!mon_.get())
-            return;
-
-        if (!c_->running())
-            return;
-
-        LOG(info) << "Terminate CoProc: " << c_->id();
-        kill(c_->id(), SIGTERM);
-        mon_->try_join_for(boost::chrono::seconds(10));
-        mon_.reset(nullptr);
+        LOG(info) << "Terminate CoProc: " << pid_;
+        kill(pid_, SIGTERM);
+        std::unique_lock lock(exit_mutex_);
+        if (!exit_cv_.wait_for(lock, std::chrono::seconds(10), [this]() { return !running_; }))
+            LOG(warning) << "CoProc " << pid_ << " did not exit in time";
     } catch (std::exception& e) {
         LOG(error) << "Exception: " << e.what();
     }
 }
 
+int VmProcSimple::ExitCode(void) {
+    return exit_code_;
+}
+
 bool VmProcSimple::Running(void) {
-    if (c_)
-        return c_->running();
-    return false;
+    return running_;
 }
 
 VmProcSimple::~VmProcSimple() {
     VmProcSimple::Stop();
+    /* The exit callback refers to this object */
+    if (pid_ != 0)
+        ProcSupervisor::Supervisor().Unwatch(pid_);
 }
 
 
@@ -157,7 +395,10 @@ void VmCoProcRpmb::Run(void) {
         init_data.wait(ec);
         int ret = init_data.exit_code();
     }
-    cmd_ = bin_ + " --dev " + data_dir_ + "/" + kRpmbData + " --sock " + sock_file_;
+
+    /* A socket left by an earlier run would be probed instead of the new one */
+    if (boost::filesystem::exists(sock_file_, bec))
+        boost::filesystem::remove(sock_file_, bec);
 
     VmProcSimple::Run();
 }
@@ -187,12 +428,11 @@ void VmCoProcVtpm::Run(void) {
     boost::system::error_code bec;
     if (!boost::filesystem::exists(data_dir_, bec)) {
         LOG(warning) << "Data path for Vtpm not exists!";
+        /* Not started on purpose, the boot goes on without it */
+        probe_ = VmProcProbe{};
         return;
     }
 
-    cmd_ = bin_ + " socket --tpmstate dir=" + data_dir_ +
-           " --tpm2 --ctrl type=unixio,path=" + data_dir_ + "/" + kVtpmSock;
-
     VmProcSimple::Run();
 }
 
@@ -12,6 +12,12 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
 
 #include <boost/thread.hpp>
 #include <boost/asio.hpp>
@@ -25,6 +31,39 @@ inline constexpr const char *kRpmbData = "RPMB_DATA";
 inline constexpr const char *kRpmbSockPrefix = "/tmp/rpmb_sock_";
 inline constexpr const char *kVtpmSock = "swtpm-sock";
 
+/* How a started process is known to be ready to serve */
+struct VmProcProbe {
+    enum Kind {
+        /* Ready once spawned */
+        kNone = 0,
+        /* Unix socket at target accepts connections */
+        kUnixSocket,
+        /* File at target exists */
+        kFile,
+        /* Output of the process contains target */
+        kLogLine,
+    };
+    Kind kind = kNone;
+    std::string target;
+};
+
+enum VmRestartPolicy {
+    kRestartNever = 0,
+    /* Restart if the process exited with a non-zero code, not if its status is unknown */
+    kRestartOnFailure,
+    kRestartAlways,
+};
+
+/* Returns kRestartNever for an empty or unknown string */
+VmRestartPolicy RestartPolicyFromStr(const std::string &s);
+const char *RestartPolicyToStr(VmRestartPolicy p);
+
+enum VmProbeResult {
+    kProbeReady = 0,
+    kProbePending,
+    kProbeFailed,
+};
+
 class VmProcess {
  public:
     virtual void Run(void) = 0;
@@ -33,42 +72,88 @@ class VmProcess {
     virtual void Join(void) = 0;
     virtual void SetLogDir(const char *path) = 0;
     virtual void SetEnv(std::vector<std::string> env) = 0;
+    virtual int ExitCode(void) = 0;
+    /* Call cb once the process has exited, from the process supervisor thread, it must not block */
+    virtual void NotifyOnExit(std::function<void(void)> cb) = 0;
+    virtual void SetReadyProbe(VmProcProbe probe) = 0;
+    /* Non-blocking check of the probe, err says why if it failed. Without a probe the process
+       only fails by exiting non-zero */
+    virtual VmProbeResult ProbeReady(std::string *err) = 0;
+    /* Applies to exits after the process was started, Stop never restarts it */
+    virtual void SetRestartPolicy(VmRestartPolicy policy) = 0;
+    /* "exe:policy:restarts:state" for GetVmInfo */
+    virtual std::string GetStats(void) = 0;
     virtual ~VmProcess() = default;
 };
 
 class VmProcSimple : public VmProcess {
  public:
-    explicit VmProcSimple(std::string cmd) : cmd_(cmd), child_latch_(1) {}
+    explicit VmProcSimple(std::string cmd) : cmd_(cmd) {}
     void Run(void);
     void Stop(void);
     bool Running(void);
     void Join(void);
     void SetEnv(std::vector<std::string> env);
     void SetLogDir(const char *path);
+    int ExitCode(void);
+    void NotifyOnExit(std::function<void(void)> cb);
+    void SetReadyProbe(VmProcProbe probe);
+    VmProbeResult ProbeReady(std::string *err);
+    void SetRestartPolicy(VmRestartPolicy policy);
+    std::string GetStats(void);
     virtual ~VmProcSimple();
 
  protected:
     VmProcSimple(const VmProcSimple&) = delete;
     VmProcSimple& operator=(const VmProcSimple&) = delete;
 
-    void ThreadMon(void);
-
+    void OnExit(int exit_code);
+    void ScheduleRestart(int exit_code);
+    void RestartLoop(void);
 
-    std::string cmd_;
+    /* Fixed once constructed, restarts run concurrently with readers */
+    const std::string cmd_;
     std::vector<std::string> env_data_;
     std::string log_dir_ = "/tmp/";
+    VmProcProbe probe_;
 
-    std::unique_ptr<boost::process::child> c_;
-    boost::latch child_latch_;
+    /* Reaped by ProcSupervisor, no thread is kept per child */
+    std::atomic<pid_t> pid_ = 0;
+    std::atomic<bool> running_ = false;
+    std::atomic<int> exit_code_ = -1;
 
  private:
-    std::unique_ptr<boost::thread> mon_;
+    std::string LogFile(void);
+
+    /* Guarded by exit_mutex_ */
+    std::string log_file_;
+    bool exited_ = false;
+    std::function<void(void)> on_exit_;
+    std::mutex exit_mutex_;
+    std::condition_variable exit_cv_;
+
+    VmRestartPolicy restart_policy_ = kRestartNever;
+    /* Set by Stop, no restart happens afterwards */
+    bool stopping_ = false;
+    /* A restart thread is waiting out the backoff or running the process */
+    bool restart_active_ = false;
+    /* Another exit happened while the restart thread was active */
+    bool restart_pending_ = false;
+    bool crash_loop_ = false;
+    uint32_t restarts_ = 0;
+    std::deque<std::chrono::steady_clock::time_point> recent_exits_;
+    boost::thread restart_thread_;
+    std::mutex restart_mutex_;
+    std::condition_variable restart_cv_;
 };
 
 class VmCoProcRpmb : public VmProcSimple {
  public:
     VmCoProcRpmb(std::string bin, std::string data_dir, std::string sock_file) :
-          VmProcSimple(""), bin_(bin), data_dir_(data_dir), sock_file_(sock_file) {}
+          VmProcSimple(bin + " --dev " + data_dir + "/" + kRpmbData + " --sock " + sock_file),
+          bin_(bin), data_dir_(data_dir), sock_file_(sock_file) {
+        probe_ = VmProcProbe{VmProcProbe::kUnixSocket, sock_file_};
+    }
 
     void Run(void);
     void Stop(void);
@@ -86,7 +171,11 @@ class VmCoProcRpmb : public VmProcSimple {
 class VmCoProcVtpm : public VmProcSimple {
  public:
     VmCoProcVtpm(std::string bin, std::string data_dir) :
-          VmProcSimple(""), bin_(bin), data_dir_(data_dir) {}
+          VmProcSimple(bin + " socket --tpmstate dir=" + data_dir +
+                       " --tpm2 --ctrl type=unixio,path=" + data_dir + "/" + kVtpmSock),
+          bin_(bin), data_dir_(data_dir) {
+        probe_ = VmProcProbe{VmProcProbe::kUnixSocket, data_dir_ + "/" + kVtpmSock};
+    }
 
     void Run(void);
     void Stop(void);
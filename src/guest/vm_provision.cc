@@ -0,0 +1,298 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <boost/process.hpp>
+
+#include "guest/vm_provision.h"
+#include "guest/disk_image.h"
+#include "guest/zip_reader.h"
+#include "utils/log.h"
+#include "utils/utils.h"
+
+namespace vm_manager {
+
+namespace {
+
+constexpr const char *kGptIni = "gpt.ini";
+constexpr const char *kInstallerCmd = "installer.cmd";
+
+constexpr size_t kCopyBufSize = 4_MB;
+constexpr unsigned int kMaxWriters = 8;
+
+/* Android sparse image, as produced by img2simg */
+constexpr uint32_t kSparseMagic = 0xed26ff3a;
+constexpr uint16_t kChunkRaw = 0xcac1;
+constexpr uint16_t kChunkFill = 0xcac2;
+constexpr uint16_t kChunkDontCare = 0xcac3;
+constexpr uint16_t kChunkCrc32 = 0xcac4;
+
+struct SparseHeader {
+    uint32_t magic;
+    uint16_t major_version;
+    uint16_t minor_version;
+    uint16_t file_hdr_sz;
+    uint16_t chunk_hdr_sz;
+    uint32_t blk_sz;
+    uint32_t total_blks;
+    uint32_t total_chunks;
+    uint32_t image_checksum;
+};
+static_assert(sizeof(SparseHeader) == 28, "sparse header layout");
+
+struct ChunkHeader {
+    uint16_t chunk_type;
+    uint16_t reserved;
+    uint32_t chunk_sz;
+    uint32_t total_sz;
+};
+static_assert(sizeof(ChunkHeader) == 12, "sparse chunk layout");
+
+/*
+ * Writes one partition image. The disk is a fresh sparse file, zeroes are
+ * skipped so they stay holes and cost neither writes nor space.
+ */
+class ImageWriter {
+ public:
+    ImageWriter(int fd, const GptPartition &part, const std::string &path)
+        : fd_(fd), part_(part), path_(path), buf_(kCopyBufSize) {}
+
+    bool Write(void) {
+        ifs_.open(path_, std::ios::binary);
+        if (!ifs_) {
+            LOG(error) << "Cannot open " << path_;
+            return false;
+        }
+        SparseHeader h;
+        if (ifs_.read(reinterpret_cast<char *>(&h), sizeof(h)) && (h.magic == kSparseMagic))
+            return WriteSparse(h);
+
+        ifs_.clear();
+        ifs_.seekg(0);
+        return Copy(part_.Size(), 0, true);
+    }
+
+ private:
+    /* Copy len bytes from the image to off in the partition, up to the end of the image if to_eof */
+    bool Copy(uint64_t len, uint64_t off, bool to_eof) {
+        while (len > 0) {
+            size_t n = std::min<uint64_t>(len, buf_.size());
+            ifs_.read(buf_.data(), n);
+            n = ifs_.gcount();
+            if (n == 0) {
+                if (to_eof)
+                    return !ifs_.bad();
+                LOG(error) << path_ << " is truncated";
+                return false;
+            }
+            if (!IsZero(buf_.data(), n) && !PWrite(buf_.data(), n, off))
+                return false;
+            len -= n;
+            off += n;
+        }
+        if (to_eof && (ifs_.peek() != std::char_traits<char>::eof())) {
+            LOG(error) << path_ << " is larger than partition " << part_.label;
+            return false;
+        }
+        return true;
+    }
+
+    bool PWrite(const char *buf, size_t len, uint64_t off) {
+        if (off + len > part_.Size()) {
+            LOG(error) << path_ << " is larger than partition " << part_.label;
+            return false;
+        }
+        if (pwrite(fd_, buf, len, part_.Offset() + off) != static_cast<ssize_t>(len)) {
+            LOG(error) << "Failed to write " << part_.label << ": " << strerror(errno);
+            return false;
+        }
+        return true;
+    }
+
+    bool WriteSparse(const SparseHeader &h) {
+        if ((h.major_version != 1) || (h.file_hdr_sz < sizeof(SparseHeader)) ||
+            (h.chunk_hdr_sz < sizeof(ChunkHeader)) || (h.blk_sz == 0) || (h.blk_sz % 4)) {
+            LOG(error) << path_ << ": unsupported sparse image";
+            return false;
+        }
+        ifs_.seekg(h.file_hdr_sz);
+
+        uint64_t off = 0;
+        for (uint32_t i = 0; i < h.total_chunks; i++) {
+            ChunkHeader c;
+            if (!ifs_.read(reinterpret_cast<char *>(&c), sizeof(c))) {
+                LOG(error) << path_ << " is truncated";
+                return false;
+            }
+            ifs_.seekg(h.chunk_hdr_sz - sizeof(c), std::ios::cur);
+            uint64_t len = static_cast<uint64_t>(c.chunk_sz) * h.blk_sz;
+
+            switch (c.chunk_type) {
+                case kChunkRaw:
+                    if (!Copy(len, off, false))
+                        return false;
+                    break;
+                case kChunkFill: {
+                    uint32_t pattern;
+                    if (!ifs_.read(reinterpret_cast<char *>(&pattern), sizeof(pattern))) {
+                        LOG(error) << path_ << " is truncated";
+                        return false;
+                    }
+                    if (pattern == 0)
+                        break;
+                    for (size_t j = 0; j < buf_.size(); j += sizeof(pattern))
+                        memcpy(&buf_[j], &pattern, sizeof(pattern));
+                    for (uint64_t done = 0; done < len; done += buf_.size()) {
+                        if (!PWrite(buf_.data(), std::min<uint64_t>(len - done, buf_.size()), off + done))
+                            return false;
+                    }
+                    break;
+                }
+                case kChunkDontCare:
+                    break;
+                case kChunkCrc32:
+                    ifs_.seekg(sizeof(uint32_t), std::ios::cur);
+                    break;
+                default:
+                    LOG(error) << path_ << ": unknown sparse chunk " << std::hex << c.chunk_type;
+                    return false;
+            }
+            off += (c.chunk_type == kChunkCrc32) ? 0 : len;
+        }
+        return true;
+    }
+
+    int fd_;
+    const GptPartition &part_;
+    std::string path_;
+    std::ifstream ifs_;
+    std::vector<char> buf_;
+};
+
+}  // namespace
+
+bool VmProvisioner::CanProvision(const std::string &flashfiles) {
+    if (boost::filesystem::path(flashfiles).extension() != ".zip")
+        return false;
+
+    ZipReader zip;
+    return zip.Open(flashfiles) && zip.Find(kGptIni) && zip.Find(kInstallerCmd);
+}
+
+/* Only the flash commands matter on a blank disk, erase and format find it zeroed already */
+bool VmProvisioner::ReadInstallerCmd(const std::string &dir) {
+    std::ifstream ifs(dir + "/" + kInstallerCmd);
+    if (!ifs) {
+        LOG(error) << "Cannot open " << dir << "/" << kInstallerCmd;
+        return false;
+    }
+
+    images_.clear();
+    std::string line;
+    while (std::getline(ifs, line)) {
+        boost::trim(line);
+        if (line.empty() || (line[0] == '#'))
+            continue;
+        std::vector<std::string> args;
+        boost::split(args, line, boost::is_any_of(" \t"), boost::token_compress_on);
+        if (args[0] == "fastboot")
+            args.erase(args.begin());
+        if (args.empty() || (args[0] != "flash") || (args.size() < 3)) {
+            LOG(info) << "Provision: skip '" << line << "'";
+            continue;
+        }
+        /* The table is written from gpt.ini */
+        if (args[1] == "gpt")
+            continue;
+
+        const GptPartition *part = gpt_.Find(args[1]);
+        if (!part)
+            part = gpt_.Find(args[1] + "_a");
+        if (!part) {
+            LOG(error) << "Provision: no partition " << args[1] << " in " << kGptIni;
+            return false;
+        }
+        std::string file = dir + "/" + args[2];
+        boost::system::error_code ec;
+        if (!boost::filesystem::is_regular_file(file, ec)) {
+            LOG(error) << "Provision: " << file << " not found";
+            return false;
+        }
+        images_.emplace_back(file, part);
+    }
+    return true;
+}
+
+bool VmProvisioner::WritePartitions(int fd) {
+    return RunParallel(images_.size(), kMaxWriters, [&](size_t j) {
+        LOG(info) << "Provision: " << images_[j].first << " -> " << images_[j].second->label;
+        return ImageWriter(fd, *images_[j].second, images_[j].first).Write();
+    });
+}
+
+bool VmProvisioner::Provision(const std::string &dir) {
+    auto start = std::chrono::steady_clock::now();
+    uint64_t size;
+    if (!ParseDiskSize(cfg_.disk.size, &size)) {
+        LOG(error) << "Provision: [disk] size is not set or invalid";
+        return false;
+    }
+    if (!gpt_.Load(dir + "/" + kGptIni, size) || !ReadInstallerCmd(dir))
+        return false;
+
+    std::string opts;
+    if (!DiskImageOpts(cfg_.disk, &opts))
+        return false;
+    std::string fmt = DiskImageFormat(cfg_.disk);
+    /* Other formats and preallocation are produced by qemu-img from a raw image */
+    bool direct = (fmt == kDiskFmtRaw) && opts.empty();
+    std::string target = direct ? cfg_.disk.path : cfg_.disk.path + ".provision";
+
+    boost::system::error_code ec;
+    boost::filesystem::remove(target, ec);
+    int fd = open(target.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG(error) << "Cannot create " << target << ": " << strerror(errno);
+        return false;
+    }
+    bool ret = (ftruncate(fd, size) == 0) && gpt_.Write(fd) && WritePartitions(fd);
+    if (close(fd) != 0)
+        ret = false;
+
+    if (ret && !direct) {
+        std::string cmd("qemu-img convert -W -f raw -O " + fmt + " " + opts + " " + target + " " + cfg_.disk.path);
+        LOG(info) << cmd;
+        if (boost::process::system(cmd)) {
+            LOG(error) << "Failed to : " << cmd;
+            ret = false;
+        }
+        boost::filesystem::remove(target, ec);
+    }
+    if (!ret) {
+        boost::filesystem::remove(target, ec);
+        LOG(error) << "Provision of " << cfg_.disk.path << " failed";
+        return false;
+    }
+
+    std::chrono::duration<double> took = std::chrono::steady_clock::now() - start;
+    LOG(info) << "Provisioned " << cfg_.disk.path << " in " << took.count() << "s";
+    return true;
+}
+
+}  // namespace vm_manager
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef SRC_GUEST_VM_PROVISION_H_
+#define SRC_GUEST_VM_PROVISION_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "guest/config_parser.h"
+#include "guest/gpt_layout.h"
+
+namespace vm_manager {
+
+/*
+ * Writes the partition images of flashfiles straight into the disk of a
+ * guest, the way the installer would, without booting it. The flashfiles
+ * must carry the gpt.ini and the installer.cmd of the installer.
+ */
+class VmProvisioner final {
+ public:
+    explicit VmProvisioner(const CivVmConfig &cfg) : cfg_(cfg) {}
+
+    /* The flashfiles zip has what a host side provisioning needs */
+    static bool CanProvision(const std::string &flashfiles);
+
+    /* dir holds the unpacked flashfiles */
+    bool Provision(const std::string &dir);
+
+ private:
+    bool ReadInstallerCmd(const std::string &dir);
+    bool WritePartitions(int fd);
+
+    const CivVmConfig &cfg_;
+    GptLayout gpt_;
+    /* Image file and the partition it goes to */
+    std::vector<std::pair<std::string, const GptPartition *>> images_;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_GUEST_VM_PROVISION_H_
@@ -0,0 +1,183 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include <sys/stat.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/ini_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "guest/vm_snapshot.h"
+#include "utils/log.h"
+#include "utils/utils.h"
+
+namespace vm_manager {
+
+namespace {
+
+constexpr const char *kSnapshotManifest = "manifest.ini";
+
+using ConfigItems = std::vector<std::pair<std::string, std::string>>;
+
+/* Config values that shape the virtual machine, the saved state only loads into the same shape */
+ConfigItems MachineConfig(const CivVmConfig &cfg) {
+    return {
+        { "emulator", cfg.emul.path },
+        { "memory", cfg.mem.size },
+        { "vcpu", std::to_string(cfg.vcpu.num) },
+        { "firmware_type", cfg.firm.type },
+        { "firmware", cfg.firm.path + cfg.firm.code },
+        { "firmware_vars", cfg.firm.vars },
+        { "disk", cfg.disk.path },
+        { "extra_disks", cfg.disk.extra_paths },
+        { "disk_iothread", cfg.disk.iothread ? "on" : "off" },
+        { "disk_queues", std::to_string(cfg.disk.queues) },
+        { "system_image", cfg.disk.system_image },
+        { "vgpu", cfg.vgpu.type + cfg.vgpu.gvtg_version },
+        { "display", cfg.disp.options },
+        { "net", cfg.net.model },
+        { "vtpm", cfg.vtpm.data_dir },
+        { "rpmb", cfg.rpmb.data_dir },
+        { "passthrough", cfg.pt.pci },
+        { "audio", cfg.audio.disable_emulation ? "off" : "on" },
+        { "extra", cfg.extra.cmd },
+    };
+}
+
+/* Files written by the guest or loaded by the emulator, they must not change while the snapshot is kept */
+std::vector<std::string> TrackedFiles(const CivVmConfig &cfg) {
+    std::vector<std::string> files = CivDiskPaths(cfg);
+    for (auto &f : { cfg.emul.path, cfg.disk.system_image, cfg.firm.path, cfg.firm.vars }) {
+        if (!f.empty())
+            files.push_back(f);
+    }
+    return files;
+}
+
+/* "size:mtime", empty if the file cannot be read */
+std::string FileStamp(const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return "";
+    uint64_t mtime_ns = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ULL + st.st_mtim.tv_nsec;
+    return std::to_string(st.st_size) + ":" + std::to_string(mtime_ns);
+}
+
+}  // namespace
+
+VmSnapshot::VmSnapshot(const std::string &vm_name) :
+    dir_(std::string(GetConfigPath()) + "/snapshots/" + vm_name) {}
+
+std::string VmSnapshot::StatePath(void) const {
+    return dir_ + "/" + kSnapshotStateFile;
+}
+
+bool VmSnapshot::Begin(void) {
+    boost::system::error_code ec;
+    boost::filesystem::remove(dir_ + "/" + kSnapshotManifest, ec);
+    boost::filesystem::remove(StatePath(), ec);
+    boost::filesystem::create_directories(dir_, ec);
+    if (ec) {
+        LOG(error) << "Cannot create snapshot directory " << dir_ << ": " << ec.message();
+        return false;
+    }
+    return true;
+}
+
+bool VmSnapshot::Commit(const CivVmConfig &cfg, const std::string &mode) {
+    boost::property_tree::ptree pt;
+    pt.put("snapshot.mode", mode);
+    for (auto &kv : MachineConfig(cfg))
+        pt.put("config." + kv.first, kv.second);
+
+    auto files = TrackedFiles(cfg);
+    for (size_t i = 0; i < files.size(); i++) {
+        std::string stamp = FileStamp(files[i]);
+        if (stamp.empty()) {
+            LOG(error) << "Snapshot: cannot stat " << files[i];
+            return false;
+        }
+        pt.put("files.path" + std::to_string(i), files[i]);
+        pt.put("files.stamp" + std::to_string(i), stamp);
+    }
+
+    try {
+        boost::property_tree::write_ini(dir_ + "/" + kSnapshotManifest, pt);
+    } catch (std::exception &e) {
+        LOG(error) << "Snapshot: cannot write manifest: " << e.what();
+        return false;
+    }
+    return true;
+}
+
+bool VmSnapshot::Check(const CivVmConfig &cfg, std::string *mode) const {
+    boost::property_tree::ptree pt;
+    try {
+        boost::property_tree::read_ini(dir_ + "/" + kSnapshotManifest, pt);
+    } catch (std::exception &e) {
+        LOG(error) << "No complete snapshot in " << dir_;
+        return false;
+    }
+
+    bool ret = true;
+    for (auto &kv : MachineConfig(cfg)) {
+        std::string saved = pt.get<std::string>("config." + kv.first, "");
+        if (saved != kv.second) {
+            LOG(error) << "Snapshot: " << kv.first << " changed from '" << saved << "' to '" << kv.second << "'";
+            ret = false;
+        }
+    }
+
+    auto files = TrackedFiles(cfg);
+    for (size_t i = 0; i < files.size(); i++) {
+        std::string path = pt.get<std::string>("files.path" + std::to_string(i), "");
+        std::string stamp = pt.get<std::string>("files.stamp" + std::to_string(i), "");
+        if ((path != files[i]) || (stamp != FileStamp(files[i]))) {
+            LOG(error) << "Snapshot: " << files[i] << " was modified after the snapshot was taken";
+            ret = false;
+        }
+    }
+
+    *mode = pt.get<std::string>("snapshot.mode", "");
+    if ((*mode != kSnapshotModeMappedRam) && (*mode != kSnapshotModeStream)) {
+        LOG(error) << "Snapshot: unknown mode '" << *mode << "'";
+        ret = false;
+    }
+    return ret;
+}
+
+bool VmSnapshot::CopyFiles(const std::string &from, const std::string &to) {
+    boost::system::error_code ec;
+    boost::filesystem::create_directories(to, ec);
+    if (ec) {
+        LOG(error) << "Cannot create " << to << ": " << ec.message();
+        return false;
+    }
+
+    for (auto &e : boost::filesystem::directory_iterator(from, ec)) {
+        if (!boost::filesystem::is_regular_file(e.path(), ec))
+            continue;
+        boost::filesystem::copy_file(e.path(), boost::filesystem::path(to) / e.path().filename(),
+                                     boost::filesystem::copy_options::overwrite_existing, ec);
+        if (ec) {
+            LOG(error) << "Cannot copy " << e.path().string() << ": " << ec.message();
+            return false;
+        }
+    }
+    if (ec) {
+        LOG(error) << "Cannot read " << from << ": " << ec.message();
+        return false;
+    }
+    return true;
+}
+
+}  // namespace vm_manager
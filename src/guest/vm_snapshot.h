@@ -0,0 +1,53 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef SRC_GUEST_VM_SNAPSHOT_H_
+#define SRC_GUEST_VM_SNAPSHOT_H_
+
+#include <string>
+
+#include "guest/config_parser.h"
+
+namespace vm_manager {
+
+inline constexpr const char *kSnapshotStateFile = "state";
+inline constexpr const char *kSnapshotVtpmDir = "vtpm";
+inline constexpr const char *kSnapshotRpmbDir = "rpmb";
+
+/* How the RAM was written, the restoring QEMU must read it the same way */
+inline constexpr const char *kSnapshotModeMappedRam = "mapped-ram";
+inline constexpr const char *kSnapshotModeStream = "stream";
+
+/*
+ * Snapshot of a guest, kept in <config path>/snapshots/<name>/. The manifest
+ * is written last, a snapshot without one is incomplete and never restored.
+ */
+class VmSnapshot final {
+ public:
+    explicit VmSnapshot(const std::string &vm_name);
+
+    const std::string &Dir(void) const { return dir_; }
+    std::string StatePath(void) const;
+
+    /* Drop the manifest of an older snapshot and make sure the directory exists */
+    bool Begin(void);
+    /* Record the config and the files the saved state depends on */
+    bool Commit(const CivVmConfig &cfg, const std::string &mode);
+    /* The snapshot is complete and was taken with the same config and files, mode is set from it */
+    bool Check(const CivVmConfig &cfg, std::string *mode) const;
+
+    /* Copy the regular files of from into to, sockets and subdirectories are skipped */
+    static bool CopyFiles(const std::string &from, const std::string &to);
+
+ private:
+    std::string dir_;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_GUEST_VM_SNAPSHOT_H_
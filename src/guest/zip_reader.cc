@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+
+#include "guest/zip_reader.h"
+#include "utils/log.h"
+#include "utils/utils.h"
+
+namespace vm_manager {
+
+namespace {
+
+constexpr uint32_t kEocdSig = 0x06054b50;
+constexpr uint32_t kZip64LocatorSig = 0x07064b50;
+constexpr uint32_t kZip64EocdSig = 0x06064b50;
+constexpr uint32_t kCentralSig = 0x02014b50;
+constexpr uint32_t kLocalSig = 0x04034b50;
+constexpr size_t kEocdSize = 22;
+constexpr size_t kZip64LocatorSize = 20;
+constexpr size_t kZip64EocdSize = 56;
+constexpr size_t kCentralSize = 46;
+constexpr size_t kLocalSize = 30;
+constexpr uint16_t kZip64ExtraId = 0x0001;
+
+constexpr uint16_t kMethodStored = 0;
+constexpr uint16_t kMethodDeflated = 8;
+
+constexpr size_t kInBufSize = 1_MB;
+constexpr size_t kOutBufSize = 4_MB;
+
+uint16_t Get16(const uint8_t *p) {
+    return p[0] | (p[1] << 8);
+}
+
+uint32_t Get32(const uint8_t *p) {
+    return Get16(p) | (static_cast<uint32_t>(Get16(p + 2)) << 16);
+}
+
+uint64_t Get64(const uint8_t *p) {
+    return Get32(p) | (static_cast<uint64_t>(Get32(p + 4)) << 32);
+}
+
+}  // namespace
+
+ZipReader::~ZipReader() {
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+bool ZipReader::ReadAt(uint64_t off, void *buf, size_t len) const {
+    char *p = static_cast<char *>(buf);
+    while (len > 0) {
+        ssize_t n = pread(fd_, p, len, off);
+        if (n <= 0) {
+            LOG(error) << path_ << ": read failed at " << off;
+            return false;
+        }
+        p += n;
+        off += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool ZipReader::Open(const std::string &path) {
+    path_ = path;
+    fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd_ < 0) {
+        LOG(error) << "Cannot open " << path << ": " << strerror(errno);
+        return false;
+    }
+    off_t file_size = lseek(fd_, 0, SEEK_END);
+    if (file_size < static_cast<off_t>(kEocdSize)) {
+        LOG(error) << path << " is not a zip file";
+        return false;
+    }
+
+    /* The end record is followed by a comment of at most 64K */
+    size_t tail_len = std::min<uint64_t>(file_size, kEocdSize + 0xffff);
+    std::vector<uint8_t> tail(tail_len);
+    uint64_t tail_off = file_size - tail_len;
+    if (!ReadAt(tail_off, tail.data(), tail_len))
+        return false;
+    ssize_t eocd = tail_len - kEocdSize;
+    while ((eocd >= 0) && (Get32(&tail[eocd]) != kEocdSig))
+        eocd--;
+    if (eocd < 0) {
+        LOG(error) << path << " is not a zip file";
+        return false;
+    }
+
+    uint64_t count = Get16(&tail[eocd + 10]);
+    uint64_t cd_size = Get32(&tail[eocd + 12]);
+    uint64_t cd_off = Get32(&tail[eocd + 16]);
+    if ((count == 0xffff) || (cd_size == 0xffffffff) || (cd_off == 0xffffffff)) {
+        uint8_t loc[kZip64LocatorSize], rec[kZip64EocdSize];
+        if ((tail_off + eocd < kZip64LocatorSize) ||
+            !ReadAt(tail_off + eocd - kZip64LocatorSize, loc, sizeof(loc)) || (Get32(loc) != kZip64LocatorSig) ||
+            !ReadAt(Get64(loc + 8), rec, sizeof(rec)) || (Get32(rec) != kZip64EocdSig)) {
+            LOG(error) << path << ": bad zip64 end record";
+            return false;
+        }
+        count = Get64(rec + 32);
+        cd_size = Get64(rec + 40);
+        cd_off = Get64(rec + 48);
+    }
+
+    std::vector<uint8_t> cd(cd_size);
+    if (!ReadAt(cd_off, cd.data(), cd.size()))
+        return false;
+
+    entries_.clear();
+    size_t pos = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if ((pos + kCentralSize > cd.size()) || (Get32(&cd[pos]) != kCentralSig)) {
+            LOG(error) << path << ": bad central directory";
+            return false;
+        }
+        const uint8_t *h = &cd[pos];
+        uint16_t name_len = Get16(h + 28), extra_len = Get16(h + 30), comment_len = Get16(h + 32);
+        if (pos + kCentralSize + name_len + extra_len + comment_len > cd.size()) {
+            LOG(error) << path << ": bad central directory";
+            return false;
+        }
+        if (Get16(h + 8) & 1) {
+            LOG(error) << path << ": encrypted entries are not supported";
+            return false;
+        }
+
+        ZipEntry e;
+        e.method = Get16(h + 10);
+        e.crc32 = Get32(h + 16);
+        e.comp_size = Get32(h + 20);
+        e.size = Get32(h + 24);
+        e.header_offset = Get32(h + 42);
+        e.name.assign(reinterpret_cast<const char *>(h + kCentralSize), name_len);
+
+        /* Only the fields saturated in the header are in the zip64 extra field, in this order */
+        const uint8_t *x = h + kCentralSize + name_len, *x_end = x + extra_len;
+        while (x + 4 <= x_end) {
+            uint16_t id = Get16(x), len = Get16(x + 2);
+            const uint8_t *v = x + 4, *v_end = std::min(v + len, x_end);
+            if (id == kZip64ExtraId) {
+                for (uint64_t *f : { &e.size, &e.comp_size, &e.header_offset }) {
+                    if ((*f == 0xffffffff) && (v + 8 <= v_end)) {
+                        *f = Get64(v);
+                        v += 8;
+                    }
+                }
+            }
+            x += 4 + len;
+        }
+
+        entries_.push_back(e);
+        pos += kCentralSize + name_len + extra_len + comment_len;
+    }
+    return true;
+}
+
+const ZipEntry *ZipReader::Find(const std::string &name) const {
+    for (auto &e : entries_) {
+        if (e.name == name)
+            return &e;
+    }
+    return nullptr;
+}
+
+bool ZipReader::Extract(const ZipEntry &e, const Sink &sink) const {
+    if ((e.method != kMethodStored) && (e.method != kMethodDeflated)) {
+        LOG(error) << e.name << ": unsupported compression method " << e.method;
+        return false;
+    }
+    uint8_t lh[kLocalSize];
+    if (!ReadAt(e.header_offset, lh, sizeof(lh)) || (Get32(lh) != kLocalSig)) {
+        LOG(error) << e.name << ": bad local header";
+        return false;
+    }
+    uint64_t in_off = e.header_offset + kLocalSize + Get16(lh + 26) + Get16(lh + 28);
+    uint64_t in_left = e.comp_size;
+
+    std::vector<char> in(kInBufSize), out(kOutBufSize);
+    uint64_t out_off = 0;
+    uLong crc = crc32(0, Z_NULL, 0);
+
+    if (e.method == kMethodStored) {
+        while (in_left > 0) {
+            size_t n = std::min<uint64_t>(in_left, out.size());
+            if (!ReadAt(in_off, out.data(), n))
+                return false;
+            crc = crc32(crc, reinterpret_cast<Bytef *>(out.data()), n);
+            if (!sink(out_off, out.data(), n))
+                return false;
+            in_off += n;
+            in_left -= n;
+            out_off += n;
+        }
+    } else {
+        z_stream zs;
+        memset(&zs, 0, sizeof(zs));
+        /* Raw deflate, zip has its own headers */
+        if (inflateInit2(&zs, -MAX_WBITS) != Z_OK)
+            return false;
+        int ret = Z_OK;
+        bool ok = true;
+        while (ok && (ret != Z_STREAM_END)) {
+            if ((zs.avail_in == 0) && (in_left > 0)) {
+                size_t n = std::min<uint64_t>(in_left, in.size());
+                if (!ReadAt(in_off, in.data(), n)) {
+                    ok = false;
+                    break;
+                }
+                zs.next_in = reinterpret_cast<Bytef *>(in.data());
+                zs.avail_in = n;
+                in_off += n;
+                in_left -= n;
+            }
+            zs.next_out = reinterpret_cast<Bytef *>(out.data());
+            zs.avail_out = out.size();
+            ret = inflate(&zs, Z_NO_FLUSH);
+            if ((ret != Z_OK) && (ret != Z_STREAM_END)) {
+                LOG(error) << e.name << ": corrupt data";
+                ok = false;
+                break;
+            }
+            size_t n = out.size() - zs.avail_out;
+            if ((ret == Z_OK) && (n == 0) && (zs.avail_in == 0) && (in_left == 0)) {
+                LOG(error) << e.name << ": truncated data";
+                ok = false;
+                break;
+            }
+            crc = crc32(crc, reinterpret_cast<Bytef *>(out.data()), n);
+            if (n && !sink(out_off, out.data(), n))
+                ok = false;
+            out_off += n;
+        }
+        inflateEnd(&zs);
+        if (!ok)
+            return false;
+    }
+
+    if ((out_off != e.size) || (crc != e.crc32)) {
+        LOG(error) << e.name << ": size or CRC mismatch";
+        return false;
+    }
+    return true;
+}
+
+bool ZipReader::ExtractTo(const ZipEntry &e, const std::string &path) const {
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        LOG(error) << "Cannot create " << path << ": " << strerror(errno);
+        return false;
+    }
+    bool ret = (ftruncate(fd, e.size) == 0) &&
+               Extract(e, [fd](uint64_t off, const char *buf, size_t len) {
+                   return IsZero(buf, len) || (pwrite(fd, buf, len, off) == static_cast<ssize_t>(len));
+               });
+    if (close(fd) != 0)
+        ret = false;
+    if (!ret)
+        LOG(error) << "Failed to extract " << e.name << " to " << path;
+    return ret;
+}
+
+bool ZipReader::ExtractAll(const std::string &dir) const {
+    boost::system::error_code ec;
+    std::vector<const ZipEntry *> files;
+    for (auto &e : entries_) {
+        if (e.IsDir())
+            continue;
+        if ((e.name[0] == '/') || (e.name.find("..") != std::string::npos)) {
+            LOG(error) << path_ << ": refuse to extract " << e.name;
+            return false;
+        }
+        boost::filesystem::create_directories(boost::filesystem::path(dir + "/" + e.name).parent_path(), ec);
+        files.push_back(&e);
+    }
+
+    return RunParallel(files.size(), kMaxExtractors, [&](size_t j) {
+        return ExtractTo(*files[j], dir + "/" + files[j]->name);
+    });
+}
+
+}  // namespace vm_manager
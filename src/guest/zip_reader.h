@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+
+#ifndef SRC_GUEST_ZIP_READER_H_
+#define SRC_GUEST_ZIP_READER_H_
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace vm_manager {
+
+struct ZipEntry {
+    std::string name;
+    uint16_t method = 0;
+    uint32_t crc32 = 0;
+    uint64_t comp_size = 0;
+    uint64_t size = 0;
+    uint64_t header_offset = 0;
+
+    bool IsDir(void) const { return !name.empty() && (name.back() == '/'); }
+};
+
+/*
+ * Reads stored and deflated entries of a zip archive, zip64 included.
+ * Entries may be extracted from several threads at once.
+ */
+class ZipReader final {
+ public:
+    /* Receives the data of an entry in order, off is from the start of the entry */
+    using Sink = std::function<bool(uint64_t off, const char *buf, size_t len)>;
+
+    ZipReader() = default;
+    ~ZipReader();
+    ZipReader(const ZipReader&) = delete;
+    ZipReader& operator=(const ZipReader&) = delete;
+
+    /* Open the archive and read its central directory */
+    bool Open(const std::string &path);
+
+    const std::vector<ZipEntry> &Entries(void) const { return entries_; }
+    /* nullptr if there is no such entry */
+    const ZipEntry *Find(const std::string &name) const;
+
+    /* Decompress e into sink, the CRC is checked at the end */
+    bool Extract(const ZipEntry &e, const Sink &sink) const;
+    /* Extract into path, zero blocks are left as holes */
+    bool ExtractTo(const ZipEntry &e, const std::string &path) const;
+    /* Extract the regular entries into dir, several at a time */
+    bool ExtractAll(const std::string &dir) const;
+
+ private:
+    bool ReadAt(uint64_t off, void *buf, size_t len) const;
+
+    std::string path_;
+    int fd_ = -1;
+    std::vector<ZipEntry> entries_;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_GUEST_ZIP_READER_H_
@@ -0,0 +1,173 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <algorithm>
+#include <utility>
+
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/ini_parser.hpp>
+
+#include "services/boot_admission.h"
+#include "utils/log.h"
+
+namespace vm_manager {
+
+/* Pressure is sampled at this rate while the head of the queue waits */
+constexpr const std::chrono::milliseconds kAdmissionPollInterval(500);
+
+/* Returns "some avg10" of a PSI file, 0 if PSI is not available */
+static double ReadPsiSomeAvg10(const char *file) {
+    std::ifstream ifs(file);
+    std::string line;
+    while (std::getline(ifs, line)) {
+        if (line.compare(0, 5, "some ") != 0)
+            continue;
+        size_t pos = line.find("avg10=");
+        if (pos == std::string::npos)
+            return 0;
+        try {
+            return std::stod(line.substr(pos + 6));
+        } catch (std::exception &e) {
+            return 0;
+        }
+    }
+    return 0;
+}
+
+/* Returns MemAvailable in MB, 0 if unknown */
+static uint64_t ReadMemAvailableMb(void) {
+    std::ifstream ifs("/proc/meminfo");
+    std::string line;
+    while (std::getline(ifs, line)) {
+        std::istringstream iss(line);
+        std::string key;
+        uint64_t kb = 0;
+        if ((iss >> key >> kb) && (key == "MemAvailable:"))
+            return kb / 1024;
+    }
+    return 0;
+}
+
+void BootAdmission::LoadSettings(const std::string &path) {
+    boost::system::error_code ec;
+    if (!boost::filesystem::exists(path, ec)) {
+        LOG(info) << "Boot admission: " << path << " not found, use defaults";
+        return;
+    }
+
+    try {
+        boost::property_tree::ptree pt;
+        boost::property_tree::ini_parser::read_ini(path, pt);
+
+        BootAdmissionSettings s;
+        s.cpu_some = pt.get<double>("admission.cpu_some_avg10", s.cpu_some);
+        s.io_some = pt.get<double>("admission.io_some_avg10", s.io_some);
+        s.memory_some = pt.get<double>("admission.memory_some_avg10", s.memory_some);
+        s.min_mem_available = pt.get<uint64_t>("admission.min_mem_available", s.min_mem_available);
+        s.max_booting = std::max(pt.get<unsigned int>("admission.max_booting", s.max_booting), 1U);
+        s.stagger = std::chrono::milliseconds(pt.get<int64_t>("admission.stagger", s.stagger.count()));
+        s.max_wait = std::chrono::seconds(pt.get<int64_t>("admission.max_wait", s.max_wait.count()));
+
+        std::scoped_lock lock(mutex_);
+        settings_ = s;
+    } catch (std::exception &e) {
+        LOG(error) << "Boot admission: failed to load " << path << ": " << e.what();
+    }
+}
+
+bool BootAdmission::UnderPressure(std::string *why) {
+    struct {
+        const char *file;
+        double limit;
+    } psi[] = {
+        { "/proc/pressure/cpu", settings_.cpu_some },
+        { "/proc/pressure/io", settings_.io_some },
+        { "/proc/pressure/memory", settings_.memory_some },
+    };
+
+    for (auto &p : psi) {
+        if (p.limit <= 0)
+            continue;
+        double v = ReadPsiSomeAvg10(p.file);
+        if (v > p.limit) {
+            *why = std::string(p.file) + " " + std::to_string(v);
+            return true;
+        }
+    }
+
+    if (settings_.min_mem_available != 0) {
+        uint64_t avail = ReadMemAvailableMb();
+        if ((avail != 0) && (avail < settings_.min_mem_available)) {
+            *why = "MemAvailable " + std::to_string(avail) + "MB";
+            return true;
+        }
+    }
+    return false;
+}
+
+void BootAdmission::Admit(const std::string &name, std::function<void(uint32_t)> on_queued) {
+    std::unique_lock lock(mutex_);
+
+    uint64_t ticket = next_ticket_++;
+    queue_.push_back(ticket);
+    auto start = std::chrono::steady_clock::now();
+    uint32_t reported = 0;
+    std::string why;
+
+    while (true) {
+        auto now = std::chrono::steady_clock::now();
+        auto it = std::find(queue_.begin(), queue_.end(), ticket);
+        uint32_t pos = static_cast<uint32_t>(it - queue_.begin()) + 1;
+
+        if (pos == 1) {
+            bool admit = booting_.empty();
+            if (!admit && (now - start >= settings_.max_wait)) {
+                LOG(warning) << "Boot admission: " << name << " waited too long, admit anyway";
+                admit = true;
+            }
+            if (!admit && (booting_.size() < settings_.max_booting) &&
+                (now - last_admit_ >= settings_.stagger) && !UnderPressure(&why))
+                admit = true;
+
+            if (admit) {
+                queue_.pop_front();
+                booting_.insert(name);
+                last_admit_ = now;
+                cv_.notify_all();
+                if (reported != 0)
+                    LOG(info) << "Boot admission: " << name << " admitted after "
+                              << std::chrono::duration_cast<std::chrono::milliseconds>(now - start).count() << "ms";
+                return;
+            }
+        }
+
+        if (pos != reported) {
+            reported = pos;
+            LOG(info) << "Boot admission: " << name << " queued at " << pos
+                      << (why.empty() ? "" : ", host pressure: " + why);
+            if (on_queued)
+                on_queued(pos);
+        }
+
+        cv_.wait_for(lock, kAdmissionPollInterval);
+    }
+}
+
+void BootAdmission::Done(const std::string &name) {
+    std::scoped_lock lock(mutex_);
+    auto it = booting_.find(name);
+    if (it == booting_.end())
+        return;
+    booting_.erase(it);
+    cv_.notify_all();
+}
+
+}  // namespace vm_manager
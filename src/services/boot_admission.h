@@ -0,0 +1,76 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+#ifndef SRC_SERVICES_BOOT_ADMISSION_H_
+#define SRC_SERVICES_BOOT_ADMISSION_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <set>
+#include <string>
+
+namespace vm_manager {
+
+/* Read from the config path by the server, missing keys keep the defaults below */
+inline constexpr const char *kBootAdmissionConf = "boot_admission.conf";
+
+struct BootAdmissionSettings {
+    /* Limits on PSI "some avg10", in percent, 0 disables the check */
+    double cpu_some = 60.0;
+    double io_some = 40.0;
+    double memory_some = 20.0;
+    /* Floor of MemAvailable in /proc/meminfo, in MB, 0 disables the check */
+    uint64_t min_mem_available = 1024;
+    /* Guests booting at the same time */
+    unsigned int max_booting = 4;
+    /* Gap between two admissions, lets the pressure of the last boot show up */
+    std::chrono::milliseconds stagger{2000};
+    /* A queued boot is admitted regardless of pressure after waiting this long */
+    std::chrono::seconds max_wait{90};
+};
+
+/*
+ * Gate in front of guest boots. Boots are admitted in FIFO order, one at a
+ * time, while the host pressure is under the configured limits. A boot is
+ * always admitted if no other guest is booting, so external load can only
+ * slow the queue down, never stall it.
+ */
+class BootAdmission final {
+ public:
+    BootAdmission() = default;
+    BootAdmission(const BootAdmission&) = delete;
+    BootAdmission& operator=(const BootAdmission&) = delete;
+
+    void LoadSettings(const std::string &path);
+
+    /*
+     * Block until the boot of name may start. on_queued is called with the
+     * queue position, 1 being next, each time it changes while waiting.
+     */
+    void Admit(const std::string &name, std::function<void(uint32_t)> on_queued);
+    /* The admitted boot of name has finished, whether the guest came up or not */
+    void Done(const std::string &name);
+
+ private:
+    bool UnderPressure(std::string *why);
+
+    BootAdmissionSettings settings_;
+    std::deque<uint64_t> queue_;
+    uint64_t next_ticket_ = 1;
+    std::multiset<std::string> booting_;
+    std::chrono::steady_clock::time_point last_admit_;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_SERVICES_BOOT_ADMISSION_H_
@@ -5,10 +5,15 @@
  * SPDX-License-Identifier: Apache-2.0
  *
  */
+#include <signal.h>
+#include <errno.h>
+
+#include <algorithm>
+#include <chrono>
 #include <string>
 #include <vector>
 #include <utility>
-#include <cassert>
+#include <stdexcept>
 
 #include <boost/process/environment.hpp>
 
@@ -19,131 +24,278 @@
 
 namespace vm_manager {
 
+/* Upper bound of one futex sleep, the server liveness is checked in between */
+constexpr const std::chrono::milliseconds kCivClientPollInterval(50);
+
 std::vector<std::string> Client::GetGuestLists(void) {
-    std::vector<std::string> vms;
-    std::pair<bstring *, int> vm_lists = client_shm_.find<bstring>("ListVms");
-    for (auto i = 0; i < vm_lists.second; i++) {
-        vms.push_back(vm_lists.first[i].c_str());
+    return reply_;
+}
+
+void Client::PrepareImportGuest(const char *path) {
+    args_.clear();
+    args_.push_back(path);
+}
+
+void Client::PrepareStartGuest(const char *path) {
+    boost::process::environment env = boost::this_process::environment();
+
+    args_.clear();
+    args_.push_back(path);
+    for (std::string s : env._data) {
+        args_.push_back(s);
     }
-    return vms;
 }
 
-void Client::PrepareStartGuestClientShm(const char *path) {
+void Client::PrepareStartGuests(const std::vector<std::string> &cfg_paths, unsigned int parallel) {
     boost::process::environment env = boost::this_process::environment();
 
-    client_shm_.destroy<bstring>("StartVmCfgPath");
-    client_shm_.destroy<bstring>("StartVmEnv");
-    client_shm_.zero_free_memory();
+    args_.clear();
+    args_.push_back(std::to_string(parallel));
+    args_.push_back(std::to_string(cfg_paths.size()));
+    args_.insert(args_.end(), cfg_paths.begin(), cfg_paths.end());
+    for (std::string s : env._data) {
+        args_.push_back(s);
+    }
+}
 
-    bstring *var_name = client_shm_.construct<bstring>
-                ("StartVmCfgPath")
-                (path, client_shm_.get_segment_manager());
+std::vector<std::string> Client::GetBatchResults(void) {
+    return reply_;
+}
 
-    bstring *var_env = client_shm_.construct<bstring>
-                ("StartVmEnv")
-                [env.size()]
-                (client_shm_.get_segment_manager());
+void Client::PrepareStopGuest(const char *vm_name) {
+    args_.clear();
+    args_.push_back(vm_name);
+}
 
-    if (!var_env)
-        return;
+void Client::PrepareGuests(const std::vector<std::string> &vm_names) {
+    args_ = vm_names;
+}
 
-    for (std::string s : env._data) {
-        var_env->assign(s.c_str());
-        var_env++;
+void Client::PrepareWaitOps(const std::vector<uint64_t> &ids, bool all, std::chrono::milliseconds timeout) {
+    args_.clear();
+    args_.push_back(std::to_string(timeout.count()));
+    args_.push_back(all ? "all" : "any");
+    for (auto id : ids) {
+        args_.push_back(std::to_string(id));
     }
 }
 
-void Client::PrepareStopGuestClientShm(const char *vm_name) {
-    client_shm_.destroy<bstring>("StopVmName");
-    client_shm_.zero_free_memory();
+uint64_t Client::GetOpId(void) {
+    if (reply_.empty())
+        return 0;
+    try {
+        return std::stoull(reply_[0]);
+    } catch (std::exception &e) {
+        return 0;
+    }
+}
 
-    bstring *var_name = client_shm_.construct<bstring>
-                ("StopVmName")
-                (vm_name, client_shm_.get_segment_manager());
+std::vector<std::string> Client::GetOpResults(void) {
+    return reply_;
 }
 
-void Client::PrepareGetGuestInfoClientShm(const char *vm_name) {
-    client_shm_.destroy<bstring>("VmName");
-    client_shm_.zero_free_memory();
+CivVmInfo Client::GetCivVmInfo(const char *vm_name) {
+    args_.clear();
+    args_.push_back(vm_name);
+    if (!Notify(kCivMsgGetVmInfo) || (reply_.size() < 2))
+        return CivVmInfo(0, VmBuilder::VmState::kVmUnknown);
 
-    bstring *var_name = client_shm_.construct<bstring>
-                ("VmName")
-                (vm_name, client_shm_.get_segment_manager());
+    try {
+        CivVmInfo vi(std::stoul(reply_[0]), static_cast<VmBuilder::VmState>(std::stoi(reply_[1])));
+        vi.co_procs.assign(reply_.begin() + 2, reply_.end());
+        return vi;
+    } catch (std::exception &e) {
+        LOG(error) << "Invalid VmInfo: " << e.what();
+        return CivVmInfo(0, VmBuilder::VmState::kVmUnknown);
+    }
 }
 
-CivVmInfo Client::GetCivVmInfo(const char *vm_name) {
-    PrepareGetGuestInfoClientShm(vm_name);
-    Notify(kCivMsgGetVmInfo);
-    CivVmInfo *vm_info = client_shm_.find_or_construct<CivVmInfo>
-                ("VmInfo")
-                (0, VmBuilder::VmState::kVmUnknown);
-    assert(vm_info != nullptr);
-    return std::move(*vm_info);
-}
-
-bool Client::Notify(CivMsgType t) {
-    std::pair<CivMsgSync*, boost::interprocess::managed_shared_memory::size_type> sync;
-    sync = server_shm_.find<CivMsgSync>(kCivServerObjSync);
-    if (!sync.first || (sync.second != 1)) {
-        LOG(error) << "Failed to find sync block!" << sync.first << " size=" << sync.second;
+bool Client::ClaimGuest(const char *tmpl, std::string *vm_name, unsigned int *cid) {
+    args_.clear();
+    args_.push_back(tmpl);
+    if (!Notify(kCivMsgClaimVm) || (reply_.size() < 2))
+        return false;
+
+    try {
+        *vm_name = reply_[0];
+        *cid = std::stoul(reply_[1]);
+    } catch (std::exception &e) {
+        LOG(error) << "Invalid claim reply: " << e.what();
         return false;
     }
-    boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock_clients(sync.first->mutex);
+    return true;
+}
+
+std::vector<std::string> Client::GetPoolStatus(void) {
+    args_.clear();
+    if (!Notify(kCivMsgPoolStatus))
+        return {};
+    return reply_;
+}
+
+bool Client::ServerAlive(void) {
+    pid_t pid = ring_->server_pid;
+    if (pid <= 0)
+        return false;
+    return (kill(pid, 0) == 0) || (errno != ESRCH);
+}
+
+CivMsgSlot *Client::ClaimSlot(std::chrono::steady_clock::time_point deadline) {
+    while (true) {
+        uint32_t free_seq = ring_->free_seq.load(std::memory_order_acquire);
+        for (auto &slot : ring_->slots) {
+            uint32_t c = slot.ctl.load(std::memory_order_acquire);
+            if (CivSlotState(c) != kCivSlotFree) {
+                /* Owner exited without releasing the slot */
+                pid_t owner = slot.owner.load();
+                if ((owner <= 0) || (kill(owner, 0) == 0) || (errno != ESRCH))
+                    continue;
+                if (!slot.owner.compare_exchange_strong(owner, 0))
+                    continue;
+                if (!slot.ctl.compare_exchange_strong(c, CivSlotCtl(CivSlotGen(c), kCivSlotFree)))
+                    continue;
+                c = CivSlotCtl(CivSlotGen(c), kCivSlotFree);
+            }
+            if (slot.ctl.compare_exchange_strong(c, CivSlotCtl(CivSlotGen(c) + 1, kCivSlotClaimed))) {
+                slot.owner.store(getpid());
+                return &slot;
+            }
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        if ((now >= deadline) || !ServerAlive())
+            return nullptr;
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
+        FutexWait(&ring_->free_seq, free_seq, std::min(wait, kCivClientPollInterval));
+    }
+}
+
+void Client::ReleaseSlot(CivMsgSlot *slot, uint32_t gen) {
+    slot->payload_len = 0;
+    slot->owner.store(0);
+    slot->ctl.store(CivSlotCtl(gen, kCivSlotFree), std::memory_order_release);
+    ring_->free_seq.fetch_add(1, std::memory_order_release);
+    FutexWake(&ring_->free_seq, 1);
+}
+
+bool Client::Notify(CivMsgType t, std::chrono::milliseconds timeout) {
+    reply_.clear();
 
-    CivMsg *data = server_shm_.construct<CivMsg>
-                (kCivServerObjData)
-                ();
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    CivMsgSlot *slot = ClaimSlot(deadline);
+    if (!slot) {
+        LOG(error) << "Server is busy or not running, no free message slot!";
+        return false;
+    }
+    uint32_t gen = CivSlotGen(slot->ctl.load(std::memory_order_acquire));
 
-    if (!data) {
+    if (!slot->SetPayload(args_)) {
+        LOG(error) << "Message payload is too large!";
+        ReleaseSlot(slot, gen);
         return false;
     }
-    data->type = t;
-    strncpy(data->payload, client_shm_name_.c_str(), sizeof(data->payload) - 1);
-    data->payload[sizeof(data->payload) - 1] = '\0';
-
-    boost::interprocess::scoped_lock<boost::interprocess::interprocess_mutex> lock_cond(sync.first->mutex_cond);
-    sync.first->cond_s.notify_one();
-    sync.first->msg_in = true;
-
-    int retry_cnt = 0;
-    constexpr const int kMaxRetryCount = 100;
-    while (sync.first->msg_in && (retry_cnt < kMaxRetryCount)) {
-        boost::interprocess::cv_status cs = sync.first->cond_c.wait_for(lock_cond, boost::chrono::seconds(1));
-        if (cs != boost::interprocess::cv_status::timeout) {
+    uint64_t req_id = ring_->next_req_id.fetch_add(1);
+    slot->type = t;
+    slot->req_id = req_id;
+    slot->reply_id = 0;
+    slot->ctl.store(CivSlotCtl(gen, kCivSlotRequest), std::memory_order_release);
+
+    ring_->doorbell.fetch_add(1, std::memory_order_release);
+    FutexWake(&ring_->doorbell, 1);
+
+    while (true) {
+        uint32_t c = slot->ctl.load(std::memory_order_acquire);
+        CivMsgSlotState st = CivSlotState(c);
+        if (st == kCivSlotDone)
             break;
-        } else {
-            retry_cnt++;
+
+        auto now = std::chrono::steady_clock::now();
+        bool alive = ServerAlive();
+        /* Server is writing the reply, it will be done shortly */
+        if ((!alive || (now >= deadline)) && (st != kCivSlotReplying)) {
+            if (!slot->ctl.compare_exchange_strong(c, CivSlotCtl(gen, kCivSlotFree)))
+                continue;
+            slot->owner.store(0);
+            ring_->free_seq.fetch_add(1, std::memory_order_release);
+            FutexWake(&ring_->free_seq, 1);
+            if (!alive)
+                LOG(error) << "Server exited while handling request " << req_id << "!";
+            else
+                LOG(error) << "Server is not responding to request " << req_id << "!";
+            return false;
         }
-    }
 
-    int ret = false;
-    if (retry_cnt < kMaxRetryCount)
-        ret = data->type == kCivMsgRespondSuccess ? true : false;
-    else
-        LOG(error) << "Server is not responding!";
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
+        if (wait.count() <= 0)
+            wait = std::chrono::milliseconds(1);
+        FutexWait(&slot->ctl, c, std::min(wait, kCivClientPollInterval));
+    }
 
-    server_shm_.destroy<CivMsg>(kCivServerObjData);
-    server_shm_.zero_free_memory();
+    bool ret = false;
+    if (slot->reply_id == req_id) {
+        ret = (slot->type == kCivMsgRespondSuccess);
+        reply_ = slot->GetPayload();
+    } else {
+        LOG(error) << "Mismatched reply " << slot->reply_id << " for request " << req_id;
+    }
 
+    ReleaseSlot(slot, gen);
     return ret;
 }
 
-Client::Client() {
-    server_shm_ = boost::interprocess::managed_shared_memory(boost::interprocess::open_only, kCivServerMemName);
+uint32_t Client::GetVmEventHead(void) {
+    return ring_->events.head.load(std::memory_order_acquire);
+}
+
+bool Client::WaitVmEvents(uint32_t *cursor, std::vector<CivVmEvent> *events, std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    uint32_t head;
+    while ((head = GetVmEventHead()) == *cursor) {
+        auto now = std::chrono::steady_clock::now();
+        if (!ServerAlive())
+            return false;
+        if (now >= deadline)
+            return true;
+        auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now);
+        FutexWait(&ring_->events.head, head, std::min(wait, kCivClientPollInterval));
+    }
 
-    client_shm_name_ = std::string("CivClientShm" + std::to_string(getpid()));
-    boost::interprocess::permissions perm;
-    perm.set_unrestricted();
-    client_shm_ = boost::interprocess::managed_shared_memory(
-            boost::interprocess::create_only,
-            client_shm_name_.c_str(),
-            65536,
-            0,
-            perm);
+    if (head - *cursor > CivVmEventRing::EventNum) {
+        LOG(warning) << "Subscriber is too slow, lost " << head - *cursor - CivVmEventRing::EventNum << " events";
+        *cursor = head - CivVmEventRing::EventNum;
+    }
+    while (*cursor != head) {
+        CivVmEvent ev;
+        if (ring_->events.Read(*cursor, &ev)) {
+            events->push_back(ev);
+        } else {
+            LOG(warning) << "Lost event " << *cursor;
+        }
+        (*cursor)++;
+    }
+    return true;
 }
 
-Client::~Client() {
-    boost::interprocess::shared_memory_object::remove(client_shm_name_.c_str());
+void Client::SubscribeVmEvents(std::function<bool(const CivVmEvent &)> cb) {
+    uint32_t cursor = GetVmEventHead();
+    std::vector<CivVmEvent> events;
+    while (WaitVmEvents(&cursor, &events, std::chrono::seconds(1))) {
+        for (auto &ev : events) {
+            if (!cb(ev))
+                return;
+        }
+        events.clear();
+    }
+}
+
+Client::Client() {
+    server_shm_ = boost::interprocess::managed_shared_memory(boost::interprocess::open_only, kCivServerMemName);
+
+    ring_ = server_shm_.find<CivMsgRing>(kCivServerObjRing).first;
+    if (!ring_)
+        throw std::runtime_error("Failed to find message ring of server!");
+    if (!ServerAlive())
+        throw std::runtime_error("Server is not running!");
 }
 
 }  // namespace vm_manager
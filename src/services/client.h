@@ -8,6 +8,8 @@
 #ifndef SRC_SERVICES_CLIENT_H_
 #define SRC_SERVICES_CLIENT_H_
 
+#include <chrono>
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -19,20 +21,49 @@ namespace vm_manager {
 class Client {
  public:
     Client();
-    ~Client();
+    ~Client() = default;
 
-    void PrepareImportGuestClientShm(const char *cfg_path);
+    void PrepareImportGuest(const char *cfg_path);
     std::vector<std::string> GetGuestLists(void);
-    void PrepareStartGuestClientShm(const char *vm_name);
-    void PrepareStopGuestClientShm(const char *vm_name);
-    void PrepareGetGuestInfoClientShm(const char *vm_name);
+    void PrepareStartGuest(const char *cfg_path);
+    void PrepareStartGuests(const std::vector<std::string> &cfg_paths, unsigned int parallel);
+    /* One "name:result:milliseconds" entry per guest, in the order of the request */
+    std::vector<std::string> GetBatchResults(void);
+    void PrepareStopGuest(const char *vm_name);
+    /* For kCivMsgPauseVm and kCivMsgResumeVm, results are read by GetBatchResults */
+    void PrepareGuests(const std::vector<std::string> &vm_names);
+    /* Wait for all or any of the operations, up to timeout */
+    void PrepareWaitOps(const std::vector<uint64_t> &ids, bool all, std::chrono::milliseconds timeout);
+    /* Id returned by an async start or stop, 0 if there is none */
+    uint64_t GetOpId(void);
+    /* One "id:state:description" entry per operation waited for */
+    std::vector<std::string> GetOpResults(void);
     CivVmInfo GetCivVmInfo(const char *vm_name);
-    bool Notify(CivMsgType t);
+    /* Take a paused guest of the template out of the warm pool and resume it */
+    bool ClaimGuest(const char *tmpl, std::string *vm_name, unsigned int *cid);
+    /* One "template:ready:booting:size" entry per warm pool template */
+    std::vector<std::string> GetPoolStatus(void);
+    bool Notify(CivMsgType t, std::chrono::milliseconds timeout = kCivMsgDefaultTimeout);
+
+    /* End of the event stream, subscribing from here skips the history */
+    uint32_t GetVmEventHead(void);
+    /*
+     * Wait until events after *cursor are published or timeout expires, then
+     * append them to events and advance *cursor. Returns false once the server is gone.
+     */
+    bool WaitVmEvents(uint32_t *cursor, std::vector<CivVmEvent> *events, std::chrono::milliseconds timeout);
+    /* Stream events to cb until it returns false or the server exits */
+    void SubscribeVmEvents(std::function<bool(const CivVmEvent &)> cb);
 
  private:
+    bool ServerAlive(void);
+    CivMsgSlot *ClaimSlot(std::chrono::steady_clock::time_point deadline);
+    void ReleaseSlot(CivMsgSlot *slot, uint32_t gen);
+
     boost::interprocess::managed_shared_memory server_shm_;
-    boost::interprocess::managed_shared_memory client_shm_;
-    std::string client_shm_name_;
+    CivMsgRing *ring_ = nullptr;
+    std::vector<std::string> args_;
+    std::vector<std::string> reply_;
 };
 
 }  // namespace vm_manager
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <climits>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "services/message.h"
+
+namespace vm_manager {
+
+bool CivMsgSlot::SetPayload(const std::vector<std::string> &v) {
+    size_t len = 0;
+    for (auto &s : v) {
+        if (len + s.size() + 1 > MaxPayloadSize) {
+            payload_len = 0;
+            return false;
+        }
+        memcpy(payload + len, s.c_str(), s.size() + 1);
+        len += s.size() + 1;
+    }
+    payload_len = len;
+    return true;
+}
+
+std::vector<std::string> CivMsgSlot::GetPayload(void) const {
+    std::vector<std::string> v;
+    size_t pos = 0;
+    while (pos < payload_len) {
+        size_t len = strnlen(payload + pos, payload_len - pos);
+        v.emplace_back(payload + pos, len);
+        pos += len + 1;
+    }
+    return v;
+}
+
+void CivVmEventRing::Publish(const CivVmEvent &ev) {
+    uint32_t seq = head.load(std::memory_order_relaxed);
+    Entry &e = entries[seq % EventNum];
+
+    e.tag.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    e.ev = ev;
+    e.ev.seq = seq;
+    e.tag.store(seq + 1, std::memory_order_release);
+
+    head.store(seq + 1, std::memory_order_release);
+    FutexWake(&head, INT_MAX);
+}
+
+bool CivVmEventRing::Read(uint32_t seq, CivVmEvent *ev) const {
+    const Entry &e = entries[seq % EventNum];
+
+    if (e.tag.load(std::memory_order_acquire) != seq + 1)
+        return false;
+    *ev = e.ev;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return e.tag.load(std::memory_order_relaxed) == seq + 1;
+}
+
+int FutexWait(std::atomic<uint32_t> *addr, uint32_t expected, std::chrono::milliseconds timeout) {
+    struct timespec ts;
+    struct timespec *pts = nullptr;
+    if (timeout.count() >= 0) {
+        ts.tv_sec = timeout.count() / 1000;
+        ts.tv_nsec = (timeout.count() % 1000) * 1000000;
+        pts = &ts;
+    }
+    return syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAIT, expected, pts, nullptr, 0);
+}
+
+void FutexWake(std::atomic<uint32_t> *addr, int count) {
+    syscall(SYS_futex, reinterpret_cast<uint32_t *>(addr), FUTEX_WAKE, count, nullptr, nullptr, 0);
+}
+
+}  // namespace vm_manager
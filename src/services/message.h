@@ -8,25 +8,21 @@
 #ifndef SRC_SERVICES_MESSAGE_H_
 #define SRC_SERVICES_MESSAGE_H_
 
+#include <sys/types.h>
+
+#include <atomic>
+#include <chrono>
 #include <string>
+#include <vector>
 
-#include <boost/interprocess/sync/interprocess_mutex.hpp>
-#include <boost/interprocess/sync/interprocess_condition.hpp>
 #include <boost/interprocess/managed_shared_memory.hpp>
-#include <boost/interprocess/allocators/allocator.hpp>
-#include <boost/interprocess/containers/string.hpp>
 
 #include "guest/vm_builder.h"
 
 namespace vm_manager {
 
-typedef boost::interprocess::allocator<char, boost::interprocess::managed_shared_memory::segment_manager> CharAllocator;
-typedef boost::interprocess::basic_string<char, std::char_traits<char>, CharAllocator> bstring;
-
 inline constexpr const char *kCivServerMemName = "CivServerShm";
-inline constexpr const char *kCivServerObjSync = "Civ Message Sync";
-inline constexpr const char *kCivServerObjData = "Civ Message Data";
-
+inline constexpr const char *kCivServerObjRing = "Civ Message Ring";
 
 enum CivMsgType {
     kCiVMsgStopServer = 100U,
@@ -35,6 +31,16 @@ enum CivMsgType {
     kCivMsgStartVm,
     kCivMsgStopVm,
     kCivMsgGetVmInfo,
+    kCivMsgStartVmBatch,
+    kCivMsgStartVmAsync,
+    kCivMsgStopVmAsync,
+    kCivMsgWaitOps,
+    kCivMsgPauseVm,
+    kCivMsgResumeVm,
+    kCivMsgSaveVm,
+    kCivMsgRestoreVm,
+    kCivMsgClaimVm,
+    kCivMsgPoolStatus,
     kCivMsgTest,
     kCivMsgRespondSuccess = 500U,
     kCivMsgRespondFail,
@@ -43,24 +49,152 @@ enum CivMsgType {
 struct CivVmInfo {
     unsigned int cid;
     VmBuilder::VmState state;
+    /* "exe:restart policy:restarts:state" of each co-process */
+    std::vector<std::string> co_procs;
     CivVmInfo(unsigned int c, VmBuilder::VmState s) : cid(c), state(s){}
 };
 
-struct CivMsgSync {
-    boost::interprocess::interprocess_mutex mutex;
-    boost::interprocess::interprocess_mutex mutex_cond;
-    boost::interprocess::interprocess_condition cond_s;
-    boost::interprocess::interprocess_condition cond_c;
-    bool msg_in;
+inline constexpr std::chrono::seconds kCivMsgDefaultTimeout(100);
+/* Upper bound of one start, covers waiting for guest ready */
+inline constexpr std::chrono::seconds kCivMsgStartTimeout(300);
+
+/* Time for a stopped guest to exit before an async stop is reported failed */
+inline constexpr std::chrono::seconds kCivStopTimeout(60);
+
+/* Upper bound of saving a guest, covers writing all of its RAM */
+inline constexpr std::chrono::seconds kCivMsgSaveTimeout(660);
+
+/* Guests booted at the same time by a batch start if not given */
+inline constexpr unsigned int kCivBatchDefaultParallel = 4U;
+
+enum CivMsgSlotState : uint32_t {
+    kCivSlotFree = 0,
+    kCivSlotClaimed,
+    kCivSlotRequest,
+    kCivSlotBusy,
+    kCivSlotReplying,
+    kCivSlotDone,
 };
 
-struct CivMsg {
-    enum { MaxPayloadSize = 1024U };
+/*
+ * Slot control word, also used as the futex the client sleeps on:
+ *   bits 0-7:  CivMsgSlotState
+ *   bits 8-31: claim generation, bumped on every claim so a stale owner
+ *              cannot move a reused slot
+ */
+static inline constexpr uint32_t CivSlotCtl(uint32_t gen, CivMsgSlotState st) {
+    return (gen << 8) | st;
+}
 
-    CivMsgType type;
+static inline constexpr uint32_t CivSlotGen(uint32_t ctl) {
+    return ctl >> 8;
+}
+
+static inline constexpr CivMsgSlotState CivSlotState(uint32_t ctl) {
+    return static_cast<CivMsgSlotState>(ctl & 0xFFU);
+}
+
+/*
+ * One request/response slot. The request payload is overwritten by the reply
+ * once the server has taken the request out of the slot.
+ */
+struct CivMsgSlot {
+    enum { MaxPayloadSize = 60 * 1024U };
+
+    std::atomic<uint32_t> ctl{0};
+    std::atomic<pid_t> owner{0};
+    /* Request id set by client, echoed back in reply_id by server */
+    uint64_t req_id = 0;
+    uint64_t reply_id = 0;
+    CivMsgType type = kCivMsgTest;
+    uint32_t payload_len = 0;
     char payload[MaxPayloadSize];
+
+    /* Payload is a sequence of NUL terminated strings */
+    bool SetPayload(const std::vector<std::string> &v);
+    std::vector<std::string> GetPayload(void) const;
+};
+
+enum CivVmEventType : uint32_t {
+    kCivVmEventCreated = 0,
+    kCivVmEventBooting,
+    kCivVmEventRunning,
+    kCivVmEventPaused,
+    kCivVmEventExited,
+    kCivVmEventQueued,
 };
 
+static inline constexpr const char *VmEventToStr(CivVmEventType t) {
+    switch (t) {
+        case kCivVmEventCreated: return "Created";
+        case kCivVmEventBooting: return "Booting";
+        case kCivVmEventRunning: return "Running";
+        case kCivVmEventPaused:  return "Paused";
+        case kCivVmEventExited:  return "Exited";
+        case kCivVmEventQueued:  return "Queued";
+    }
+    return "NaN";
+}
+
+struct CivVmEvent {
+    enum { MaxNameLen = 64U };
+
+    /* Position of the event in the stream, starts from 0 */
+    uint32_t seq = 0;
+    CivVmEventType type = kCivVmEventCreated;
+    /* Exit code of the main process, only valid for kCivVmEventExited */
+    int32_t exit_code = 0;
+    /* Position in the boot queue, 1 is next, only valid for kCivVmEventQueued */
+    uint32_t queue_pos = 0;
+    /* CLOCK_REALTIME, in nanoseconds */
+    uint64_t timestamp_ns = 0;
+    char name[MaxNameLen] = { 0 };
+};
+
+/*
+ * Broadcast ring of VM lifecycle events, written by the server only. Every
+ * subscriber keeps its own cursor and sleeps on the head futex, a subscriber
+ * that falls more than EventNum behind loses the oldest events.
+ */
+struct CivVmEventRing {
+    enum { EventNum = 256U };
+
+    struct Entry {
+        /* Seqlock: seq + 1 once the event is published, 0 while it is rewritten */
+        std::atomic<uint32_t> tag{0};
+        CivVmEvent ev;
+    };
+
+    /* Number of events published so far */
+    std::atomic<uint32_t> head{0};
+    Entry entries[EventNum];
+
+    void Publish(const CivVmEvent &ev);
+    /* Returns false if the event at seq has been overwritten or not published yet */
+    bool Read(uint32_t seq, CivVmEvent *ev) const;
+};
+
+/* Lives in the server shm, mapped once by each client and reused for every call */
+struct CivMsgRing {
+    enum { SlotNum = 16U };
+
+    pid_t server_pid = 0;
+    std::atomic<uint64_t> next_req_id{1};
+    /* Bumped when a request is posted, server sleeps on it */
+    std::atomic<uint32_t> doorbell{0};
+    /* Bumped when a slot is released, clients waiting for a slot sleep on it */
+    std::atomic<uint32_t> free_seq{0};
+    CivMsgSlot slots[SlotNum];
+    CivVmEventRing events;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "futex word must be lock free");
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared atomics must be lock free");
+
+/* Process shared futex, timeout < 0 waits forever */
+int FutexWait(std::atomic<uint32_t> *addr, uint32_t expected, std::chrono::milliseconds timeout);
+void FutexWake(std::atomic<uint32_t> *addr, int count);
+
 }  // namespace vm_manager
 
 #endif  // SRC_SERVICES_MESSAGE_H_
@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "services/op_table.h"
+
+namespace vm_manager {
+
+uint64_t OpTable::Create(const std::string &desc) {
+    std::scoped_lock lock(mutex_);
+    uint64_t id = next_id_++;
+    ops_[id] = Op{kCivOpPending, desc};
+    return id;
+}
+
+void OpTable::Finish(uint64_t id, bool success) {
+    std::scoped_lock lock(mutex_);
+    auto it = ops_.find(id);
+    if ((it == ops_.end()) || (it->second.state != kCivOpPending))
+        return;
+    it->second.state = success ? kCivOpSucceeded : kCivOpFailed;
+
+    finished_.push_back(id);
+    while (finished_.size() > kMaxFinished) {
+        ops_.erase(finished_.front());
+        finished_.pop_front();
+    }
+    cv_.notify_all();
+}
+
+CivOpState OpTable::StateOf(uint64_t id) {
+    auto it = ops_.find(id);
+    if (it == ops_.end())
+        return kCivOpUnknown;
+    return it->second.state;
+}
+
+bool OpTable::Wait(const std::vector<uint64_t> &ids, bool all,
+                   std::chrono::steady_clock::time_point deadline, std::vector<std::string> *out) {
+    std::unique_lock lock(mutex_);
+
+    auto met = [&]() {
+        size_t done = 0;
+        for (auto id : ids) {
+            CivOpState s = StateOf(id);
+            if ((s == kCivOpSucceeded) || (s == kCivOpFailed))
+                done++;
+        }
+        return all ? (done == ids.size()) : (done != 0);
+    };
+
+    bool ret = cv_.wait_until(lock, deadline, met);
+
+    for (auto id : ids) {
+        auto it = ops_.find(id);
+        std::string desc = (it == ops_.end()) ? "" : it->second.desc;
+        CivOpState s = StateOf(id);
+        out->push_back(std::to_string(id) + ":" + OpStateToStr(s) + ":" + desc);
+        if ((s == kCivOpSucceeded) || (s == kCivOpFailed)) {
+            ops_.erase(it);
+            finished_.erase(std::remove(finished_.begin(), finished_.end(), id), finished_.end());
+        }
+    }
+    return ret;
+}
+
+}  // namespace vm_manager
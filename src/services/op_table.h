@@ -0,0 +1,82 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+#ifndef SRC_SERVICES_OP_TABLE_H_
+#define SRC_SERVICES_OP_TABLE_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+
+namespace vm_manager {
+
+enum CivOpState {
+    kCivOpPending = 0,
+    kCivOpSucceeded,
+    kCivOpFailed,
+    kCivOpUnknown,
+};
+
+static inline constexpr const char *OpStateToStr(CivOpState s) {
+    switch (s) {
+        case kCivOpPending:   return "Pending";
+        case kCivOpSucceeded: return "Succeeded";
+        case kCivOpFailed:    return "Failed";
+        default:              return "Unknown";
+    }
+}
+
+/*
+ * Operations running in the background of the server, tracked by id until
+ * a client collects them. Finished operations are dropped once a Wait has
+ * reported them, or oldest first once more than kMaxFinished of them are
+ * left uncollected.
+ */
+class OpTable final {
+ public:
+    enum { kMaxFinished = 1024U };
+
+    OpTable() = default;
+    OpTable(const OpTable&) = delete;
+    OpTable& operator=(const OpTable&) = delete;
+
+    /* Returns the id of a new pending operation, ids start from 1 */
+    uint64_t Create(const std::string &desc);
+    void Finish(uint64_t id, bool success);
+
+    /*
+     * Wait until all (or any, if all is false) of ids have finished or the
+     * deadline passes. One "id:state:description" entry per id goes to out.
+     * Returns true if the condition was met, unknown ids never finish.
+     * The finished ones are collected, later waits see them unknown.
+     */
+    bool Wait(const std::vector<uint64_t> &ids, bool all,
+              std::chrono::steady_clock::time_point deadline, std::vector<std::string> *out);
+
+ private:
+    struct Op {
+        CivOpState state;
+        std::string desc;
+    };
+
+    CivOpState StateOf(uint64_t id);
+
+    std::map<uint64_t, Op> ops_;
+    std::deque<uint64_t> finished_;
+    uint64_t next_id_ = 1;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_SERVICES_OP_TABLE_H_
@@ -9,19 +9,23 @@
 #include <sys/socket.h>
 #include <linux/vm_sockets.h>
 
+#include <cerrno>
+#include <cstring>
 #include <iostream>
 #include <exception>
 #include <utility>
 #include <string>
 #include <memory>
 #include <vector>
+#include <algorithm>
+#include <set>
+#include <chrono>
 
+#include <boost/filesystem.hpp>
 #include <boost/interprocess/managed_shared_memory.hpp>
 #include <boost/interprocess/mapped_region.hpp>
 #include <boost/interprocess/sync/scoped_lock.hpp>
 #include <boost/process/environment.hpp>
-#include <boost/interprocess/allocators/allocator.hpp>
-#include <boost/interprocess/containers/string.hpp>
 #include <boost/thread/mutex.hpp>
 
 #include <grpcpp/grpcpp.h>
@@ -30,6 +34,7 @@
 #include "services/message.h"
 #include "guest/vm_powerctl.h"
 #include "guest/vm_builder_qemu.h"
+#include "guest/vm_snapshot.h"
 #include "utils/log.h"
 #include "utils/utils.h"
 #include "include/constants/vm_manager.h"
@@ -38,47 +43,134 @@ namespace vm_manager {
 
 const int kCivSharedMemSize = 20480U;
 
-size_t Server::FindVmInstance(std::string name) {
-    for (size_t i = 0; i < vmis_.size(); ++i) {
-        if (vmis_[i]->GetName().compare(name) == 0)
-            return i;
+/* The warm pool is checked for missing guests at least this often */
+constexpr const std::chrono::seconds kPoolCheckInterval(5);
+
+Server::VmOpLock Server::LockVmOp(const std::string &name) {
+    std::shared_ptr<std::mutex> m;
+    {
+        std::scoped_lock lock(vm_op_map_mutex_);
+        auto &slot = vm_op_mutex_[name];
+        if (!slot)
+            slot = std::make_shared<std::mutex>();
+        m = slot;
     }
-    return -1UL;
+    /* Holders and waiters keep a reference, so the map does not drop it under them */
+    return VmOpLock(this, name, std::move(m));
 }
 
-void Server::DeleteVmInstance(std::string name) {
-    std::scoped_lock lock(vmis_mutex_);
-    size_t index = FindVmInstance(name);
-    if (index == -1UL)
+Server::VmOpLock::~VmOpLock() {
+    lock_.unlock();
+    m_.reset();
+    server_->DropVmOpMutex(name_);
+}
+
+void Server::DropVmOpMutex(const std::string &name) {
+    std::scoped_lock lock(vm_op_map_mutex_);
+    auto it = vm_op_mutex_.find(name);
+    /* References are only taken under vm_op_map_mutex_, the map holds the last one */
+    if ((it == vm_op_mutex_.end()) || (it->second.use_count() > 1) || vms_.Find(name))
         return;
-    vmis_.erase(vmis_.begin() + index);
-}
-
-int Server::StopVm(const char payload[]) {
-    boost::interprocess::managed_shared_memory shm(
-        boost::interprocess::open_only,
-        payload);
-    std::pair<bstring *, int> vm_name;
-    vm_name = shm.find<bstring>("StopVmName");
-    size_t id = FindVmInstance(std::string(vm_name.first->c_str()));
-
-    if (id != -1UL) {
-        LOG(info) << "StopVm: " << vmis_[id]->GetName();
-        char listener_address[50] = { 0 };
-        snprintf(listener_address, sizeof(listener_address) - 1, "vsock:%u:%u",
-                vmis_[id]->GetCid(),
-        vm_manager::kCivPowerCtlListenerPort);
-        CivVmPowerCtl pm(grpc::CreateChannel(listener_address, grpc::InsecureChannelCredentials()));
-        if (!pm.Shutdown()) {
-            vmis_[id]->StopVm();
-        }
-    } else {
-        LOG(warning) << "CiV: " << vm_name.first->c_str() << " is not running!";
+    vm_op_mutex_.erase(it);
+}
+
+int Server::StopVm(const std::vector<std::string> &args, std::vector<std::string> *out) {
+    if (args.empty())
         return -1;
+    const std::string &name = args[0];
+
+    auto op_lock = LockVmOp(name);
+
+    VmHandle h = vms_.Find(name);
+    if (!h) {
+        LOG(warning) << "CiV: " << name << " is not running!";
+        return -1;
+    }
+    uint32_t cid = h.vm->GetCid();
+
+    /* A paused guest cannot answer the shutdown request */
+    if (h.vm->GetState() == VmBuilder::VmState::kVmPaused)
+        h.vm->ResumeVm();
+
+    LOG(info) << "StopVm: " << name;
+    char listener_address[50] = { 0 };
+    snprintf(listener_address, sizeof(listener_address) - 1, "vsock:%u:%u",
+            cid,
+    vm_manager::kCivPowerCtlListenerPort);
+    CivVmPowerCtl pm(grpc::CreateChannel(listener_address, grpc::InsecureChannelCredentials()));
+    if (!pm.Shutdown())
+        h.vm->StopVm();
+    return 0;
+}
+
+/* The instance h has exited, or went back to kVmCreated if it is imported */
+bool Server::WaitVmStopped(VmHandle h, std::chrono::seconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    while (std::chrono::steady_clock::now() < deadline) {
+        VmHandle cur = vms_.Find(h.vm->GetName());
+        if (!cur || (cur.gen != h.gen) || (cur.vm->GetState() == VmBuilder::VmState::kVmCreated))
+            return true;
+        boost::this_thread::sleep_for(boost::chrono::milliseconds(100));
     }
+    return false;
+}
+
+/* Run fn in background, out gets the operation id to wait for */
+int Server::RunAsync(const std::string &desc, std::function<int(void)> fn, std::vector<std::string> *out) {
+    uint64_t id = ops_.Create(desc);
+
+    boost::thread t([this, id, desc, fn]() {
+        int ret = -1;
+        try {
+            ret = fn();
+        } catch (std::exception &e) {
+            LOG(error) << "Operation " << id << " (" << desc << "): " << e.what();
+        }
+        ops_.Finish(id, ret == 0);
+    });
+    t.detach();
+
+    out->push_back(std::to_string(id));
     return 0;
 }
 
+int Server::StartVmAsync(const std::vector<std::string> &args, std::vector<std::string> *out) {
+    if (args.empty() || args[0].empty())
+        return -1;
+
+    return RunAsync("start " + args[0], [this, args]() {
+        std::vector<std::string> o;
+        return StartVm(args, &o);
+    }, out);
+}
+
+int Server::StopVmAsync(const std::vector<std::string> &args, std::vector<std::string> *out) {
+    if (args.empty() || args[0].empty())
+        return -1;
+
+    return RunAsync("stop " + args[0], [this, args]() {
+        VmHandle h = vms_.Find(args[0]);
+        std::vector<std::string> o;
+        if (!h || (StopVm(args, &o) != 0))
+            return -1;
+        return WaitVmStopped(h, kCivStopTimeout) ? 0 : -1;
+    }, out);
+}
+
+/* args: timeout in milliseconds, "all" or "any", operation ids */
+int Server::WaitOps(const std::vector<std::string> &args, std::vector<std::string> *out) {
+    if (args.size() < 3)
+        return -1;
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(std::stoll(args[0]));
+    bool all = (args[1] == "all");
+    std::vector<uint64_t> ids;
+    for (auto it = args.begin() + 2; it != args.end(); ++it)
+        ids.push_back(std::stoull(*it));
+
+    return ops_.Wait(ids, all, deadline, out) ? 0 : -1;
+}
+
 bool Server::SetupStartupListenerService(void) {
     boost::latch listener_ready(1);
     char listener_address[50] = { 0 };
@@ -94,210 +186,715 @@ bool Server::SetupStartupListenerService(void) {
     return true;
 }
 
-int Server::ListVm(const char payload[]) {
-    boost::interprocess::managed_shared_memory shm(
-        boost::interprocess::open_only,
-        payload);
-
-    shm.destroy<bstring>("ListVms");
-    shm.zero_free_memory();
-
-    bstring *vm_lists = shm.construct<bstring>
-                ("ListVms")
-                [vmis_.size()]
-                (shm.get_segment_manager());
-
-    for (size_t i = 0; i < vmis_.size(); ++i) {
-        std::string s(vmis_[i]->GetName() + ":" + VmStateToStr(vmis_[i]->GetState()));
-        vm_lists[i].assign(s.c_str());
+int Server::ListVm(const std::vector<std::string> &args, std::vector<std::string> *out) {
+    auto snap = vms_.Get();
+    for (auto &it : snap->by_name) {
+        out->push_back(it.first + ":" + VmStateToStr(it.second.vm->GetState()));
     }
+    std::sort(out->begin(), out->end());
 
     return 0;
 }
 
-int Server::ImportVm(const char payload[]) {
-    boost::interprocess::managed_shared_memory shm(
-        boost::interprocess::open_read_only,
-        payload);
-
-    auto cfg_path = shm.find<bstring>("ImportVmCfgPath");
-
-    std::string p(cfg_path.first->c_str());
-
-    if (p.empty())
+int Server::ImportVm(const std::vector<std::string> &args, std::vector<std::string> *out) {
+    if (args.empty() || args[0].empty())
         return -1;
+    const std::string &p = args[0];
 
-    CivConfig cfg;
-    if (!cfg.ReadConfigFile(p)) {
+    CivVmConfig cfg;
+    if (!CivConfigCache::Cache().Read(p, &cfg)) {
         LOG(error) << "Failed to read config file";
         return -1;
     }
 
     std::vector<std::string> name_param;
-    boost::split(name_param, cfg.GetValue(kGroupGlob, kGlobName), boost::is_any_of(","));
+    boost::split(name_param, cfg.glob.name, boost::is_any_of(","));
     const std::string &vm_name = name_param[0];
     if (vm_name.empty())
         return -1;
 
-    auto id = FindVmInstance(vm_name);
-    if (id != -1UL) {
-        VmBuilder::VmState st = vmis_[id].get()->GetState();
+    auto op_lock = LockVmOp(vm_name);
+
+    VmHandle old = vms_.Find(vm_name);
+    if (old) {
+        VmBuilder::VmState st = old.vm->GetState();
         if ((st != VmBuilder::VmState::kVmCreated) && (st != VmBuilder::VmState::kVmEmpty)) {
             LOG(error) << "CiV: " << vm_name << " is running! Cannot overwrite!";
             return -1;
         }
         LOG(warning) << "Overwrite existed CiV: " << vm_name;
-        DeleteVmInstance(vm_name);
+        vms_.Remove(vm_name, old.gen);
+        std::scoped_lock lock(imported_mutex_);
+        imported_.erase(vm_name);
     }
 
-    std::vector<std::unique_ptr<VmBuilder>>::iterator vmi;
-    if (cfg.GetValue(kGroupEmul, kEmulType) == kEmulTypeQemu) {
+    bool wait_ready = cfg.glob.wait_ready;
+    std::unique_ptr<VmBuilder> vb;
+    if (cfg.emul.type == kEmulTypeQemu) {
         std::unique_ptr<VmBuilderQemu> vbq = std::make_unique<VmBuilderQemu>(vm_name, std::move(cfg));
+        vbq->SetStateListener([this](VmBuilder *b, VmBuilder::VmState st) { OnVmStateChange(b, st); });
         if (!vbq->BuildVmArgs())
             return -1;
-        vmi = vmis_.insert(vmis_.end(), std::move(vbq));
+        vb = std::move(vbq);
     } else {
         /* Default try to contruct for QEMU */
         std::unique_ptr<VmBuilderQemu> vbq = std::make_unique<VmBuilderQemu>(vm_name, std::move(cfg));
+        vbq->SetStateListener([this](VmBuilder *b, VmBuilder::VmState st) { OnVmStateChange(b, st); });
         if (!vbq->BuildVmArgs())
             return -1;
-        vmi = vmis_.insert(vmis_.end(), std::move(vbq));
+        vb = std::move(vbq);
     }
+
+    vms_.Add(std::move(vb));
+
+    std::scoped_lock lock(imported_mutex_);
+    imported_[vm_name] = ImportedVm{p, wait_ready};
     return 0;
 }
 
-void Server::VmThread(VmBuilder *vb, boost::latch *notify_cont) {
-    LOG(info) << "Starting VM:  " << vb->GetName();
+void Server::PostVmEvent(const std::string &name, CivVmEventType type, int exit_code, uint32_t queue_pos) {
+    CivVmEvent ev;
+    ev.type = type;
+    ev.exit_code = exit_code;
+    ev.queue_pos = queue_pos;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ev.timestamp_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+    snprintf(ev.name, sizeof(ev.name), "%s", name.c_str());
+
+    std::shared_lock ring_lock(ring_lock_);
+    if (!ring_)
+        return;
+    std::scoped_lock lock(events_mutex_);
+    ring_->events.Publish(ev);
+}
+
+void Server::OnVmStateChange(VmBuilder *vb, VmBuilder::VmState s) {
+    switch (s) {
+        case VmBuilder::kVmCreated:
+            PostVmEvent(vb->GetName(), kCivVmEventCreated);
+            break;
+        case VmBuilder::kVmBooting:
+            PostVmEvent(vb->GetName(), kCivVmEventBooting);
+            break;
+        case VmBuilder::kVmRunning:
+            PostVmEvent(vb->GetName(), kCivVmEventRunning);
+            break;
+        case VmBuilder::kVmPaused:
+            PostVmEvent(vb->GetName(), kCivVmEventPaused);
+            break;
+        default:
+            break;
+    }
+}
+
+bool Server::IsImportedVm(const std::string &name) {
+    std::scoped_lock lock(imported_mutex_);
+    return imported_.count(name) != 0;
+}
+
+bool Server::FindImportedVm(const std::string &name_or_path, std::string *name, bool *wait_ready) {
+    std::scoped_lock lock(imported_mutex_);
+    auto it = imported_.find(name_or_path);
+    if (it == imported_.end()) {
+        it = std::find_if(imported_.begin(), imported_.end(), [&name_or_path](const auto &i) {
+            return i.second.path == name_or_path;
+        });
+        if (it == imported_.end())
+            return false;
+    }
+    *name = it->first;
+    *wait_ready = it->second.wait_ready;
+    return true;
+}
+
+/* Per guest copies of template data, for guests of the warm pool */
+static std::string PoolDataDir(const std::string &name) {
+    return std::string(GetConfigPath()) + "/pool/" + name;
+}
+
+/* Imported VMs keep their definition for the next start, others are dropped */
+void Server::ReleaseVm(VmHandle h) {
+    auto op_lock = LockVmOp(h.vm->GetName());
+    ReleaseVmLocked(h);
+}
+
+/* The caller holds the op lock of the VM */
+void Server::ReleaseVmLocked(VmHandle h) {
+    if (pool_.Remove(h.vm->GetName())) {
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(PoolDataDir(h.vm->GetName()), ec);
+    }
+    if (IsImportedVm(h.vm->GetName()) && (vms_.Find(h.vm->GetName()).gen == h.gen)) {
+        h.vm->ResetVm();
+        /* Its cid was given back, index it again without one */
+        vms_.Add(h.vm);
+        return;
+    }
+    vms_.Remove(h.vm->GetName(), h.gen);
+}
+
+/* No thread waits for a running guest, the exit is delivered by the process supervisor */
+void Server::WatchVmExit(VmHandle h) {
+    h.vm->NotifyVmExit([this, h]() {
+        /* Releasing stops the co-processes, which is not done on the supervisor thread */
+        boost::thread t([this, h]() {
+            PostVmEvent(h.vm->GetName(), kCivVmEventExited, h.vm->GetExitCode());
+            ReleaseVm(h);
+        });
+        t.detach();
+    });
+}
+
+/* notify_cont counts 1 for the launch, and 1 more for the readiness with wait_ready */
+void Server::VmThread(VmHandle h, bool wait_ready, boost::latch *notify_cont) {
+    VmBuilder *vb = h.vm.get();
+    std::string name = vb->GetName();
+
+    admission_.Admit(name, [this, name](uint32_t pos) {
+        PostVmEvent(name, kCivVmEventQueued, 0, pos);
+    });
+
+    LOG(info) << "Starting VM:  " << name;
     /* Start VM */
-    vb->StartVm();
+    if (!vb->StartVm()) {
+        LOG(error) << "Failed to start VM: " << name;
+        admission_.Done(name);
+        PostVmEvent(name, kCivVmEventExited, -1);
+        /* The launcher holds the op lock until the latch is counted down */
+        ReleaseVmLocked(h);
+        if (wait_ready)
+            notify_cont->count_down();
+        notify_cont->count_down();
+        return;
+    }
 
-    if (notify_cont->try_count_down()) {
+    if (!wait_ready) {
+        /* Readiness is not tracked, the boot only counts until it is started */
+        admission_.Done(name);
         vb->SetVmReady();
-        vb->WaitVmExit();
-        DeleteVmInstance(vb->GetName());
+        WatchVmExit(h);
+        notify_cont->count_down();
         return;
     }
+    notify_cont->count_down();
 
-    startup_listener_.listener.AddPendingVM(vb->GetCid(), [vb](){
-        vb->SetVmReady();
+    std::weak_ptr<VmBuilder> wvb = h.vm;
+    startup_listener_.listener.AddPendingVM(vb->GetCid(), [wvb](){
+        if (auto vm = wvb.lock())
+            vm->SetVmReady();
     });
 
-    if (vb->WaitVmReady()) {
-        notify_cont->try_count_down();
-        vb->WaitVmExit();
-        DeleteVmInstance(vb->GetName());
+    bool ready = vb->WaitVmReady();
+    admission_.Done(name);
+
+    if (ready) {
+        WatchVmExit(h);
     } else {
-        DeleteVmInstance(vb->GetName());
-        notify_cont->try_count_down();
+        startup_listener_.listener.RemovePendingVM(vb->GetCid());
+        PostVmEvent(vb->GetName(), kCivVmEventExited, vb->GetExitCode());
+        ReleaseVmLocked(h);
     }
+    notify_cont->count_down();
 }
 
-int Server::StartVm(const char payload[]) {
-    boost::interprocess::managed_shared_memory shm(
-        boost::interprocess::open_read_only,
-        payload);
+int Server::LaunchVm(VmHandle h, bool wait_ready, std::vector<std::string> env) {
+    VmBuilder *vb = h.vm.get();
+    vb->SetProcessEnv(std::move(env));
 
-    auto cfg_path = shm.find<bstring>("StartVmCfgPath");
+    boost::latch notify_cont(1);
+    if (wait_ready) {
+        notify_cont.reset(2);
+    }
 
-    std::string p(cfg_path.first->c_str());
+    boost::thread t([this, h, wait_ready, &notify_cont]() {
+        VmThread(h, wait_ready, &notify_cont);
+    });
+    t.detach();
 
-    if (p.empty())
+    notify_cont.wait();
+
+    if (vb->GetState() == VmBuilder::VmState::kVmRunning) {
+        return 0;
+    }
+    return -1;
+}
+
+/* With restore set, the guest resumes from its snapshot instead of booting */
+int Server::StartVm(const std::vector<std::string> &args, std::vector<std::string> *out, bool restore) {
+    if (args.empty() || args[0].empty())
         return -1;
+    const std::string &p = args[0];
+    std::vector<std::string> env_data(args.begin() + 1, args.end());
+
+    std::string imported_name;
+    bool wait_ready = false;
+    if (FindImportedVm(p, &imported_name, &wait_ready)) {
+        auto op_lock = LockVmOp(imported_name);
+
+        VmHandle h = vms_.Find(imported_name);
+        if (h) {
+            if (h.vm->GetState() != VmBuilder::VmState::kVmCreated) {
+                LOG(error) << imported_name << " is already running!";
+                return -1;
+            }
+            if (!(restore ? h.vm->PrepareRestore() : h.vm->PrepareBoot()))
+                return -1;
+            /* Re-register, the cid may have changed with the newly acquired resources */
+            h = vms_.Add(h.vm);
+            LOG(info) << "Start imported VM: " << imported_name;
+            return LaunchVm(h, wait_ready, std::move(env_data));
+        }
+    }
 
-    CivConfig cfg;
-    if (!cfg.ReadConfigFile(p)) {
+    CivVmConfig cfg;
+    if (!CivConfigCache::Cache().Read(p, &cfg)) {
         LOG(error) << "Failed to read config file";
         return -1;
     }
 
     std::vector<std::string> name_param;
-    boost::split(name_param, cfg.GetValue(kGroupGlob, kGlobName), boost::is_any_of(","));
+    boost::split(name_param, cfg.glob.name, boost::is_any_of(","));
     const std::string &vm_name = name_param[0];
     if (vm_name.empty())
         return -1;
 
-    if (FindVmInstance(vm_name) != -1UL) {
+    auto op_lock = LockVmOp(vm_name);
+
+    if (vms_.Find(vm_name)) {
         LOG(error) << vm_name << " is already running!";
         return -1;
     }
 
-    std::vector<std::unique_ptr<VmBuilder>>::iterator vmi;
-    if (cfg.GetValue(kGroupEmul, kEmulType) == kEmulTypeQemu) {
+    std::unique_ptr<VmBuilder> vbp;
+    if (cfg.emul.type == kEmulTypeQemu) {
         std::unique_ptr<VmBuilderQemu> vbq = std::make_unique<VmBuilderQemu>(vm_name, cfg);
+        vbq->SetStateListener([this](VmBuilder *b, VmBuilder::VmState st) { OnVmStateChange(b, st); });
         if (!vbq->BuildVmArgs())
             return -1;
-        vmi = vmis_.insert(vmis_.end(), std::move(vbq));
+        vbp = std::move(vbq);
     } else {
         /* Default try to contruct for QEMU */
         std::unique_ptr<VmBuilderQemu> vbq = std::make_unique<VmBuilderQemu>(vm_name, cfg);
+        vbq->SetStateListener([this](VmBuilder *b, VmBuilder::VmState st) { OnVmStateChange(b, st); });
         if (!vbq->BuildVmArgs())
             return -1;
-        vmi = vmis_.insert(vmis_.end(), std::move(vbq));
+        vbp = std::move(vbq);
     }
 
-    std::pair<bstring *, int> vm_env = shm.find<bstring>("StartVmEnv");
-    std::vector<std::string> env_data;
+    /* Acquire host resources before registering so the cid is indexed */
+    if (!(restore ? vbp->PrepareRestore() : vbp->PrepareBoot()))
+        return -1;
+
+    VmHandle h = vms_.Add(std::move(vbp));
+    return LaunchVm(h, cfg.glob.wait_ready, std::move(env_data));
+}
 
-    for (int i = 0; i < vm_env.second; i++) {
-        env_data.push_back(std::string(vm_env.first[i].c_str()));
+/* Validate every guest of a batch before any of them is booted */
+bool Server::CheckBatch(const std::vector<std::string> &paths, std::vector<std::string> *names,
+                        std::vector<std::string> *errors) {
+    std::set<std::string> seen_names;
+    std::set<uint32_t> seen_cids;
+
+    for (auto &p : paths) {
+        std::string vm_name;
+        uint32_t cid = 0;
+        bool wait_ready;
+        if (FindImportedVm(p, &vm_name, &wait_ready)) {
+            VmHandle h = vms_.Find(vm_name);
+            if (h && (h.vm->GetState() != VmBuilder::VmState::kVmCreated))
+                errors->push_back(vm_name + ": already running");
+        } else {
+            CivVmConfig cfg;
+            if (!CivConfigCache::Cache().Read(p, &cfg)) {
+                errors->push_back(p + ": invalid config");
+                names->push_back(p);
+                continue;
+            }
+            std::vector<std::string> name_param;
+            boost::split(name_param, cfg.glob.name, boost::is_any_of(","));
+            vm_name = name_param[0];
+            if (vm_name.empty()) {
+                errors->push_back(p + ": no guest name");
+                names->push_back(p);
+                continue;
+            }
+            if (vms_.Find(vm_name))
+                errors->push_back(vm_name + ": already running");
+
+            cid = cfg.glob.vsock_cid;
+            if (cid != 0) {
+                VmHandle used = vms_.FindByCid(cid);
+                /* Imported guests that are not running hold no cid */
+                if (used && (used.vm->GetState() != VmBuilder::VmState::kVmCreated))
+                    errors->push_back(vm_name + ": vsock cid " + std::to_string(cid) + " is in use");
+                else if (!seen_cids.insert(cid).second)
+                    errors->push_back(vm_name + ": vsock cid " + std::to_string(cid) + " is used twice");
+            }
+        }
+
+        if (!seen_names.insert(vm_name).second)
+            errors->push_back(vm_name + ": listed twice");
+        names->push_back(vm_name);
     }
+    return errors->empty();
+}
 
-    VmBuilder *vb = vmi->get();
-    vb->SetProcessEnv(std::move(env_data));
+/*
+ * args: parallel, count, config paths, environment
+ * Boots up to parallel guests at a time, each one the same way as StartVm.
+ */
+int Server::StartVmBatch(const std::vector<std::string> &args, std::vector<std::string> *out) {
+    if (args.size() < 2)
+        return -1;
 
-    boost::latch notify_cont(1);
-    if (cfg.GetValue(kGroupGlob, kGlobWaitReady).compare("true") == 0) {
-        notify_cont.reset(2);
+    size_t parallel = std::stoul(args[0]);
+    size_t count = std::stoul(args[1]);
+    if ((count == 0) || (args.size() < count + 2))
+        return -1;
+
+    std::vector<std::string> paths(args.begin() + 2, args.begin() + 2 + count);
+    std::vector<std::string> env_data(args.begin() + 2 + count, args.end());
+
+    std::vector<std::string> names;
+    std::vector<std::string> errors;
+    if (!CheckBatch(paths, &names, &errors)) {
+        for (auto &e : errors)
+            LOG(error) << "Batch start: " << e;
+        *out = std::move(errors);
+        return -1;
     }
 
-    boost::thread t([this, vb, &notify_cont]() {
-        VmThread(vb, &notify_cont);
-    });
-    t.detach();
+    if (parallel == 0)
+        parallel = kCivBatchDefaultParallel;
+    parallel = std::min(parallel, count);
 
-    notify_cont.wait();
+    LOG(info) << "Batch start " << count << " guests, " << parallel << " at a time";
 
-    if (vb->GetState() == VmBuilder::VmState::kVmRunning) {
-        return 0;
+    std::vector<int> rets(count, -1);
+    std::vector<int64_t> cost_ms(count, 0);
+    std::atomic<size_t> next{0};
+
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next.fetch_add(1)) < count) {
+            std::vector<std::string> start_args{paths[i]};
+            start_args.insert(start_args.end(), env_data.begin(), env_data.end());
+            std::vector<std::string> start_out;
+
+            auto t0 = std::chrono::steady_clock::now();
+            try {
+                rets[i] = StartVm(start_args, &start_out);
+            } catch (std::exception &e) {
+                LOG(error) << "Batch start " << names[i] << ": " << e.what();
+            }
+            cost_ms[i] = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - t0).count();
+        }
+    };
+
+    std::vector<boost::thread> workers;
+    for (size_t i = 0; i < parallel; i++)
+        workers.emplace_back(worker);
+    for (auto &t : workers)
+        t.join();
+
+    int ret = 0;
+    for (size_t i = 0; i < count; i++) {
+        out->push_back(names[i] + ":" + ((rets[i] == 0) ? "Done" : "Failed") + ":" + std::to_string(cost_ms[i]));
+        if (rets[i] != 0)
+            ret = -1;
     }
-    return -1;
+    return ret;
 }
 
-int Server::GetVmInfo(const char payload[]) {
-    boost::interprocess::managed_shared_memory shm(
-        boost::interprocess::open_only,
-        payload);
+int Server::SaveVm(const std::vector<std::string> &args, std::vector<std::string> *out) {
+    if (args.empty() || args[0].empty())
+        return -1;
+    const std::string &name = args[0];
+
+    VmHandle h;
+    {
+        auto op_lock = LockVmOp(name);
+        h = vms_.Find(name);
+        if (!h) {
+            LOG(warning) << "CiV: " << name << " is not running!";
+            return -1;
+        }
+        LOG(info) << "SaveVm: " << name;
+        if (!h.vm->SaveVm())
+            return -1;
+    }
+    /* The guest quits once saved, report after it is released so it can be restored right away */
+    return WaitVmStopped(h, kCivStopTimeout) ? 0 : -1;
+}
+
+/*
+ * args: VM names
+ * Pause or resume each VM, out gets one "name:result:milliseconds" entry per VM.
+ */
+int Server::PauseVms(const std::vector<std::string> &args, std::vector<std::string> *out, bool pause) {
+    if (args.empty())
+        return -1;
+
+    int ret = 0;
+    for (auto &name : args) {
+        auto t0 = std::chrono::steady_clock::now();
+        bool ok = false;
+        {
+            auto op_lock = LockVmOp(name);
+            VmHandle h = vms_.Find(name);
+            if (!h)
+                LOG(warning) << "CiV: " << name << " is not running!";
+            else
+                ok = pause ? h.vm->PauseVm() : h.vm->ResumeVm();
+        }
+        int64_t cost_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - t0).count();
+
+        LOG(info) << (pause ? "PauseVm: " : "ResumeVm: ") << name << (ok ? " Done" : " Failed");
+        out->push_back(name + ":" + (ok ? "Done" : "Failed") + ":" + std::to_string(cost_ms));
+        if (!ok)
+            ret = -1;
+    }
+    return ret;
+}
+
+void Server::PoolThread(void) {
+    while (!stop_server_) {
+        std::string tmpl, name;
+        while (pool_.NextRefill(&tmpl, &name)) {
+            boost::thread t([this, tmpl, name]() { BootPoolVm(tmpl, name); });
+            t.detach();
+        }
+        pool_.WaitChange(kPoolCheckInterval);
+    }
+}
+
+/* Boot name from the config tmpl through the usual path, then park it paused in the pool */
+void Server::BootPoolVm(const std::string &tmpl, const std::string &name) {
+    auto fail = [this, &tmpl, &name]() {
+        pool_.Remove(name);
+        pool_.RefillFailed(tmpl);
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(PoolDataDir(name), ec);
+    };
+
+    CivVmConfig cfg;
+    if (!CivConfigCache::Cache().Read(std::string(GetConfigPath()) + "/" + tmpl + ".ini", &cfg)) {
+        LOG(error) << "Warm pool: cannot read config of " << tmpl;
+        fail();
+        return;
+    }
+    bool emulated_gpu = cfg.vgpu.type.empty() || (cfg.vgpu.type == kVgpuNone) || (cfg.vgpu.type == kVgpuVirtio) ||
+                        (cfg.vgpu.type == kVgpuVirtio2D) || (cfg.vgpu.type == kVgpuRamfb);
+    if (!emulated_gpu || !cfg.pt.pci.empty()) {
+        LOG(error) << "Warm pool: " << tmpl << " uses host devices, its guests cannot run side by side";
+        fail();
+        return;
+    }
+
+    /* Guests of one template run side by side, nothing they write may be shared */
+    cfg.glob.name = name;
+    cfg.glob.vsock_cid = 0;
+    cfg.net.adb_port = 0;
+    cfg.net.fastboot_port = 0;
+    cfg.disk.snapshot = true;
+    if (!cfg.vtpm.data_dir.empty()) {
+        std::string dir = PoolDataDir(name) + "/vtpm";
+        if (!VmSnapshot::CopyFiles(cfg.vtpm.data_dir, dir)) {
+            fail();
+            return;
+        }
+        cfg.vtpm.data_dir = dir;
+    }
+    if (!cfg.rpmb.data_dir.empty()) {
+        std::string dir = PoolDataDir(name) + "/rpmb";
+        if (!VmSnapshot::CopyFiles(cfg.rpmb.data_dir, dir)) {
+            fail();
+            return;
+        }
+        cfg.rpmb.data_dir = dir;
+    }
+
+    auto op_lock = LockVmOp(name);
 
-    std::pair<bstring *, int> vm_name;
-    vm_name = shm.find<bstring>("VmName");
-    size_t id = FindVmInstance(std::string(vm_name.first->c_str()));
-    if (id == -1UL)
+    std::unique_ptr<VmBuilderQemu> vbq = std::make_unique<VmBuilderQemu>(name, std::move(cfg));
+    vbq->SetStateListener([this](VmBuilder *b, VmBuilder::VmState st) { OnVmStateChange(b, st); });
+    if (!vbq->BuildVmArgs() || !vbq->PrepareBoot()) {
+        fail();
+        return;
+    }
+
+    LOG(info) << "Warm pool: boot " << name;
+    VmHandle h = vms_.Add(std::move(vbq));
+    /* There is no client environment, the guest gets the one the server was started with */
+    boost::process::environment env = boost::this_process::environment();
+    /* Pausing a guest that has not finished booting would park it half booted */
+    if (LaunchVm(h, true, env._data) != 0) {
+        fail();
+        return;
+    }
+
+    if (!h.vm->PauseVm()) {
+        LOG(error) << "Warm pool: cannot pause " << name;
+        h.vm->StopVm();
+        pool_.RefillFailed(tmpl);
+        return;
+    }
+    pool_.SetReady(name);
+    LOG(info) << "Warm pool: " << name << " is ready";
+}
+
+/* args: config name of the template, out gets the name and cid of the claimed guest */
+int Server::ClaimVm(const std::vector<std::string> &args, std::vector<std::string> *out) {
+    if (args.empty() || args[0].empty())
         return -1;
 
-    shm.destroy<bstring>("VmInfo");
-    shm.zero_free_memory();
+    std::string name;
+    while (pool_.Claim(args[0], &name)) {
+        auto op_lock = LockVmOp(name);
+        VmHandle h = vms_.Find(name);
+        if (h && h.vm->ResumeVm()) {
+            LOG(info) << "Warm pool: " << name << " is claimed";
+            out->push_back(name);
+            out->push_back(std::to_string(h.vm->GetCid()));
+            return 0;
+        }
+        LOG(warning) << "Warm pool: " << name << " cannot be resumed, drop it";
+        if (h)
+            h.vm->StopVm();
+    }
+
+    LOG(error) << "Warm pool: no guest of " << args[0] << " is ready";
+    return -1;
+}
 
-    CivVmInfo *vm_info = shm.construct<CivVmInfo>
-                ("VmInfo")
-                (0, VmBuilder::VmState::kVmUnknown);
+int Server::GetPoolStatus(const std::vector<std::string> &args, std::vector<std::string> *out) {
+    *out = pool_.Status();
+    return 0;
+}
 
-    vm_info->cid = vmis_[id]->GetCid();
-    vm_info->state = vmis_[id]->GetState();
+int Server::GetVmInfo(const std::vector<std::string> &args, std::vector<std::string> *out) {
+    if (args.empty())
+        return -1;
+
+    VmHandle h = vms_.Find(args[0]);
+    if (!h)
+        return -1;
+
+    out->push_back(std::to_string(h.vm->GetCid()));
+    out->push_back(std::to_string(h.vm->GetState()));
+    auto stats = h.vm->GetCoProcStats();
+    out->insert(out->end(), stats.begin(), stats.end());
     return 0;
 }
 
+CivMsgType Server::HandleMsg(CivMsgType type, const std::vector<std::string> &args, std::vector<std::string> *out) {
+    int ret = -1;
+    try {
+        switch (type) {
+            case kCivMsgListVm:
+                ret = ListVm(args, out);
+                break;
+            case kCivMsgImportVm:
+                ret = ImportVm(args, out);
+                break;
+            case kCivMsgStartVm:
+                ret = StartVm(args, out);
+                break;
+            case kCivMsgStopVm:
+                ret = StopVm(args, out);
+                break;
+            case kCivMsgGetVmInfo:
+                ret = GetVmInfo(args, out);
+                break;
+            case kCivMsgStartVmBatch:
+                ret = StartVmBatch(args, out);
+                break;
+            case kCivMsgStartVmAsync:
+                ret = StartVmAsync(args, out);
+                break;
+            case kCivMsgStopVmAsync:
+                ret = StopVmAsync(args, out);
+                break;
+            case kCivMsgWaitOps:
+                ret = WaitOps(args, out);
+                break;
+            case kCivMsgPauseVm:
+                ret = PauseVms(args, out, true);
+                break;
+            case kCivMsgResumeVm:
+                ret = PauseVms(args, out, false);
+                break;
+            case kCivMsgSaveVm:
+                ret = SaveVm(args, out);
+                break;
+            case kCivMsgRestoreVm:
+                ret = StartVm(args, out, true);
+                break;
+            case kCivMsgClaimVm:
+                ret = ClaimVm(args, out);
+                break;
+            case kCivMsgPoolStatus:
+                ret = GetPoolStatus(args, out);
+                break;
+            default:
+                LOG(error) << "vm-manager: received unknown message type: " << type;
+                break;
+        }
+    } catch (std::exception &e) {
+        LOG(error) << "CiV Server: Exception when handling message(" << type << "): " << e.what();
+        ret = -1;
+    }
+    return (ret == 0) ? kCivMsgRespondSuccess : kCivMsgRespondFail;
+}
+
+void Server::Respond(CivMsgSlot *slot, uint32_t gen, uint64_t req_id,
+                     CivMsgType type, const std::vector<std::string> &out) {
+    std::shared_lock ring_lock(ring_lock_);
+    if (!ring_)
+        return;
+
+    /* Client gave up waiting and the slot was released or reused */
+    uint32_t c = CivSlotCtl(gen, kCivSlotBusy);
+    if (!slot->ctl.compare_exchange_strong(c, CivSlotCtl(gen, kCivSlotReplying)))
+        return;
+
+    if (!slot->SetPayload(out)) {
+        LOG(error) << "Reply is too large for message slot!";
+        type = kCivMsgRespondFail;
+    }
+    slot->type = type;
+    slot->reply_id = req_id;
+    slot->ctl.store(CivSlotCtl(gen, kCivSlotDone), std::memory_order_release);
+    FutexWake(&slot->ctl, 1);
+}
+
 static void HandleSIG(int num) {
-    LOG(info) << "Signal(" << num << ") received!";
+    int saved_errno = errno;
     Server::Get().Stop();
+    errno = saved_errno;
 }
 
 void Server::Start(void) {
     try {
         signal(SIGINT, HandleSIG);
         signal(SIGTERM, HandleSIG);
+        /* Daemonize ignores SIGCHLD, children must stay zombies until the supervisor reaps them with their status */
+        signal(SIGCHLD, SIG_DFL);
 
         SetupStartupListenerService();
 
+        admission_.LoadSettings(std::string(GetConfigPath()) + "/" + kBootAdmissionConf);
+
+        /* Guests of an earlier server are gone, so is any use of their data */
+        boost::system::error_code ec;
+        boost::filesystem::remove_all(std::string(GetConfigPath()) + "/pool", ec);
+        pool_.LoadSettings(std::string(GetConfigPath()) + "/" + kWarmPoolConf);
+        boost::thread pool_thread([this]() { PoolThread(); });
+        pool_thread.detach();
+
         struct shm_remove {
             shm_remove() { boost::interprocess::shared_memory_object::remove(kCivServerMemName); }
             ~shm_remove() { boost::interprocess::shared_memory_object::remove(kCivServerMemName); }
@@ -308,76 +905,75 @@ void Server::Start(void) {
         boost::interprocess::managed_shared_memory shm(
             boost::interprocess::create_only,
             kCivServerMemName,
-            sizeof(CivMsgSync) + sizeof(CivMsg) + 1024,
+            sizeof(CivMsgRing) + 16_KB,
             0,
             unrestricted_permissions);
 
-        sync_ = shm.construct<CivMsgSync>
-                (kCivServerObjSync)
-                ();
+        {
+            std::unique_lock ring_lock(ring_lock_);
+            ring_ = shm.construct<CivMsgRing>
+                    (kCivServerObjRing)
+                    ();
+        }
 
-        while (!stop_server_) {
-            boost::interprocess::scoped_lock <boost::interprocess::interprocess_mutex> lock(sync_->mutex_cond);
-            if (!sync_->msg_in)
-                sync_->cond_s.wait(lock);
+        ring_->server_pid = getpid();
 
-            std::pair<CivMsg*, boost::interprocess::managed_shared_memory::size_type> data;
-            data = shm.find<CivMsg>(kCivServerObjData);
+        while (!stop_server_) {
+            uint32_t doorbell = ring_->doorbell.load(std::memory_order_acquire);
+
+            CivMsgSlot *slot = nullptr;
+            uint32_t gen = 0;
+            for (auto &s : ring_->slots) {
+                uint32_t c = s.ctl.load(std::memory_order_acquire);
+                if (CivSlotState(c) != kCivSlotRequest)
+                    continue;
+                if (s.ctl.compare_exchange_strong(c, CivSlotCtl(CivSlotGen(c), kCivSlotBusy))) {
+                    slot = &s;
+                    gen = CivSlotGen(c);
+                    break;
+                }
+            }
+            if (!slot) {
+                FutexWait(&ring_->doorbell, doorbell, std::chrono::milliseconds(-1));
+                continue;
+            }
 
-            if (!data.first)
+            CivMsgType type = slot->type;
+            uint64_t req_id = slot->req_id;
+            std::vector<std::string> args = slot->GetPayload();
+            /* Client abandoned the slot while the request was copied out */
+            if (slot->ctl.load(std::memory_order_acquire) != CivSlotCtl(gen, kCivSlotBusy))
                 continue;
 
-            switch (data.first->type) {
+            switch (type) {
                 case kCiVMsgStopServer:
                     stop_server_ = true;
-                    data.first->type = kCivMsgRespondSuccess;
-                    break;
-                case kCivMsgListVm:
-                    if (ListVm(data.first->payload) == 0) {
-                        data.first->type = kCivMsgRespondSuccess;
-                    } else {
-                        data.first->type = kCivMsgRespondFail;
-                    }
-                    break;
-                case kCivMsgImportVm:
-                    if (ImportVm(data.first->payload) == 0) {
-                        data.first->type = kCivMsgRespondSuccess;
-                    } else {
-                        data.first->type = kCivMsgRespondFail;
-                    }
-                    break;
-                case kCivMsgStartVm:
-                    if (StartVm(data.first->payload) == 0) {
-                        data.first->type = kCivMsgRespondSuccess;
-                    } else {
-                        data.first->type = kCivMsgRespondFail;
-                    }
-                    break;
-                case kCivMsgStopVm:
-                    if (StopVm(data.first->payload) == 0) {
-                        data.first->type = kCivMsgRespondSuccess;
-                    } else {
-                        data.first->type = kCivMsgRespondFail;
-                    }
-                    break;
-                case kCivMsgGetVmInfo:
-                    if (GetVmInfo(data.first->payload) == 0) {
-                        data.first->type = kCivMsgRespondSuccess;
-                    } else {
-                        data.first->type = kCivMsgRespondFail;
-                    }
+                    Respond(slot, gen, req_id, kCivMsgRespondSuccess, {});
                     break;
                 case kCivMsgTest:
+                    Respond(slot, gen, req_id, kCivMsgRespondSuccess, {});
                     break;
-                default:
-                    LOG(error) << "vm-manager: received unknown message type: " << data.first->type;
+                default: {
+                    boost::thread t([this, slot, gen, req_id, type, args]() {
+                        std::vector<std::string> out;
+                        CivMsgType ret = HandleMsg(type, args, &out);
+                        Respond(slot, gen, req_id, ret, out);
+                    });
+                    t.detach();
                     break;
+                }
             }
-            sync_->msg_in = false;
-            sync_->cond_c.notify_one();
         }
 
-        shm.destroy_ptr(sync_);
+        LOG(info) << "Stop CiV Server!";
+        if (startup_listener_.server)
+            startup_listener_.server->Shutdown();
+
+        {
+            std::unique_lock ring_lock(ring_lock_);
+            shm.destroy_ptr(ring_);
+            ring_ = nullptr;
+        }
 
         LOG(info) << "CiV Server exited!";
     } catch (std::exception &e) {
@@ -385,12 +981,14 @@ void Server::Start(void) {
     }
 }
 
+/* Called from the signal handler, only atomics and the futex syscall here, Start shuts the rest down */
 void Server::Stop(void) {
-    LOG(info) << "Stop CiV Server!";
     stop_server_ = true;
-    sync_->cond_s.notify_one();
-    if (startup_listener_.server)
-        startup_listener_.server->Shutdown();
+    CivMsgRing *ring = ring_;
+    if (ring) {
+        ring->doorbell.fetch_add(1, std::memory_order_release);
+        FutexWake(&ring->doorbell, 1);
+    }
 }
 
 Server &Server::Get(void) {
@@ -11,12 +11,22 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <map>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <functional>
+#include <chrono>
 
 #include <boost/thread/latch.hpp>
 
 #include "utils/log.h"
 #include "guest/vm_builder.h"
 #include "services/message.h"
+#include "services/vm_registry.h"
+#include "services/boot_admission.h"
+#include "services/op_table.h"
+#include "services/warm_pool.h"
 #include "services/startup_listener_impl.h"
 
 namespace vm_manager {
@@ -40,16 +50,60 @@ class Server final {
     Server(const Server&) = delete;
     Server& operator=(const Server&) = delete;
 
-    size_t FindVmInstance(std::string name);
-    void DeleteVmInstance(std::string name);
-
-    int ListVm(const char payload[]);
-    int ImportVm(const char payload[]);
-    int StartVm(const char payload[]);
-    int StopVm(const char payload[]);
-    int GetVmInfo(const char payload[]);
-
-    void VmThread(VmBuilder *vb, boost::latch *wait_continue);
+    /* Held while operating on one VM, its mutex is dropped once the VM is gone and nobody uses it */
+    class VmOpLock final {
+     public:
+        VmOpLock(Server *server, const std::string &name, std::shared_ptr<std::mutex> m) :
+              server_(server), name_(name), m_(std::move(m)), lock_(*m_) {}
+        ~VmOpLock();
+
+     private:
+        VmOpLock(const VmOpLock&) = delete;
+        VmOpLock& operator=(const VmOpLock&) = delete;
+
+        Server *server_;
+        std::string name_;
+        std::shared_ptr<std::mutex> m_;
+        std::unique_lock<std::mutex> lock_;
+    };
+
+    VmOpLock LockVmOp(const std::string &name);
+    void DropVmOpMutex(const std::string &name);
+
+    int ListVm(const std::vector<std::string> &args, std::vector<std::string> *out);
+    int ImportVm(const std::vector<std::string> &args, std::vector<std::string> *out);
+    int StartVm(const std::vector<std::string> &args, std::vector<std::string> *out, bool restore = false);
+    int StartVmBatch(const std::vector<std::string> &args, std::vector<std::string> *out);
+    bool CheckBatch(const std::vector<std::string> &paths, std::vector<std::string> *names,
+                    std::vector<std::string> *errors);
+    int LaunchVm(VmHandle h, bool wait_ready, std::vector<std::string> env);
+    bool FindImportedVm(const std::string &name_or_path, std::string *name, bool *wait_ready);
+    bool IsImportedVm(const std::string &name);
+    int StopVm(const std::vector<std::string> &args, std::vector<std::string> *out);
+    bool WaitVmStopped(VmHandle h, std::chrono::seconds timeout);
+    int RunAsync(const std::string &desc, std::function<int(void)> fn, std::vector<std::string> *out);
+    int StartVmAsync(const std::vector<std::string> &args, std::vector<std::string> *out);
+    int StopVmAsync(const std::vector<std::string> &args, std::vector<std::string> *out);
+    int WaitOps(const std::vector<std::string> &args, std::vector<std::string> *out);
+    int SaveVm(const std::vector<std::string> &args, std::vector<std::string> *out);
+    int PauseVms(const std::vector<std::string> &args, std::vector<std::string> *out, bool pause);
+    void PoolThread(void);
+    void BootPoolVm(const std::string &tmpl, const std::string &name);
+    int ClaimVm(const std::vector<std::string> &args, std::vector<std::string> *out);
+    int GetPoolStatus(const std::vector<std::string> &args, std::vector<std::string> *out);
+    int GetVmInfo(const std::vector<std::string> &args, std::vector<std::string> *out);
+
+    CivMsgType HandleMsg(CivMsgType type, const std::vector<std::string> &args, std::vector<std::string> *out);
+    void Respond(CivMsgSlot *slot, uint32_t gen, uint64_t req_id,
+                 CivMsgType type, const std::vector<std::string> &out);
+
+    void VmThread(VmHandle h, bool wait_ready, boost::latch *wait_continue);
+    void WatchVmExit(VmHandle h);
+    void ReleaseVm(VmHandle h);
+    void ReleaseVmLocked(VmHandle h);
+
+    void OnVmStateChange(VmBuilder *vb, VmBuilder::VmState s);
+    void PostVmEvent(const std::string &name, CivVmEventType type, int exit_code = 0, uint32_t queue_pos = 0);
 
     void Accept();
 
@@ -57,13 +111,36 @@ class Server final {
 
     bool SetupStartupListenerService();
 
-    bool stop_server_ = false;
+    std::atomic<bool> stop_server_ = false;
+
+    CivMsgRing *ring_ = nullptr;
+    /* Handlers may outlive the message loop, the ring is only touched under this lock */
+    std::shared_mutex ring_lock_;
+    /* The event ring has a single writer side, handler threads take turns on it */
+    std::mutex events_mutex_;
+
+    VmRegistry vms_;
+
+    /* Every boot waits here until the host has room for it */
+    BootAdmission admission_;
+
+    /* Starts and stops requested without waiting, collected by WaitOps */
+    OpTable ops_;
 
-    CivMsgSync *sync_ = nullptr;
+    /* Guests booted ahead and kept paused, handed out by ClaimVm */
+    WarmPool pool_;
 
-    std::vector<std::unique_ptr<VmBuilder>> vmis_;
+    struct ImportedVm {
+        std::string path;
+        bool wait_ready;
+    };
+    /* VMs defined by ImportVm, they stay registered across boots, indexed by name */
+    std::map<std::string, ImportedVm> imported_;
+    std::mutex imported_mutex_;
 
-    std::mutex vmis_mutex_;
+    /* Serialize operations on the same VM, operations on different VMs run in parallel */
+    std::map<std::string, std::shared_ptr<std::mutex>> vm_op_mutex_;
+    std::mutex vm_op_map_mutex_;
 
     StartupListenerInst startup_listener_;
 };
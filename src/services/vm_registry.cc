@@ -0,0 +1,80 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+#include <string>
+#include <memory>
+#include <utility>
+
+#include "services/vm_registry.h"
+
+namespace vm_manager {
+
+std::shared_ptr<const VmRegistry::Snapshot> VmRegistry::Get(void) const {
+    return std::atomic_load(&snap_);
+}
+
+VmHandle VmRegistry::Find(const std::string &name) const {
+    auto snap = Get();
+    auto it = snap->by_name.find(name);
+    if (it == snap->by_name.end())
+        return VmHandle();
+    return it->second;
+}
+
+VmHandle VmRegistry::FindByCid(uint32_t cid) const {
+    auto snap = Get();
+    auto it = snap->by_cid.find(cid);
+    if (it == snap->by_cid.end())
+        return VmHandle();
+    return it->second;
+}
+
+VmHandle VmRegistry::Add(std::shared_ptr<VmBuilder> vm) {
+    std::scoped_lock lock(write_mutex_);
+
+    auto snap = std::make_shared<Snapshot>(*std::atomic_load(&snap_));
+
+    std::string name = vm->GetName();
+    auto old = snap->by_name.find(name);
+    if (old != snap->by_name.end()) {
+        auto cid_it = snap->by_cid.find(old->second.cid);
+        if ((cid_it != snap->by_cid.end()) && (cid_it->second.gen == old->second.gen))
+            snap->by_cid.erase(cid_it);
+        snap->by_name.erase(old);
+    }
+
+    VmHandle h;
+    h.vm = std::move(vm);
+    h.gen = next_gen_++;
+    h.cid = h.vm->GetCid();
+    snap->by_name[name] = h;
+    if (h.cid != 0)
+        snap->by_cid[h.cid] = h;
+
+    std::atomic_store(&snap_, std::shared_ptr<const Snapshot>(std::move(snap)));
+    return h;
+}
+
+bool VmRegistry::Remove(const std::string &name, uint64_t gen) {
+    std::scoped_lock lock(write_mutex_);
+
+    auto cur = std::atomic_load(&snap_);
+    auto it = cur->by_name.find(name);
+    if ((it == cur->by_name.end()) || (it->second.gen != gen))
+        return false;
+
+    auto snap = std::make_shared<Snapshot>(*cur);
+    auto cid_it = snap->by_cid.find(it->second.cid);
+    if ((cid_it != snap->by_cid.end()) && (cid_it->second.gen == gen))
+        snap->by_cid.erase(cid_it);
+    snap->by_name.erase(name);
+
+    std::atomic_store(&snap_, std::shared_ptr<const Snapshot>(std::move(snap)));
+    return true;
+}
+
+}  // namespace vm_manager
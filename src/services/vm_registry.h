@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+#ifndef SRC_SERVICES_VM_REGISTRY_H_
+#define SRC_SERVICES_VM_REGISTRY_H_
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include "guest/vm_builder.h"
+
+namespace vm_manager {
+
+/*
+ * Reference to one registered VM instance. The generation tells apart
+ * instances that were registered under the same name at different times.
+ */
+struct VmHandle {
+    std::shared_ptr<VmBuilder> vm;
+    uint64_t gen = 0;
+    /* The cid it is indexed by, the builder's own cid changes when it is stopped or booted again */
+    uint32_t cid = 0;
+
+    explicit operator bool() const { return vm != nullptr; }
+};
+
+/*
+ * Registry of VM instances indexed by name and by vsock cid.
+ *
+ * Writers copy the index, modify the copy and publish it, readers take the
+ * current snapshot without any lock. A handle keeps its builder alive even
+ * after the entry has been removed from the registry.
+ */
+class VmRegistry final {
+ public:
+    struct Snapshot {
+        std::unordered_map<std::string, VmHandle> by_name;
+        std::unordered_map<uint32_t, VmHandle> by_cid;
+    };
+
+    VmRegistry() : snap_(std::make_shared<const Snapshot>()) {}
+    VmRegistry(const VmRegistry&) = delete;
+    VmRegistry& operator=(const VmRegistry&) = delete;
+
+    std::shared_ptr<const Snapshot> Get(void) const;
+    VmHandle Find(const std::string &name) const;
+    VmHandle FindByCid(uint32_t cid) const;
+
+    /* Registers vm under its name, replacing any existing entry, returns the new handle */
+    VmHandle Add(std::shared_ptr<VmBuilder> vm);
+    /* Removes name only if it still refers to the instance of generation gen */
+    bool Remove(const std::string &name, uint64_t gen);
+
+ private:
+    std::shared_ptr<const Snapshot> snap_;
+    std::mutex write_mutex_;
+    uint64_t next_gen_ = 1;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_SERVICES_VM_REGISTRY_H_
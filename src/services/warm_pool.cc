@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+#include <algorithm>
+#include <string>
+#include <utility>
+
+#include <boost/filesystem.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <boost/property_tree/ini_parser.hpp>
+
+#include "services/warm_pool.h"
+#include "utils/log.h"
+
+namespace vm_manager {
+
+/* Refills of a template are held back this long after one of its boots failed */
+constexpr const std::chrono::seconds kPoolRetryDelay(30);
+
+void WarmPool::LoadSettings(const std::string &path) {
+    boost::system::error_code ec;
+    if (!boost::filesystem::exists(path, ec)) {
+        LOG(info) << "Warm pool: " << path << " not found, no guest is pre-booted";
+        return;
+    }
+
+    try {
+        boost::property_tree::ptree pt;
+        boost::property_tree::ini_parser::read_ini(path, pt);
+
+        std::scoped_lock lock(mutex_);
+        for (auto &kv : pt.get_child("pool", boost::property_tree::ptree())) {
+            unsigned int size = kv.second.get_value<unsigned int>(0);
+            templates_[kv.first].size = size;
+            LOG(info) << "Warm pool: keep " << size << " guests of " << kv.first;
+        }
+    } catch (std::exception &e) {
+        LOG(error) << "Warm pool: failed to load " << path << ": " << e.what();
+    }
+    cv_.notify_all();
+}
+
+bool WarmPool::NextRefill(std::string *tmpl, std::string *name) {
+    std::scoped_lock lock(mutex_);
+    auto now = std::chrono::steady_clock::now();
+    for (auto &t : templates_) {
+        Template &p = t.second;
+        if ((p.booting != 0) || (p.ready.size() >= p.size) || (now < p.retry_at))
+            continue;
+
+        *tmpl = t.first;
+        *name = t.first + "-pool-" + std::to_string(next_seq_++);
+        guests_[*name] = Guest{t.first, kPoolBooting};
+        p.booting++;
+        return true;
+    }
+    return false;
+}
+
+void WarmPool::SetReady(const std::string &name) {
+    std::scoped_lock lock(mutex_);
+    auto it = guests_.find(name);
+    if ((it == guests_.end()) || (it->second.state != kPoolBooting))
+        return;
+    it->second.state = kPoolReady;
+    Template &p = templates_[it->second.tmpl];
+    p.booting--;
+    p.ready.push_back(name);
+    cv_.notify_all();
+}
+
+void WarmPool::RefillFailed(const std::string &tmpl) {
+    std::scoped_lock lock(mutex_);
+    templates_[tmpl].retry_at = std::chrono::steady_clock::now() + kPoolRetryDelay;
+}
+
+bool WarmPool::Claim(const std::string &tmpl, std::string *name) {
+    std::scoped_lock lock(mutex_);
+    auto t = templates_.find(tmpl);
+    if ((t == templates_.end()) || t->second.ready.empty())
+        return false;
+
+    *name = t->second.ready.front();
+    t->second.ready.pop_front();
+    guests_[*name].state = kPoolClaimed;
+    cv_.notify_all();
+    return true;
+}
+
+bool WarmPool::Remove(const std::string &name) {
+    std::scoped_lock lock(mutex_);
+    auto it = guests_.find(name);
+    if (it == guests_.end())
+        return false;
+
+    Template &p = templates_[it->second.tmpl];
+    if (it->second.state == kPoolBooting) {
+        p.booting--;
+    } else if (it->second.state == kPoolReady) {
+        p.ready.erase(std::remove(p.ready.begin(), p.ready.end(), name), p.ready.end());
+    }
+    guests_.erase(it);
+    cv_.notify_all();
+    return true;
+}
+
+void WarmPool::WaitChange(std::chrono::milliseconds timeout) {
+    std::unique_lock lock(mutex_);
+    cv_.wait_for(lock, timeout);
+}
+
+std::vector<std::string> WarmPool::Status(void) {
+    std::scoped_lock lock(mutex_);
+    std::vector<std::string> out;
+    for (auto &t : templates_) {
+        out.push_back(t.first + ":" + std::to_string(t.second.ready.size()) + ":" +
+                      std::to_string(t.second.booting) + ":" + std::to_string(t.second.size));
+    }
+    return out;
+}
+
+}  // namespace vm_manager
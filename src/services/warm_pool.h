@@ -0,0 +1,83 @@
+/*
+ * Copyright (c) 2022 Intel Corporation.
+ * All rights reserved.
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ *
+ */
+#ifndef SRC_SERVICES_WARM_POOL_H_
+#define SRC_SERVICES_WARM_POOL_H_
+
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <string>
+#include <vector>
+
+namespace vm_manager {
+
+/*
+ * Read from the config path by the server. Each key of the [pool] group is
+ * a guest config name, its value the number of paused guests kept for it.
+ */
+inline constexpr const char *kWarmPoolConf = "warm_pool.conf";
+
+/*
+ * Bookkeeping of guests booted ahead of time and kept paused until claimed.
+ * Guests are refilled one at a time per template, the server does the boots.
+ */
+class WarmPool final {
+ public:
+    WarmPool() = default;
+    WarmPool(const WarmPool&) = delete;
+    WarmPool& operator=(const WarmPool&) = delete;
+
+    void LoadSettings(const std::string &path);
+
+    /* Picks a template short of guests and names a new guest for it, false if none is short */
+    bool NextRefill(std::string *tmpl, std::string *name);
+    /* The guest is booted and paused, it can be claimed */
+    void SetReady(const std::string &name);
+    /* The boot of a guest for tmpl failed, its refills are held back for a while */
+    void RefillFailed(const std::string &tmpl);
+    /* Take a ready guest of tmpl out of the pool, the oldest one first */
+    bool Claim(const std::string &tmpl, std::string *name);
+    /* The guest has exited, returns true if it was booted for the pool */
+    bool Remove(const std::string &name);
+
+    /* Sleep until the pool may need a refill, or timeout */
+    void WaitChange(std::chrono::milliseconds timeout);
+
+    /* One "template:ready:booting:size" entry per template */
+    std::vector<std::string> Status(void);
+
+ private:
+    enum GuestState {
+        kPoolBooting = 0,
+        kPoolReady,
+        kPoolClaimed,
+    };
+    struct Guest {
+        std::string tmpl;
+        GuestState state;
+    };
+    struct Template {
+        unsigned int size = 0;
+        std::deque<std::string> ready;
+        unsigned int booting = 0;
+        std::chrono::steady_clock::time_point retry_at;
+    };
+
+    std::map<std::string, Template> templates_;
+    std::map<std::string, Guest> guests_;
+    uint64_t next_seq_ = 1;
+    std::mutex mutex_;
+    std::condition_variable cv_;
+};
+
+}  // namespace vm_manager
+
+#endif  // SRC_SERVICES_WARM_POOL_H_
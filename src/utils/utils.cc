@@ -14,7 +14,11 @@
 #include <signal.h>
 #include <fcntl.h>
 
+#include <algorithm>
+#include <atomic>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <boost/filesystem.hpp>
 
@@ -131,3 +135,25 @@ int Daemonize(void) {
     return 0;
 }
 
+bool RunParallel(std::size_t count, unsigned int max_workers, const std::function<bool(std::size_t)> &fn) {
+    std::atomic<std::size_t> next(0);
+    std::atomic<bool> ok(true);
+    std::size_t n = std::min<std::size_t>({ count, max_workers, std::max(1U, std::thread::hardware_concurrency()) });
+
+    std::vector<std::thread> workers;
+    for (std::size_t i = 0; i < n; i++) {
+        workers.emplace_back([&]() {
+            for (std::size_t j = next++; ok && (j < count); j = next++) {
+                if (!fn(j))
+                    ok = false;
+            }
+        });
+    }
+    for (auto &t : workers)
+        t.join();
+    return ok;
+}
+
+bool IsZero(const char *buf, std::size_t len) {
+    return (len == 0) || ((buf[0] == 0) && (memcmp(buf, buf + 1, len - 1) == 0));
+}
@@ -12,11 +12,40 @@
 #define MAX_PATH 2048U
 #endif
 
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+
 #define CIV_GUEST_QMP_SUFFIX     ".qmp.unix.socket"
 
 const char *GetConfigPath(void);
 int Daemonize(void);
 
+/* Run fn(0) ... fn(count - 1) on up to max_workers threads, no new call is made once one failed */
+bool RunParallel(std::size_t count, unsigned int max_workers, const std::function<bool(std::size_t)> &fn);
+
+/* Zip entries inflated at once, more threads only contend for the disk */
+constexpr unsigned int kMaxExtractors = 8;
+
+/* True if all len bytes at buf are 0, true for len 0 */
+bool IsZero(const char *buf, std::size_t len);
+
+/* Little endian stores for on-disk structures */
+inline void Put16(uint8_t *p, uint16_t v) {
+    p[0] = v & 0xff;
+    p[1] = v >> 8;
+}
+
+inline void Put32(uint8_t *p, uint32_t v) {
+    Put16(p, v & 0xffff);
+    Put16(p + 2, v >> 16);
+}
+
+inline void Put64(uint8_t *p, uint64_t v) {
+    Put32(p, v & 0xffffffff);
+    Put32(p + 4, v >> 32);
+}
+
 constexpr std::size_t operator""_KB(unsigned long long v) {
     return 1024u * v;
 }
@@ -7,8 +7,12 @@
  */
 #include <sys/syslog.h>
 #include <iostream>
+#include <iomanip>
 #include <map>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <atomic>
 
 #include <boost/program_options.hpp>
 #include <boost/interprocess/shared_memory_object.hpp>
@@ -20,6 +24,8 @@
 #include "utils/utils.h"
 #include "guest/vm_builder.h"
 #include "guest/vm_flash.h"
+#include "guest/vm_clone.h"
+#include "guest/disk_image.h"
 #include "guest/tui.h"
 #include "services/server.h"
 #include "services/client.h"
@@ -30,8 +36,7 @@ namespace vm_manager {
 bool IsServerRunning() {
     try {
         Client c;
-        c.Notify(kCivMsgTest);
-        return true;
+        return c.Notify(kCivMsgTest, std::chrono::seconds(1));
     } catch (std::exception& e) {
         // LOG(warning) << "Server is not running: " << e.what();
         return false;
@@ -86,27 +91,105 @@ static int GetGuestState(std::string name) {
     return VmBuilder::kVmUnknown;
 }
 
-static bool StartGuest(std::string path) {
+static bool FindConfigPath(const std::string &path, boost::filesystem::path *p) {
+    boost::system::error_code ec;
+    *p = boost::filesystem::path(path);
+
+    if (!boost::filesystem::exists(*p, ec) || !boost::filesystem::is_regular_file(*p, ec)) {
+        p->clear();
+        p->assign(GetConfigPath() + std::string("/") + path + ".ini");
+        if (!boost::filesystem::exists(*p, ec))
+            return false;
+    }
+    /* Server matches imported guests by path, keep it stable */
+    *p = boost::filesystem::absolute(*p, ec);
+    return true;
+}
+
+static bool ResolveConfigPath(const std::string &path, boost::filesystem::path *p) {
+    if (!FindConfigPath(path, p)) {
+        LOG(error) << "CiV config not exists: " << path;
+        return false;
+    }
+    return true;
+}
+
+/* A name without a config here is passed on as is, it may be a guest imported from another path */
+static std::string StartTarget(const std::string &path) {
+    boost::filesystem::path p;
+    if (!FindConfigPath(path, &p))
+        return path;
+    return p.string();
+}
+
+static bool ImportGuest(std::string path) {
     if (!IsServerRunning()) {
         LOG(info) << "server is not running! Please start server!";
         return false;
     }
 
-    boost::system::error_code ec;
-    boost::filesystem::path p(path);
+    boost::filesystem::path p;
+    if (!ResolveConfigPath(path, &p))
+        return false;
 
-    if (!boost::filesystem::exists(p, ec) || !boost::filesystem::is_regular_file(p, ec)) {
-        p.clear();
-        p.assign(GetConfigPath() + std::string("/") + path + ".ini");
-        if (!boost::filesystem::exists(p, ec)) {
-            LOG(error) << "CiV config not exists: " << path;
-            return false;
+    Client c;
+    c.PrepareImportGuest(p.c_str());
+    if (!c.Notify(kCivMsgImportVm)) {
+        LOG(error) << "Import guest: " << path << " Failed!";
+        return false;
+    }
+    LOG(info) << "Import guest: " << path << " Done.";
+    return true;
+}
+
+/* Print the boot queue position of name, from cursor on, until done is set */
+static void ReportBootQueue(std::string name, uint32_t cursor, const std::atomic<bool> *done) {
+    try {
+        Client c;
+        std::vector<CivVmEvent> events;
+        while (!*done) {
+            events.clear();
+            if (!c.WaitVmEvents(&cursor, &events, std::chrono::milliseconds(200)))
+                return;
+            for (auto &ev : events) {
+                if ((ev.type == kCivVmEventQueued) && (name == ev.name))
+                    LOG(info) << "Waiting for host resources: " << name << " is " << ev.queue_pos << " in boot queue";
+            }
         }
+    } catch (std::exception &e) {
+        return;
     }
+}
 
+/* With restore set, the guest resumes from the state saved by SaveGuest */
+static bool StartGuest(std::string path, bool restore) {
+    if (!IsServerRunning()) {
+        LOG(info) << "server is not running! Please start server!";
+        return false;
+    }
+
+    std::string target = path;
+    std::string name = path;
+    boost::filesystem::path p;
+    if (FindConfigPath(path, &p)) {
+        target = p.string();
+        CivVmConfig cfg;
+        if (CivConfigCache::Cache().Read(target, &cfg))
+            name = cfg.glob.name.substr(0, cfg.glob.name.find(','));
+    }
+
+    /* Otherwise path may be the name of a guest imported from elsewhere */
     Client c;
-    c.PrepareStartGuestClientShm(p.c_str());
-    if (!c.Notify(kCivMsgStartVm)) {
+    c.PrepareStartGuest(target.c_str());
+    std::atomic<bool> done = false;
+    boost::thread reporter(ReportBootQueue, name, c.GetVmEventHead(), &done);
+
+    /* Covers waiting for boot admission and guest ready, see VmBuilderQemu::WaitVmReady */
+    bool ret = c.Notify(restore ? kCivMsgRestoreVm : kCivMsgStartVm, kCivMsgStartTimeout);
+    done = true;
+    reporter.join();
+
+    if (!ret) {
         LOG(error) << "Start guest: " << path << " Failed!";
         return false;
     }
@@ -114,6 +197,78 @@ static bool StartGuest(std::string path) {
     return true;
 }
 
+/* A directory, given as is or relative to the config path, stands for all configs in it */
+static bool ResolveConfigPaths(const std::string &item, std::vector<std::string> *paths) {
+    boost::system::error_code ec;
+    boost::filesystem::path dir(item);
+    if (!boost::filesystem::is_directory(dir, ec))
+        dir = boost::filesystem::path(GetConfigPath() + std::string("/") + item);
+
+    if (boost::filesystem::is_directory(dir, ec)) {
+        std::vector<std::string> found;
+        for (auto &e : boost::filesystem::directory_iterator(dir, ec)) {
+            if (boost::filesystem::is_regular_file(e.path(), ec) && (e.path().extension() == ".ini"))
+                found.push_back(boost::filesystem::absolute(e.path(), ec).string());
+        }
+        if (found.empty()) {
+            LOG(error) << "No CiV config in: " << dir.string();
+            return false;
+        }
+        std::sort(found.begin(), found.end());
+        paths->insert(paths->end(), found.begin(), found.end());
+        return true;
+    }
+
+    boost::filesystem::path p;
+    if (!ResolveConfigPath(item, &p))
+        return false;
+    paths->push_back(p.string());
+    return true;
+}
+
+/* One line per "name:result:milliseconds" entry */
+static void PrintBatchResults(const std::vector<std::string> &results) {
+    for (auto &r : results) {
+        std::vector<std::string> sp;
+        boost::split(sp, r, boost::is_any_of(":"));
+        if (sp.size() == 3)
+            std::cout << std::left << std::setw(24) << sp[0] << std::setw(8) << sp[1]
+                      << std::right << sp[2] << " ms" << std::endl;
+        else
+            std::cout << r << std::endl;
+    }
+}
+
+static bool StartGuests(const std::vector<std::string> &items, unsigned int parallel) {
+    if (!IsServerRunning()) {
+        LOG(info) << "server is not running! Please start server!";
+        return false;
+    }
+
+    std::vector<std::string> paths;
+    for (auto &i : items) {
+        if (!ResolveConfigPaths(i, &paths))
+            return false;
+    }
+
+    if (parallel == 0)
+        parallel = kCivBatchDefaultParallel;
+    size_t rounds = (paths.size() + parallel - 1) / parallel;
+
+    Client c;
+    c.PrepareStartGuests(paths, parallel);
+    bool ret = c.Notify(kCivMsgStartVmBatch, kCivMsgStartTimeout * rounds);
+
+    PrintBatchResults(c.GetBatchResults());
+
+    if (!ret) {
+        LOG(error) << "Start guests: Failed!";
+        return false;
+    }
+    LOG(info) << "Start guests: " << paths.size() << " Done.";
+    return true;
+}
+
 static bool StopGuest(std::string name) {
     if (!IsServerRunning()) {
         LOG(info) << "server is not running! Please start server!";
@@ -121,7 +276,7 @@ static bool StopGuest(std::string name) {
     }
 
     Client c;
-    c.PrepareStopGuestClientShm(name.c_str());
+    c.PrepareStopGuest(name.c_str());
     if (!c.Notify(kCivMsgStopVm)) {
         LOG(error) << "Stop guest: " << name << " Failed!";
         return false;
@@ -130,6 +285,93 @@ static bool StopGuest(std::string name) {
     return true;
 }
 
+static bool SaveGuest(std::string name) {
+    if (!IsServerRunning()) {
+        LOG(info) << "server is not running! Please start server!";
+        return false;
+    }
+
+    Client c;
+    c.PrepareStopGuest(name.c_str());
+    if (!c.Notify(kCivMsgSaveVm, kCivMsgSaveTimeout)) {
+        LOG(error) << "Save guest: " << name << " Failed!";
+        return false;
+    }
+    LOG(info) << "Save guest: " << name << " Done.";
+    return true;
+}
+
+static bool PauseGuests(const std::vector<std::string> &names, bool pause) {
+    if (!IsServerRunning()) {
+        LOG(info) << "server is not running! Please start server!";
+        return false;
+    }
+
+    const char *op = pause ? "Pause" : "Resume";
+    Client c;
+    c.PrepareGuests(names);
+    bool ret = c.Notify(pause ? kCivMsgPauseVm : kCivMsgResumeVm);
+
+    PrintBatchResults(c.GetBatchResults());
+
+    if (!ret) {
+        LOG(error) << op << " guests: Failed!";
+        return false;
+    }
+    LOG(info) << op << " guests: " << names.size() << " Done.";
+    return true;
+}
+
+/* Send an async start or stop, the operation id is printed for --wait */
+static bool RequestAsync(CivMsgType t, const std::string &arg) {
+    if (!IsServerRunning()) {
+        LOG(info) << "server is not running! Please start server!";
+        return false;
+    }
+
+    Client c;
+    if (t == kCivMsgStartVmAsync) {
+        c.PrepareStartGuest(StartTarget(arg).c_str());
+    } else {
+        c.PrepareStopGuest(arg.c_str());
+    }
+
+    if (!c.Notify(t) || (c.GetOpId() == 0)) {
+        LOG(error) << "Request for " << arg << " Failed!";
+        return false;
+    }
+    std::cout << c.GetOpId() << std::endl;
+    return true;
+}
+
+static bool WaitOperations(const std::vector<uint64_t> &ids, bool all, unsigned int timeout_s) {
+    if (!IsServerRunning()) {
+        LOG(info) << "server is not running! Please start server!";
+        return false;
+    }
+
+    std::chrono::milliseconds timeout = std::chrono::seconds(timeout_s);
+    Client c;
+    c.PrepareWaitOps(ids, all, timeout);
+    /* Leave the server some time to reply after its own deadline */
+    bool ret = c.Notify(kCivMsgWaitOps, timeout + std::chrono::seconds(5));
+
+    for (auto &r : c.GetOpResults())
+        std::cout << r << std::endl;
+
+    if (!ret) {
+        LOG(error) << "Wait for operations: not finished in " << timeout_s << "s";
+        return false;
+    }
+    for (auto &r : c.GetOpResults()) {
+        std::vector<std::string> sp;
+        boost::split(sp, r, boost::is_any_of(":"));
+        if (all && ((sp.size() < 2) || (sp[1] != OpStateToStr(kCivOpSucceeded))))
+            return false;
+    }
+    return true;
+}
+
 
 static bool GetGuestCid(std::string name) {
     if (!IsServerRunning()) {
@@ -147,6 +389,68 @@ static bool GetGuestCid(std::string name) {
     return true;
 }
 
+static bool GetGuestInfo(std::string name) {
+    if (!IsServerRunning()) {
+        LOG(info) << "server is not running! Please start server first!";
+        return false;
+    }
+
+    Client c;
+    CivVmInfo vi = c.GetCivVmInfo(name.c_str());
+    if (vi.state == VmBuilder::VmState::kVmUnknown) {
+        LOG(error) << "Failed to get guest info: " << name;
+        return false;
+    }
+    std::cout << "cid:   " << vi.cid << std::endl;
+    std::cout << "state: " << VmStateToStr(vi.state) << std::endl;
+    for (auto &p : vi.co_procs) {
+        std::vector<std::string> sp;
+        boost::split(sp, p, boost::is_any_of(":"));
+        if (sp.size() != 4)
+            continue;
+        std::cout << "  " << std::left << std::setw(24) << sp[0] << std::setw(12) << sp[1]
+                  << "restarts=" << std::setw(6) << sp[2] << sp[3] << std::right << std::endl;
+    }
+    return true;
+}
+
+static bool ClaimGuest(std::string tmpl) {
+    if (!IsServerRunning()) {
+        LOG(info) << "server is not running! Please start server first!";
+        return false;
+    }
+
+    Client c;
+    std::string name;
+    unsigned int cid = 0;
+    if (!c.ClaimGuest(tmpl.c_str(), &name, &cid)) {
+        LOG(error) << "Claim guest of " << tmpl << " Failed!";
+        return false;
+    }
+    std::cout << name << " " << cid << std::endl;
+    return true;
+}
+
+static bool ShowPool(void) {
+    if (!IsServerRunning()) {
+        LOG(info) << "server is not running! Please start server first!";
+        return false;
+    }
+
+    Client c;
+    std::cout << std::left << std::setw(24) << "template" << std::setw(8) << "ready"
+              << std::setw(8) << "booting" << "size" << std::endl;
+    for (auto &p : c.GetPoolStatus()) {
+        std::vector<std::string> sp;
+        boost::split(sp, p, boost::is_any_of(":"));
+        if (sp.size() != 4)
+            continue;
+        std::cout << std::setw(24) << sp[0] << std::setw(8) << sp[1] << std::setw(8) << sp[2] << sp[3] << std::endl;
+    }
+    std::cout << std::right;
+    return true;
+}
+
 static bool StartServer(bool daemon) {
     if (IsServerRunning()) {
         LOG(info) << "Server already running!";
@@ -180,6 +484,28 @@ static bool StartServer(bool daemon) {
     return true;
 }
 
+static bool MonitorGuests(void) {
+    if (!IsServerRunning()) {
+        LOG(info) << "server is not running! Please start server first!";
+        return false;
+    }
+
+    Client c;
+    c.SubscribeVmEvents([](const CivVmEvent &ev) {
+        std::cout << ev.timestamp_ns / 1000000000ULL << "." << std::setw(9) << std::setfill('0')
+                  << ev.timestamp_ns % 1000000000ULL << std::setfill(' ') << " "
+                  << ev.name << ":" << VmEventToStr(ev.type);
+        if (ev.type == kCivVmEventExited)
+            std::cout << " exit_code=" << ev.exit_code;
+        if (ev.type == kCivVmEventQueued)
+            std::cout << " position=" << ev.queue_pos;
+        std::cout << std::endl;
+        return true;
+    });
+    LOG(info) << "Server exited, stop monitoring.";
+    return true;
+}
+
 static bool StopServer(void) {
     if (!IsServerRunning()) {
         LOG(info) << "server is not running! Please start server first!";
@@ -203,12 +529,32 @@ class CivOptions final {
             ("help,h",    "Show this help message")
             ("create,c",  po::value<std::string>(), "Create a CiV guest")
             // ("delete,d",  po::value<std::string>(), "Delete a CiV guest")
+            ("import,i",  po::value<std::string>(), "Import a CiV guest, later starts reuse its definition")
             ("start,b",   po::value<std::string>(), "Start a CiV guest")
+            ("start-batch", po::value<std::vector<std::string>>()->multitoken(),
+                          "Start CiV guests, each one a guest name, config file, or directory of configs")
+            ("jobs,j",    po::value<unsigned int>(), "Number of guests booted at the same time by --start-batch")
             ("stop,q",    po::value<std::string>(), "Stop a CiV guest")
+            ("pause",     po::value<std::vector<std::string>>()->multitoken(), "Pause CiV guests, their vCPUs stop running")
+            ("resume",    po::value<std::vector<std::string>>()->multitoken(), "Resume paused CiV guests")
+            ("save",      po::value<std::string>(), "Save the state of a CiV guest to disk and stop it")
+            ("restore",   "Start the guest given by --start from its saved state")
+            ("async",     "Return an operation id right away for --start/--stop instead of waiting")
+            ("wait",      po::value<std::vector<uint64_t>>()->multitoken(), "Wait for operations returned by --async")
+            ("any",       "Return from --wait once any operation has finished")
+            ("timeout",   po::value<unsigned int>(), "Seconds to wait for operations, 300 by default")
             ("flash,f",   po::value<std::string>(), "Flash a CiV guest")
+            ("clone",     po::value<std::string>(), "Create copy-on-write instances of a flashed CiV guest")
+            ("count,n",   po::value<unsigned int>(), "Number of instances made by --clone, 1 by default")
+            ("bench-disk", po::value<std::string>(), "Compare disk image formats and preallocation in a directory")
+            ("bench-size", po::value<unsigned int>(), "Image size in MB for --bench-disk, 1024 by default")
             // ("update,u",  po::value<std::string>(), "Update an existing CiV guest")
             ("get-cid", po::value<std::string>(), "Get cid of a guest")
+            ("info",    po::value<std::string>(), "Show state and co-processes of a guest")
+            ("claim",     po::value<std::string>(), "Resume a pre-booted guest of a config from the warm pool")
+            ("pool",      "Show the warm pool of pre-booted guests")
             ("list,l",    "List existing CiV guest")
+            ("monitor,m", "Stream state changes of CiV guests")
             ("version,v", "Show CiV vm-manager version")
             ("start-server",  "Start host server")
             ("stop-server",  "Stop host server")
@@ -281,19 +627,69 @@ class CivOptions final {
             return true;
         }
 
+        if (vm_.count("import")) {
+            return ImportGuest(vm_["import"].as<std::string>());
+        }
+
+        if (vm_.count("start") && vm_.count("async")) {
+            return RequestAsync(kCivMsgStartVmAsync, vm_["start"].as<std::string>());
+        }
+
+        if (vm_.count("stop") && vm_.count("async")) {
+            return RequestAsync(kCivMsgStopVmAsync, vm_["stop"].as<std::string>());
+        }
+
+        if (vm_.count("wait")) {
+            unsigned int timeout = vm_.count("timeout") ? vm_["timeout"].as<unsigned int>()
+                                                        : kCivMsgStartTimeout.count();
+            return WaitOperations(vm_["wait"].as<std::vector<uint64_t>>(), vm_.count("any") == 0, timeout);
+        }
+
         if (vm_.count("start")) {
-            return StartGuest(vm_["start"].as<std::string>());
+            return StartGuest(vm_["start"].as<std::string>(), vm_.count("restore") != 0);
+        }
+
+        if (vm_.count("start-batch")) {
+            unsigned int jobs = vm_.count("jobs") ? vm_["jobs"].as<unsigned int>() : kCivBatchDefaultParallel;
+            return StartGuests(vm_["start-batch"].as<std::vector<std::string>>(), jobs);
         }
 
         if (vm_.count("stop")) {
             return StopGuest(vm_["stop"].as<std::string>());
         }
 
+        if (vm_.count("save")) {
+            return SaveGuest(vm_["save"].as<std::string>());
+        }
+
+        if (vm_.count("pause")) {
+            return PauseGuests(vm_["pause"].as<std::vector<std::string>>(), true);
+        }
+
+        if (vm_.count("resume")) {
+            return PauseGuests(vm_["resume"].as<std::vector<std::string>>(), false);
+        }
+
         if (vm_.count("flash")) {
             VmFlasher f;
             return f.FlashGuest(vm_["flash"].as<std::string>());
         }
 
+        if (vm_.count("clone")) {
+            unsigned int count = vm_.count("count") ? vm_["count"].as<unsigned int>() : 1;
+            VmCloner cl;
+            std::vector<std::string> names;
+            bool ret = cl.CloneGuest(vm_["clone"].as<std::string>(), count, &names);
+            for (auto &n : names)
+                std::cout << n << std::endl;
+            return ret;
+        }
+
+        if (vm_.count("bench-disk")) {
+            unsigned int size = vm_.count("bench-size") ? vm_["bench-size"].as<unsigned int>() : 1024;
+            return BenchDiskImages(vm_["bench-disk"].as<std::string>(), size);
+        }
+
         if (vm_.count("update")) {
             return false;
         }
@@ -302,10 +698,26 @@ class CivOptions final {
             return GetGuestCid(vm_["get-cid"].as<std::string>());
         }
 
+        if (vm_.count("info")) {
+            return GetGuestInfo(vm_["info"].as<std::string>());
+        }
+
+        if (vm_.count("claim")) {
+            return ClaimGuest(vm_["claim"].as<std::string>());
+        }
+
+        if (vm_.count("pool")) {
+            return ShowPool();
+        }
+
         if (vm_.count("list")) {
             return ListGuest();
         }
 
+        if (vm_.count("monitor")) {
+            return MonitorGuests();
+        }
+
         return false;
     }
 
@@ -313,8 +725,10 @@ class CivOptions final {
     void PrintHelp(void) {
         std::cout << "Usage:\n";
         std::cout << "  vm-manager"
-                  << " [-c vm_name] [-b vm_name] [-q vm_name] [-f vm_name] [--get-cid vm_name]"
-                  << " [-l] [-v] [-h]\n";
+                  << " [-c vm_name] [-i vm_name] [-b vm_name] [--start-batch vm_name|dir ... [-j N]]"
+                  << " [-q vm_name] [--save vm_name] [-b vm_name --restore] [--pause vm_name ...] [--resume vm_name ...] [--async] [--wait op_id ... [--any] [--timeout secs]]"
+                  << " [-f vm_name] [--clone vm_name [-n N]] [--bench-disk dir [--bench-size MB]] [--get-cid vm_name] [--info vm_name] [--claim vm_name] [--pool]"
+                  << " [-l] [-m] [-v] [-h]\n";
         std::cout << "Options:\n";
 
         std::cout << cmdline_options_ << std::endl;